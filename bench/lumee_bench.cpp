@@ -0,0 +1,297 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Microbenchmarks for the core of Lumee, independent of the window. Each
+// result is printed as a JSON object on its own line:
+//
+//     {"name": "decode/jpeg/1920x1080", "ops": 12, "ns_per_op": 8112345}
+//
+//     lumee_bench [FILTER]
+//
+// Only benchmarks whose names contain FILTER are run.
+
+#include "image_list.h"
+#include "thumbnail_atlas.h"
+#include "utils.h"
+#include "work_queue.h"
+
+#include <gdkmm/pixbufloader.h>
+#include <gtkmm/main.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Each benchmark repeats until it has run for at least this long, in
+// microseconds.
+const gint64 MIN_TIME = 500000;
+
+const int NUM_QUEUE_ITEMS = 200000;
+const int NUM_LIST_ENTRIES = 100000;
+const int THUMBNAIL_SIZE = 96;
+
+const char* filter = "";
+
+bool is_selected(const std::string& name) {
+  return name.find(filter) != std::string::npos;
+}
+
+void report(const std::string& name, gint64 ops, gint64 elapsed) {
+  std::printf("{\"name\": \"%s\", \"ops\": %lld, \"ns_per_op\": %.0f}\n",
+              name.c_str(), static_cast<long long>(ops),
+              elapsed * 1000.0 / std::max<gint64>(ops, 1));
+  std::fflush(stdout);
+}
+
+// Calls `function` until `MIN_TIME` has passed, after a call to warm up. Each
+// call counts as `ops_per_call` operations.
+template <typename Function>
+void measure(const std::string& name, Function function,
+             int ops_per_call = 1) {
+  if (!is_selected(name))
+    return;
+  function();
+  gint64 ops = 0, start_time = g_get_monotonic_time(), elapsed = 0;
+  do {
+    function();
+    ops += ops_per_call;
+    elapsed = g_get_monotonic_time() - start_time;
+  } while (elapsed < MIN_TIME);
+  report(name, ops, elapsed);
+}
+
+// Tracks the items left in a run, so the main thread can wait for them.
+class Completion {
+ public:
+  void reset(int count) {
+    remaining.store(count, std::memory_order_relaxed);
+    finished = false;
+  }
+
+  void done() {
+    if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      Glib::Threads::Mutex::Lock lock(mutex);
+      finished = true;
+      cond.signal();
+    }
+  }
+
+  void wait() {
+    Glib::Threads::Mutex::Lock lock(mutex);
+    while (!finished)
+      cond.wait(mutex);
+  }
+
+ private:
+  std::atomic<int> remaining{0};
+  bool finished = false;
+  Glib::Threads::Mutex mutex;
+  Glib::Threads::Cond cond;
+};
+
+class EmptyItem : public WorkQueue::Item {
+ public:
+  virtual void run() { completion->done(); }
+  virtual void discard() { completion->done(); }
+
+  Completion* completion = nullptr;
+};
+
+// Pushes empty items from the main thread, so only the queue is measured.
+// Prefetch items are moved in batches, and can run on every thread.
+void bench_work_queue() {
+  std::vector<int> thread_counts = {1, int(g_get_num_processors())};
+  thread_counts.erase(std::unique(thread_counts.begin(), thread_counts.end()),
+                      thread_counts.end());
+  for (int num_threads : thread_counts) {
+    std::string name = "work_queue/push_pop/threads:" +
+        std::to_string(num_threads);
+    if (!is_selected(name))
+      continue;
+    WorkQueue queue(num_threads);
+    Completion completion;
+    std::vector<EmptyItem> items(NUM_QUEUE_ITEMS);
+    for (EmptyItem& item : items)
+      item.completion = &completion;
+
+    gint64 ops = 0, start_time = g_get_monotonic_time(), elapsed = 0;
+    do {
+      completion.reset(items.size());
+      for (EmptyItem& item : items)
+        queue.push(&item, WorkQueue::PRIORITY_PREFETCH);
+      completion.wait();
+      ops += items.size();
+      elapsed = g_get_monotonic_time() - start_time;
+    } while (elapsed < MIN_TIME);
+    report(name, ops, elapsed);
+  }
+}
+
+// Returns an image with smooth gradients and some noise, which compresses
+// roughly like a photo.
+Glib::RefPtr<Gdk::Pixbuf> create_image(int width, int height) {
+  Glib::RefPtr<Gdk::Pixbuf> pixbuf = Gdk::Pixbuf::create(
+      Gdk::COLORSPACE_RGB, false, 8, width, height);
+  std::minstd_rand random(1);
+  guint8* pixels = pixbuf->get_pixels();
+  for (int y = 0; y < height; ++y) {
+    guint8* p = pixels + y * pixbuf->get_rowstride();
+    for (int x = 0; x < width; ++x, p += 3) {
+      int noise = random() % 16;
+      p[0] = (x * 255 / width + noise) & 0xff;
+      p[1] = (y * 255 / height + noise) & 0xff;
+      p[2] = ((x + y) * 127 / (width + height) + noise) & 0xff;
+    }
+  }
+  return pixbuf;
+}
+
+// Decodes the same way as `ImageWorker`, and scales to a thumbnail the same
+// way as `ImageWorker::load_thumbnail()` does from a full image.
+void bench_decode_and_scale() {
+  const std::vector<std::pair<int, int>> sizes = {
+      {640, 480}, {1920, 1080}, {4000, 3000}};
+  for (const char* format : {"jpeg", "png"}) {
+    for (const std::pair<int, int>& size : sizes) {
+      std::string suffix = std::string(format) + "/" +
+          std::to_string(size.first) + "x" + std::to_string(size.second);
+      if (!is_selected("decode/" + suffix) && !is_selected("scale/" + suffix))
+        continue;
+      gchar* buffer = nullptr;
+      gsize buffer_size = 0;
+      create_image(size.first, size.second)->save_to_buffer(
+          buffer, buffer_size, format);
+
+      Glib::RefPtr<Gdk::Pixbuf> image;
+      measure("decode/" + suffix, [&]() {
+        Glib::RefPtr<Gdk::PixbufLoader> loader = Gdk::PixbufLoader::create();
+        loader->write(reinterpret_cast<const guint8*>(buffer), buffer_size);
+        loader->close();
+        image = loader->get_pixbuf();
+      });
+      g_free(buffer);
+      if (!image)
+        continue;
+      double factor = Dimensions(image).fit(THUMBNAIL_SIZE);
+      measure("scale/" + suffix, [&]() {
+        ThumbnailAtlas::get_default().scale(
+            image, std::max(1.0, std::round(image->get_width() * factor)),
+            std::max(1.0, std::round(image->get_height() * factor)));
+      });
+    }
+  }
+}
+
+// Returns file names in random order, like a camera's numbering interleaved
+// with edited copies.
+std::vector<std::string> create_names() {
+  std::vector<std::string> names;
+  for (int i = 0; i < NUM_LIST_ENTRIES; ++i) {
+    names.push_back("IMG_" + std::to_string(i) + ".jpg");
+    if (i % 10 == 0)
+      names.back().insert(names.back().size() - 4, " (edited)");
+  }
+  std::shuffle(names.begin(), names.end(), std::minstd_rand(1));
+  return names;
+}
+
+// Fills rows like `ImageList` does for each enumerated file.
+void fill_list(const Glib::RefPtr<ImageList>& list,
+               const std::vector<std::string>& names) {
+  for (const std::string& name : names) {
+    Gtk::TreeModel::Row row = *list->append();
+    row[list->columns.path] = "/pictures/" + name;
+    row[list->columns.time_modified] = 1400000000;
+    row[list->columns.display_name_collation_key] =
+        collate_key_for_filename(name);
+  }
+}
+
+// Ingestion is into a sorted list, as in the window. Sorting is measured
+// separately, as when the sort order is changed.
+void bench_list() {
+  std::vector<std::string> names = create_names();
+  std::string count = std::to_string(NUM_LIST_ENTRIES);
+  measure("list/ingest_sorted/" + count, [&]() {
+    Glib::RefPtr<ImageList> list = ImageList::create();
+    list->set_thumbnails_enabled(false);
+    list->set_sort_column(list->columns.display_name_collation_key,
+                          Gtk::SORT_ASCENDING);
+    fill_list(list, names);
+  });
+  if (!is_selected("list/sort/" + count))
+    return;
+  gint64 ops = 0, elapsed = 0;
+  do {
+    Glib::RefPtr<ImageList> list = ImageList::create();
+    list->set_thumbnails_enabled(false);
+    fill_list(list, names);
+    gint64 start_time = g_get_monotonic_time();
+    list->set_sort_column(list->columns.display_name_collation_key,
+                          Gtk::SORT_ASCENDING);
+    elapsed += g_get_monotonic_time() - start_time;
+    ++ops;
+  } while (elapsed < MIN_TIME);
+  report("list/sort/" + count, ops, elapsed);
+}
+
+// Scales the same way as `ImageView` does when zooming.
+void bench_zoom() {
+  Glib::RefPtr<Gdk::Pixbuf> image = create_image(4000, 3000);
+  double fit_factor = Dimensions(image).fit(Dimensions(1920, 1080));
+  for (double factor : {0.25, 0.5, fit_factor, 2.0}) {
+    char name[64];
+    std::snprintf(name, sizeof name, "zoom/4000x3000/%.3f", factor);
+    measure(name, [&]() {
+      image->scale_simple(std::round(image->get_width() * factor),
+                          std::round(image->get_height() * factor),
+                          Gdk::INTERP_BILINEAR);
+    });
+  }
+}
+
+void bench_fit() {
+  volatile double sink = 0.0;
+  const int count = 1000;
+  measure("dimensions/fit", [&]() {
+    for (int i = 1; i <= count; ++i)
+      sink = Dimensions(4000 + i, 3000).fit(Dimensions(1920, 1080 + i));
+  }, count);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc > 2) {
+    std::fprintf(stderr, "Usage: %s [FILTER]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (argc > 1)
+    filter = argv[1];
+  Gtk::Main::init_gtkmm_internals();
+
+  bench_work_queue();
+  bench_decode_and_scale();
+  bench_list();
+  bench_zoom();
+  bench_fit();
+  return EXIT_SUCCESS;
+}
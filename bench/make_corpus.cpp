@@ -0,0 +1,359 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Generates a deterministic corpus of images for benchmarks and performance
+// tests:
+//
+//   images/  Each writable format at sizes from 64 pixels up to 12 MP (or
+//            100 MP with `--full`), and JPEGs with and without an EXIF
+//            thumbnail.
+//   folder/  10,000 small JPEGs (or 100,000 with `--full`), for opening big
+//            folders. They're hard links to one file where possible.
+//
+//     make_corpus [--full] DIR
+//
+// Nothing is done if DIR already holds a corpus made with the same options.
+
+#include <gdkmm/pixbuf.h>
+#include <glib/gstdio.h>
+#include <glibmm/fileutils.h>
+#include <glibmm/miscutils.h>
+#include <gtkmm/main.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// Bumped whenever the corpus changes, so old corpora are regenerated.
+const int CORPUS_VERSION = 2;
+
+const char* const FORMATS[] = {"jpeg", "png", "gif", "tiff", "webp"};
+const char* const EXTENSIONS[] = {"jpg", "png", "gif", "tif", "webp"};
+
+// Largest code a GIF's LZW data can use, which has 12 bits.
+const int GIF_MAX_CODE = 4095;
+
+const int NUM_EXIF_IMAGES = 20;
+const int EXIF_THUMBNAIL_WIDTH = 160;
+const int EXIF_THUMBNAIL_HEIGHT = 120;
+
+// Returns an image with smooth gradients and some noise, which compresses
+// roughly like a photo. The same seed always gives the same image.
+Glib::RefPtr<Gdk::Pixbuf> create_image(int width, int height,
+                                       unsigned seed) {
+  Glib::RefPtr<Gdk::Pixbuf> pixbuf = Gdk::Pixbuf::create(
+      Gdk::COLORSPACE_RGB, false, 8, width, height);
+  std::minstd_rand random(seed);
+  int offset = random() % 256;
+  guint8* pixels = pixbuf->get_pixels();
+  for (int y = 0; y < height; ++y) {
+    guint8* p = pixels + std::size_t(y) * pixbuf->get_rowstride();
+    for (int x = 0; x < width; ++x, p += 3) {
+      int noise = random() % 16;
+      p[0] = (x * 255 / width + offset + noise) & 0xff;
+      p[1] = (y * 255 / height + noise) & 0xff;
+      p[2] = (int(gint64(x + y) * 127 / (width + height)) + noise) & 0xff;
+    }
+  }
+  return pixbuf;
+}
+
+// GIFs are written here, since gdk-pixbuf can read them but not write them.
+bool is_writable(const std::string& format) {
+  if (format == "gif")
+    return true;
+  for (const Gdk::PixbufFormat& pixbuf_format : Gdk::Pixbuf::get_formats()) {
+    if (pixbuf_format.get_name() == format)
+      return pixbuf_format.is_writable();
+  }
+  return false;
+}
+
+void put_u16(std::string& data, guint16 value) {
+  data += char(value & 0xff);
+  data += char(value >> 8);
+}
+
+void put_u32(std::string& data, guint32 value) {
+  put_u16(data, value & 0xffff);
+  put_u16(data, value >> 16);
+}
+
+// Packs LZW codes into a GIF's data sub-blocks, least significant bit first.
+class GifCodeWriter {
+ public:
+  explicit GifCodeWriter(std::string& data) : data(data) {}
+
+  void put(int code, int bits) {
+    buffer |= guint32(code) << buffer_bits;
+    for (buffer_bits += bits; buffer_bits >= 8; buffer_bits -= 8) {
+      put_byte(buffer & 0xff);
+      buffer >>= 8;
+    }
+  }
+
+  // Writes what's left, and the block terminator.
+  void finish() {
+    if (buffer_bits)
+      put_byte(buffer & 0xff);
+    flush_block();
+    data += '\0';
+  }
+
+ private:
+  void put_byte(guint8 byte) {
+    block += char(byte);
+    if (block.size() == 255)
+      flush_block();
+  }
+
+  void flush_block() {
+    if (block.empty())
+      return;
+    data += char(block.size());
+    data += block;
+    block.clear();
+  }
+
+  std::string& data;
+  std::string block;
+  guint32 buffer = 0;
+  int buffer_bits = 0;
+};
+
+// Writes a GIF with a fixed palette of 3 bits of red and green and 2 of
+// blue. Codes grow and the table is cleared at the same points as in giflib.
+std::string encode_gif(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) {
+  int width = pixbuf->get_width(), height = pixbuf->get_height(),
+      channels = pixbuf->get_n_channels();
+  std::string data = "GIF89a";
+  put_u16(data, width);
+  put_u16(data, height);
+  data += char(0xf7);  // A global table of 256 colors.
+  data += '\0';
+  data += '\0';
+  for (int i = 0; i < 256; ++i) {
+    data += char((i >> 5) * 255 / 7);
+    data += char(((i >> 2) & 7) * 255 / 7);
+    data += char((i & 3) * 255 / 3);
+  }
+  data += ',';
+  put_u16(data, 0);
+  put_u16(data, 0);
+  put_u16(data, width);
+  put_u16(data, height);
+  data += '\0';
+  data += char(8);  // Minimum code size.
+
+  const int CLEAR_CODE = 256, END_CODE = 257;
+  // Codes by prefix code and then byte, and the entries to clear.
+  std::vector<gint16> codes((GIF_MAX_CODE + 1) * 256, -1);
+  std::vector<int> used;
+  int next_code = END_CODE + 1, bits = 9, prefix = -1;
+  GifCodeWriter writer(data);
+  auto put = [&](int code) {
+    writer.put(code, bits);
+    if (next_code >= 1 << bits && bits < 12)
+      ++bits;
+  };
+  put(CLEAR_CODE);
+  for (int y = 0; y < height; ++y) {
+    const guint8* p = pixbuf->get_pixels() +
+        std::size_t(y) * pixbuf->get_rowstride();
+    for (int x = 0; x < width; ++x, p += channels) {
+      int index = (p[0] & 0xe0) | ((p[1] >> 3) & 0x1c) | (p[2] >> 6);
+      if (prefix < 0) {
+        prefix = index;
+        continue;
+      }
+      int key = prefix * 256 + index;
+      if (codes[key] >= 0) {
+        prefix = codes[key];
+        continue;
+      }
+      put(prefix);
+      if (next_code >= GIF_MAX_CODE) {
+        put(CLEAR_CODE);
+        for (int used_key : used)
+          codes[used_key] = -1;
+        used.clear();
+        next_code = END_CODE + 1;
+        bits = 9;
+      } else {
+        codes[key] = next_code++;
+        used.push_back(key);
+      }
+      prefix = index;
+    }
+  }
+  put(prefix);
+  put(END_CODE);
+  writer.finish();
+  data += ';';
+  return data;
+}
+
+std::string encode(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                   const std::string& format) {
+  if (format == "gif")
+    return encode_gif(pixbuf);
+  gchar* buffer = nullptr;
+  gsize size = 0;
+  pixbuf->save_to_buffer(buffer, size, format);
+  std::string data(buffer, size);
+  g_free(buffer);
+  return data;
+}
+
+// Adds an APP1 segment after the SOI marker with an empty IFD0, and an IFD1
+// that points to a JPEG thumbnail, the way cameras store them.
+std::string add_exif_thumbnail(const std::string& jpeg,
+                               const std::string& thumbnail) {
+  // IFD1 has three entries, and the thumbnail follows it.
+  const guint32 IFD1_OFFSET = 14, THUMBNAIL_OFFSET = IFD1_OFFSET + 42;
+  std::string tiff = "II";
+  put_u16(tiff, 42);
+  put_u32(tiff, 8);  // IFD0
+  put_u16(tiff, 0);
+  put_u32(tiff, IFD1_OFFSET);
+  put_u16(tiff, 3);
+  put_u16(tiff, 0x0103);  // Compression: JPEG
+  put_u16(tiff, 3);
+  put_u32(tiff, 1);
+  put_u32(tiff, 6);
+  put_u16(tiff, 0x0201);  // JPEGInterchangeFormat
+  put_u16(tiff, 4);
+  put_u32(tiff, 1);
+  put_u32(tiff, THUMBNAIL_OFFSET);
+  put_u16(tiff, 0x0202);  // JPEGInterchangeFormatLength
+  put_u16(tiff, 4);
+  put_u32(tiff, 1);
+  put_u32(tiff, thumbnail.size());
+  put_u32(tiff, 0);
+  tiff += thumbnail;
+
+  std::string payload = std::string("Exif\0\0", 6) + tiff;
+  std::size_t length = payload.size() + 2;
+  std::string segment = "\xff\xe1";
+  segment += char(length >> 8);
+  segment += char(length & 0xff);
+  return jpeg.substr(0, 2) + segment + payload + jpeg.substr(2);
+}
+
+void write_file(const std::string& filename, const std::string& data) {
+  Glib::file_set_contents(filename, data.data(), data.size());
+}
+
+// Removes the files left in a folder by another corpus.
+void clear_dir(const std::string& dir) {
+  try {
+    Glib::Dir entries(dir);
+    for (const std::string& name : entries)
+      g_remove(Glib::build_filename(dir, name).c_str());
+  } catch (const Glib::FileError&) {}
+}
+
+// Every format is written, so runs on different systems can be compared.
+// Returns false if one can't be.
+bool make_images(const std::string& dir, bool full) {
+  std::vector<std::pair<int, int>> sizes = {
+      {64, 64}, {640, 480}, {1920, 1080}, {4000, 3000}};
+  if (full)
+    sizes.emplace_back(12000, 8334);
+  unsigned seed = 1;
+  for (std::size_t f = 0; f < G_N_ELEMENTS(FORMATS); ++f) {
+    if (!is_writable(FORMATS[f])) {
+      std::fprintf(stderr, "make_corpus: can't write %s; is its "
+                   "gdk-pixbuf loader installed?\n", FORMATS[f]);
+      return false;
+    }
+    for (const std::pair<int, int>& size : sizes) {
+      std::string name = std::string(FORMATS[f]) + "-" +
+          std::to_string(size.first) + "x" + std::to_string(size.second) +
+          "." + EXTENSIONS[f];
+      write_file(Glib::build_filename(dir, name), encode(
+          create_image(size.first, size.second, seed++), FORMATS[f]));
+    }
+  }
+
+  for (int i = 0; i < NUM_EXIF_IMAGES; ++i) {
+    Glib::RefPtr<Gdk::Pixbuf> image = create_image(2000, 1500, seed++);
+    std::string jpeg = encode(image, "jpeg"), name = "exif-";
+    if (i % 2) {
+      jpeg = add_exif_thumbnail(jpeg, encode(image->scale_simple(
+          EXIF_THUMBNAIL_WIDTH, EXIF_THUMBNAIL_HEIGHT, Gdk::INTERP_BILINEAR),
+          "jpeg"));
+      name += "thumbnail-";
+    }
+    write_file(Glib::build_filename(dir, name + std::to_string(i) + ".jpg"),
+               jpeg);
+  }
+  return true;
+}
+
+void make_folder(const std::string& dir, int count) {
+  std::string jpeg = encode(create_image(64, 48, 0), "jpeg");
+  std::string first = Glib::build_filename(dir, "img-0.jpg");
+  write_file(first, jpeg);
+  for (int i = 1; i < count; ++i) {
+    std::string filename = Glib::build_filename(
+        dir, "img-" + std::to_string(i) + ".jpg");
+    if (link(first.c_str(), filename.c_str()) != 0)
+      write_file(filename, jpeg);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool full = argc == 3 && std::strcmp(argv[1], "--full") == 0;
+  if (argc != 2 && !full) {
+    std::fprintf(stderr, "Usage: %s [--full] DIR\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  Gtk::Main::init_gtkmm_internals();
+
+  std::string dir = argv[argc - 1],
+              stamp_filename = Glib::build_filename(dir, "corpus-stamp"),
+              stamp = std::to_string(CORPUS_VERSION) + (full ? " full\n" :
+                                                        " standard\n");
+  try {
+    if (Glib::file_get_contents(stamp_filename) == stamp)
+      return EXIT_SUCCESS;
+  } catch (const Glib::FileError&) {}
+
+  std::string images_dir = Glib::build_filename(dir, "images"),
+              folder_dir = Glib::build_filename(dir, "folder");
+  try {
+    for (const std::string& subdir : {images_dir, folder_dir}) {
+      clear_dir(subdir);
+      g_mkdir_with_parents(subdir.c_str(), 0755);
+    }
+    if (!make_images(images_dir, full))
+      return EXIT_FAILURE;
+    make_folder(folder_dir, full ? 100000 : 10000);
+    write_file(stamp_filename, stamp);
+  } catch (const Glib::Error& error) {
+    std::fprintf(stderr, "make_corpus: %s\n", error.what().c_str());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
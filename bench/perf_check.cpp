@@ -0,0 +1,107 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Runs the performance scenarios against a corpus made by `make_corpus`, and
+// fails if any result exceeds its threshold:
+//
+//   open_ms           Opening the corpus's big folder.
+//   thumbnail_p95_ms  95th percentile time to load a thumbnail, several at a
+//                     time, from the corpus's images.
+//   switch_p95_ms     95th percentile time to load an image, one at a time.
+//   rss_mb            Peak resident memory.
+//
+//     perf_check CORPUS_DIR [NAME=VALUE...]
+//
+// Results without a threshold are only printed. Loading a thumbnail or image
+// that fails is always an error.
+
+#include "benchmark.h"
+
+#include <glibmm/miscutils.h>
+#include <gtkmm/main.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+
+namespace {
+
+std::map<std::string, double> thresholds;
+bool passed = true;
+
+void check(const std::string& name, double value) {
+  auto found = thresholds.find(name);
+  if (found == thresholds.end()) {
+    std::printf("%-16s %10.1f\n", name.c_str(), value);
+    return;
+  }
+  bool ok = value <= found->second;
+  std::printf("%-16s %10.1f  limit %10.1f  %s\n", name.c_str(), value,
+              found->second, ok ? "PASS" : "FAIL");
+  passed = passed && ok;
+}
+
+bool run(Benchmark& benchmark, const std::string& folder) {
+  if (benchmark.run(std::cout))
+    return true;
+  std::fprintf(stderr, "perf_check: can't open %s\n", folder.c_str());
+  return false;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s CORPUS_DIR [NAME=VALUE...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  for (int i = 2; i < argc; ++i) {
+    std::string argument = argv[i];
+    std::size_t equals = argument.find('=');
+    if (equals == std::string::npos) {
+      std::fprintf(stderr, "perf_check: bad threshold '%s'\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+    thresholds[argument.substr(0, equals)] =
+        std::atof(argument.substr(equals + 1).c_str());
+  }
+  Gtk::Main::init_gtkmm_internals();
+
+  std::string folder = Glib::build_filename(argv[1], "folder"),
+              images = Glib::build_filename(argv[1], "images");
+  Benchmark open_benchmark(folder, true);
+  if (!run(open_benchmark, folder))
+    return EXIT_FAILURE;
+  Benchmark load_benchmark(images);
+  if (!run(load_benchmark, images))
+    return EXIT_FAILURE;
+
+  check("open_ms",
+        open_benchmark.get_seconds(Benchmark::STAGE_ENUMERATE) * 1000.0);
+  check("thumbnail_p95_ms",
+        load_benchmark.get_latency(Benchmark::STAGE_THUMBNAILS, 95.0));
+  check("switch_p95_ms",
+        load_benchmark.get_latency(Benchmark::STAGE_IMAGES, 95.0));
+  check("rss_mb", Benchmark::get_peak_rss() / double(1 << 20));
+  int failures = load_benchmark.get_failures(Benchmark::STAGE_THUMBNAILS) +
+      load_benchmark.get_failures(Benchmark::STAGE_IMAGES);
+  if (failures) {
+    std::printf("%d files failed to load  FAIL\n", failures);
+    passed = false;
+  }
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Runs the performance scenarios for `make check`. The corpus is generated
+# once and reused. Thumbnails and folder snapshots are cached in a fresh
+# folder, so every run measures cold loading.
+#
+# `PERF_THRESHOLDS` holds the thresholds passed to `perf_check`, and
+# `LUMEE_CORPUS` can point to an existing corpus, such as one made with
+# `make_corpus --full`.
+
+set -e
+corpus=$LUMEE_CORPUS
+if [ -z "$corpus" ]; then
+  corpus=bench/corpus
+  bench/make_corpus "$corpus"
+fi
+
+XDG_CACHE_HOME=$(pwd)/bench/cache
+rm -rf "$XDG_CACHE_HOME"
+export XDG_CACHE_HOME
+exec bench/perf_check "$corpus" $PERF_THRESHOLDS
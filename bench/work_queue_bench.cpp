@@ -0,0 +1,190 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Measures `WorkQueue` throughput with many small items and several producer
+// threads, as the pool grows. A queue guarded by a single mutex, as
+// `WorkQueue` used to be, is measured alongside for comparison.
+//
+//     work_queue_bench [MAX_THREADS [NUM_ITEMS [PRIORITY]]]
+//
+// `PRIORITY` is a `WorkQueue::Priority` value. It's prefetch by default, the
+// most urgent class that's batched and can use every thread.
+
+#include "work_queue.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+namespace {
+
+const int NUM_PRODUCERS = 4;
+
+// Iterations of busy work per item, about a microsecond.
+const int WORK_ITERATIONS = 500;
+
+// Tracks the items left in a run, so the main thread can wait for them.
+class Completion {
+ public:
+  explicit Completion(int count) : remaining(count) {}
+
+  void done() {
+    if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      Glib::Threads::Mutex::Lock lock(mutex);
+      finished = true;
+      cond.signal();
+    }
+  }
+
+  void wait() {
+    Glib::Threads::Mutex::Lock lock(mutex);
+    while (!finished)
+      cond.wait(mutex);
+  }
+
+ private:
+  std::atomic<int> remaining;
+  bool finished = false;
+  Glib::Threads::Mutex mutex;
+  Glib::Threads::Cond cond;
+};
+
+class BenchItem : public WorkQueue::Item {
+ public:
+  virtual void run() {
+    volatile guint32 x = 1;
+    for (int i = 0; i < WORK_ITERATIONS; ++i)
+      x = x * 1664525 + 1013904223;
+    completion->done();
+  }
+  virtual void discard() { completion->done(); }
+
+  Completion* completion = nullptr;
+};
+
+// Thread pool sharing one queue, one mutex and one condition variable.
+class MutexQueue {
+ public:
+  explicit MutexQueue(int num_threads) {
+    for (int i = 0; i < num_threads; ++i)
+      threads.push_back(Glib::Threads::Thread::create([this]() { run(); }));
+  }
+
+  ~MutexQueue() {
+    {
+      Glib::Threads::Mutex::Lock lock(mutex);
+      stopping = true;
+    }
+    cond.broadcast();
+    for (Glib::Threads::Thread* thread : threads)
+      thread->join();
+  }
+
+  // The priority is ignored.
+  void push(WorkQueue::Item* item, WorkQueue::Priority) {
+    {
+      Glib::Threads::Mutex::Lock lock(mutex);
+      items.push_back(item);
+    }
+    cond.signal();
+  }
+
+ private:
+  void run() {
+    while (true) {
+      WorkQueue::Item* item = nullptr;
+      {
+        Glib::Threads::Mutex::Lock lock(mutex);
+        while (!stopping && items.empty())
+          cond.wait(mutex);
+        if (stopping)
+          break;
+        item = items.front();
+        items.pop_front();
+      }
+      item->run();
+    }
+  }
+
+  std::vector<Glib::Threads::Thread*> threads;
+  Glib::Threads::Mutex mutex;
+  Glib::Threads::Cond cond;
+  std::deque<WorkQueue::Item*> items;
+  bool stopping = false;
+};
+
+// Pushes every item from `NUM_PRODUCERS` threads into `queue`, waits for them
+// to finish and returns the throughput in items per second.
+template <typename Queue>
+double measure(Queue& queue, std::vector<BenchItem>& items,
+               WorkQueue::Priority priority) {
+  Completion completion(items.size());
+  for (BenchItem& item : items)
+    item.completion = &completion;
+
+  gint64 start_time = g_get_monotonic_time();
+  std::vector<Glib::Threads::Thread*> producers;
+  std::size_t slice = items.size() / NUM_PRODUCERS;
+  for (int p = 0; p < NUM_PRODUCERS; ++p) {
+    std::size_t first = p * slice,
+                last = p == NUM_PRODUCERS - 1 ? items.size() : first + slice;
+    producers.push_back(Glib::Threads::Thread::create(
+        [&queue, &items, first, last, priority]() {
+          for (std::size_t i = first; i < last; ++i)
+            queue.push(&items[i], priority);
+        }));
+  }
+  for (Glib::Threads::Thread* producer : producers)
+    producer->join();
+  completion.wait();
+  gint64 elapsed = g_get_monotonic_time() - start_time;
+  return items.size() * 1e6 / std::max<gint64>(elapsed, 1);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int max_threads = argc > 1 ? std::atoi(argv[1]) : 64;
+  int num_items = argc > 2 ? std::atoi(argv[2]) : 1000000;
+  int priority = argc > 3 ? std::atoi(argv[3]) : WorkQueue::PRIORITY_PREFETCH;
+  if (max_threads < 1 || num_items < NUM_PRODUCERS || priority < 0 ||
+      priority >= WorkQueue::NUM_PRIORITIES) {
+    std::fprintf(stderr, "Usage: %s [MAX_THREADS [NUM_ITEMS [PRIORITY]]]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::printf("%d items, %d producers, %u processors, priority %d\n",
+              num_items, NUM_PRODUCERS, g_get_num_processors(), priority);
+  std::printf("%8s %16s %16s %8s\n", "threads", "pool items/s",
+              "mutex items/s", "ratio");
+  std::vector<BenchItem> items(num_items);
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    double pool_rate, mutex_rate;
+    {
+      WorkQueue queue(num_threads);
+      pool_rate = measure(queue, items, WorkQueue::Priority(priority));
+    }
+    {
+      MutexQueue queue(num_threads);
+      mutex_rate = measure(queue, items, WorkQueue::Priority(priority));
+    }
+    std::printf("%8d %16.0f %16.0f %8.2f\n", num_threads, pool_rate,
+                mutex_rate, pool_rate / mutex_rate);
+  }
+  return EXIT_SUCCESS;
+}
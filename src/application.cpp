@@ -14,8 +14,13 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "application.h"
+#include "benchmark.h"
+#include "stats.h"
+#include "thumbnail_cache.h"
+#include "trace.h"
 
 #include <giomm/menu.h>
+#include <glibmm/fileutils.h>
 #include <glibmm/i18n.h>
 #include <glibmm/optioncontext.h>
 #include <glibmm/miscutils.h>
@@ -24,6 +29,9 @@
 #include <gtkmm/settings.h>
 
 #include <iostream>
+#include <map>
+
+const char* const Application::RESOURCE_PATH = "/com/github/bmars/Lumee/";
 
 Application::~Application() {
   delete main_window;
@@ -43,7 +51,9 @@ Application::Application()
 bool Application::local_command_line_vfunc(char**& argv, int& exit_status) {
   Glib::OptionContext context("[FOLDER | FILE]");
   Glib::OptionGroup group("", "");
-  Glib::OptionGroup group_gtk(gtk_get_option_group(true));
+  // The display is opened at startup instead, so benchmarks can run without
+  // one.
+  Glib::OptionGroup group_gtk(gtk_get_option_group(false));
   context.set_main_group(group);
   context.add_group(group_gtk);
 
@@ -53,6 +63,22 @@ bool Application::local_command_line_vfunc(char**& argv, int& exit_status) {
   entry_version.set_description(_("Show the version number"));
   group.add_entry(entry_version, show_version);
 
+  std::string benchmark_folder;
+  Glib::OptionEntry entry_benchmark;
+  entry_benchmark.set_long_name("benchmark");
+  entry_benchmark.set_description(
+      _("Measure loading the images in a folder, and print the results"));
+  entry_benchmark.set_arg_description(_("FOLDER"));
+  group.add_entry_filename(entry_benchmark, benchmark_folder);
+
+  std::string trace_file;
+  Glib::OptionEntry entry_trace;
+  entry_trace.set_long_name("trace");
+  entry_trace.set_description(
+      _("Record a trace, and write it to a file on exit"));
+  entry_trace.set_arg_description(_("FILE"));
+  group.add_entry_filename(entry_trace, trace_file);
+
   int argc = g_strv_length(argv);
   try {
     context.parse(argc, argv);
@@ -64,18 +90,38 @@ bool Application::local_command_line_vfunc(char**& argv, int& exit_status) {
     exit_status = EXIT_FAILURE;
     return true;
   }
+  if (!trace_file.empty())
+    Trace::start(trace_file);
+  if (argc > 1)
+    startup_file = Gio::File::create_for_commandline_arg(argv[1])->get_path();
   if (show_version) {
     std::cout << PACKAGE_NAME << " " << PACKAGE_VERSION << std::endl;
     return true;
   }
+  if (!benchmark_folder.empty()) {
+    if (!Benchmark(benchmark_folder).run(std::cout)) {
+      std::cerr << argv[0] << ": "
+                << Glib::ustring::compose(_("Can't open folder '%1'"),
+                                          benchmark_folder)
+                << std::endl;
+      exit_status = EXIT_FAILURE;
+    }
+    return true;
+  }
   return false;
 }
 
 void Application::on_startup() {
   Gtk::Application::on_startup();
+  ImageList::load_formats_async();
   add_action("about", sigc::mem_fun(*this, &Application::show_about_dialog));
   add_action("quit", sigc::mem_fun(*this, &Application::hide_all_windows));
+  stats_action = Gio::SimpleAction::create("stats", get_stats_state());
+  stats_action->signal_activate().connect(sigc::hide(
+      sigc::mem_fun(*this, &Application::update_stats_action)));
+  add_action(stats_action);
 
+  load_startup_file();
   Gtk::Window::set_default_icon_name("image-x-generic");
   Gtk::Settings::get_default()->
       property_gtk_application_prefer_dark_theme() = true;
@@ -97,15 +143,24 @@ void Application::on_startup() {
   add_accelerator("<Primary>0", "win.zoom-normal");
   add_accelerator("f", "win.zoom-to-fit", g_variant_new_string("fit-best"));
   add_accelerator("w", "win.zoom-to-fit", g_variant_new_string("fit-width"));
+  add_accelerator("<Primary>l", "win.view-mode", g_variant_new_string("list"));
+  add_accelerator("<Primary>g", "win.view-mode", g_variant_new_string("grid"));
+  add_accelerator("F5", "win.slideshow");
+  add_accelerator("F12", "win.show-stats");
+
+  ThumbnailCache::remove_old_thumbnails_async();
 }
 
 int Application::on_command_line(
     const Glib::RefPtr<Gio::ApplicationCommandLine>& command_line) {
   int argc = 0;
   char** argv = command_line->get_arguments(argc);
-  if (argc > 1)
-    open(command_line->create_file_for_arg(argv[1]));
-  else if (!command_line->is_remote())
+  if (argc > 1) {
+    Glib::RefPtr<Gio::File> file = command_line->create_file_for_arg(argv[1]);
+    main_window->open(file, startup_file_loading &&
+                            file->get_path() == startup_file);
+    startup_file_loading = false;
+  } else if (!command_line->is_remote())
     open(Gio::File::create_for_path(Glib::get_user_special_dir(
         G_USER_DIRECTORY_PICTURES)));
   g_strfreev(argv);
@@ -118,18 +173,33 @@ void Application::on_open(const type_vec_files& files,
   main_window->open(files[0]);
 }
 
+// This only runs in the primary instance, so a file that's passed on to a
+// running instance isn't decoded twice.
+void Application::load_startup_file() {
+  if (startup_file.empty() ||
+      !Glib::file_test(startup_file, Glib::FILE_TEST_IS_REGULAR))
+    return;
+  startup_file_loading = true;
+  startup_worker.load([this](const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                             const std::string& path) {
+                        main_window->show_early_image(pixbuf, path);
+                      }, startup_file);
+}
+
+// The files are compiled into the program as resources. gtkmm 3.10 can't load
+// CSS from a resource path, so it's loaded from a resource URI.
 void Application::load_ui() {
-  std::string data_dir = RuntimeInfo::get_data_dir();
   Glib::RefPtr<Gtk::Builder> builder = Gtk::Builder::create();
-  builder->add_from_file(Glib::build_filename(data_dir, "app_menu.ui"));
+  builder->add_from_resource(Glib::ustring(RESOURCE_PATH) + "app_menu.ui");
   set_app_menu(Glib::RefPtr<Gio::Menu>::cast_dynamic(builder->get_object(
       "app-menu")));
-  builder->add_from_file(Glib::build_filename(data_dir, "main.ui"));
+  builder->add_from_resource(Glib::ustring(RESOURCE_PATH) + "main.ui");
   builder->get_widget_derived("main-window", main_window);
   add_window(*main_window);
 
   Glib::RefPtr<Gtk::CssProvider> css_provider = Gtk::CssProvider::create();
-  css_provider->load_from_path(Glib::build_filename(data_dir, "style.css"));
+  css_provider->load_from_file(Gio::File::create_for_uri(
+      std::string("resource://") + RESOURCE_PATH + "style.css"));
   Gtk::StyleContext::add_provider_for_screen(
       Gdk::Screen::get_default(), css_provider,
       GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
@@ -159,3 +229,18 @@ void Application::hide_all_windows() {
   for (Gtk::Window* window : get_windows())
     window->hide();
 }
+
+// Activating the action is what refreshes it, so its state isn't rebuilt
+// when nothing reads it.
+void Application::update_stats_action() {
+  stats_action->set_state(get_stats_state());
+}
+
+// static
+Glib::VariantBase Application::get_stats_state() {
+  std::map<Glib::ustring, double> values;
+  for (const std::pair<std::string, double>& value :
+       Stats::get_default().get_values())
+    values[value.first] = value.second;
+  return Glib::Variant<std::map<Glib::ustring, double>>::create(values);
+}
@@ -19,6 +19,7 @@
 #include "main_window.h"
 #include "utils.h"
 
+#include <giomm/simpleaction.h>
 #include <gtkmm/aboutdialog.h>
 #include <gtkmm/application.h>
 
@@ -41,17 +42,36 @@ class Application : public Gtk::Application {
   virtual void on_open(const type_vec_files& files, const Glib::ustring& hint);
 
  private:
+  // Path of the application's resources.
+  static const char* const RESOURCE_PATH;
+
   // Loads the UI and CSS at startup.
   void load_ui();
 
+  // Starts loading the image of a file given on the command line, so it
+  // decodes while the UI is loaded.
+  void load_startup_file();
+
   // Shows a dialog with information about the application.
   void show_about_dialog();
 
   // Hides all windows, causing the application to quit.
   void hide_all_windows();
 
+  // Refreshes the state of the "stats" action, which holds the statistics
+  // counters for other processes to read over D-Bus.
+  void update_stats_action();
+  static Glib::VariantBase get_stats_state();
+
   MainWindow* main_window = nullptr;
   std::unique_ptr<Gtk::AboutDialog> about_dialog;
+  Glib::RefPtr<Gio::SimpleAction> stats_action;
+
+  // File given on the command line, and whether its image is loading in
+  // `startup_worker`.
+  std::string startup_file;
+  bool startup_file_loading = false;
+  ImageWorker startup_worker;
 };
 
 #endif  // LUMEE_APPLICATION_H
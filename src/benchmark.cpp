@@ -0,0 +1,263 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "benchmark.h"
+#include "stats.h"
+#include "thumbnail_atlas.h"
+#include "utils.h"
+
+#include <giomm/file.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sys/resource.h>
+
+const int Benchmark::MAX_THUMBNAILS_LOADING = 16;
+const std::size_t Benchmark::MAX_THUMBNAILS_KEPT = 2000;
+
+Benchmark::Benchmark(const std::string& folder_path, bool enumerate_only)
+    : folder_path(folder_path), enumerate_only(enumerate_only) {}
+
+bool Benchmark::run(std::ostream& output) {
+  if (RuntimeInfo::get_start_time())
+    startup_time = g_get_monotonic_time() - RuntimeInfo::get_start_time();
+  ImageList::load_formats_async();
+  main_loop = Glib::MainLoop::create();
+  image_list = ImageList::create();
+  image_list->set_thumbnails_enabled(false);
+
+  stages[STAGE_ENUMERATE].start_time = g_get_monotonic_time();
+  image_list->open_folder(
+      sigc::mem_fun(*this, &Benchmark::on_folder_ready),
+      Gio::File::create_for_path(folder_path));
+  main_loop->run();
+  if (opened)
+    print_results(output);
+  return opened;
+}
+
+double Benchmark::get_seconds(StageKind kind) const {
+  return (stages[kind].end_time - stages[kind].start_time) / 1e6;
+}
+
+// Nearest-rank percentile.
+double Benchmark::get_latency(StageKind kind, double percentile) const {
+  const std::vector<gint64>& latencies = stages[kind].latencies;
+  if (latencies.empty())
+    return 0.0;
+  std::size_t rank = std::ceil(percentile / 100.0 * latencies.size());
+  return latencies[std::max(rank, std::size_t(1)) - 1] / 1000.0;
+}
+
+// `ru_maxrss` is in kilobytes on Linux.
+//
+// static
+std::size_t Benchmark::get_peak_rss() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return std::size_t(usage.ru_maxrss) * 1024;
+}
+
+void Benchmark::on_folder_ready(bool success) {
+  stages[STAGE_ENUMERATE].end_time = g_get_monotonic_time();
+  opened = success;
+  if (!success || enumerate_only) {
+    main_loop->quit();
+    return;
+  }
+  for (Gtk::TreeModel::iterator iter : image_list->children()) {
+    std::string path = (*iter)[image_list->columns.path];
+    guint64 time_modified = (*iter)[image_list->columns.time_modified];
+    files.emplace_back(path, time_modified);
+  }
+  stages[STAGE_ENUMERATE].files = files.size();
+  start_stage(STAGE_THUMBNAILS);
+}
+
+void Benchmark::start_stage(StageKind kind) {
+  current_stage = kind;
+  if (kind == NUM_STAGES) {
+    main_loop->quit();
+    return;
+  }
+  Stage& stage = stages[kind];
+  stage.start_time = g_get_monotonic_time();
+  stage.start_busy_time = WorkQueue::get_default().get_busy_time();
+  if (files.empty()) {  // Nothing would ever finish loading.
+    stage.end_time = stage.start_time;
+    stage.end_busy_time = stage.start_busy_time;
+    start_stage(StageKind(kind + 1));
+    return;
+  }
+  next_file = 0;
+  load_files();
+}
+
+// Images are loaded one at a time, like when the user switches between them
+// in the window.
+void Benchmark::load_files() {
+  std::size_t max_loading = current_stage == STAGE_THUMBNAILS ?
+      MAX_THUMBNAILS_LOADING : 1;
+  while (load_start_times.size() < max_loading && next_file < files.size()) {
+    const std::pair<std::string, guint64>& file = files[next_file++];
+    load_start_times[file.first] = g_get_monotonic_time();
+    ImageWorker::SlotFinished slot =
+        [this](const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+               const std::string& path) { on_loaded(pixbuf, path); };
+    if (current_stage == STAGE_THUMBNAILS)
+      image_worker.load_thumbnail(slot, file.first, file.second,
+                                  ImageList::DEFAULT_THUMBNAIL_SIZE,
+                                  WorkQueue::PRIORITY_BACKGROUND);
+    else
+      image_worker.load(slot, file.first);
+  }
+}
+
+void Benchmark::on_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                          const std::string& path) {
+  gint64 now = g_get_monotonic_time();
+  Stage& stage = stages[current_stage];
+  auto found = load_start_times.find(path);
+  stage.latencies.push_back(now - found->second);
+  load_start_times.erase(found);
+  ++stage.files;
+  if (!pixbuf)
+    ++stage.failures;
+  else if (current_stage == STAGE_THUMBNAILS &&
+           thumbnails.size() < MAX_THUMBNAILS_KEPT)
+    thumbnails.push_back(pixbuf);
+
+  if (next_file < files.size() || !load_start_times.empty()) {
+    load_files();
+    return;
+  }
+  stage.end_time = now;
+  stage.end_busy_time = WorkQueue::get_default().get_busy_time();
+  std::sort(stage.latencies.begin(), stage.latencies.end());
+  if (current_stage == STAGE_THUMBNAILS)
+    measure_thumbnails();
+  start_stage(StageKind(current_stage + 1));
+}
+
+// A separate pixbuf's rows are padded to a multiple of 4 bytes, as
+// `gdk_pixbuf_new()` does. Heap overhead per allocation isn't counted, so
+// the separate sizes are lower bounds.
+void Benchmark::measure_thumbnails() {
+  for (const auto& thumbnail : thumbnails) {
+    std::size_t width = thumbnail->get_width(),
+                height = thumbnail->get_height();
+    thumbnail_separate_bytes +=
+        ((width * thumbnail->get_n_channels() + 3) & ~std::size_t(3)) *
+        height;
+    thumbnail_rgba_bytes += width * 4 * height;
+  }
+  thumbnail_atlas_bytes = ThumbnailAtlas::get_default().get_size();
+  thumbnails.clear();
+}
+
+void Benchmark::print_results(std::ostream& output) const {
+  output << "{\n"
+         << "  \"folder\": " << quote(folder_path) << ",\n"
+         << "  \"files\": " << stages[STAGE_ENUMERATE].files << ",\n"
+         << "  \"threads\": " << WorkQueue::get_default().get_num_threads()
+         << ",\n"
+         << "  \"peak_rss_bytes\": " << get_peak_rss() << ",\n"
+         << "  \"startup_ms\": " << startup_time / 1000.0 << ",\n"
+         << "  \"formats_ms\": "
+         << Stats::get_default().get_formats_time() / 1000.0 << ",\n"
+         << "  \"stages\": {\n";
+  int last = enumerate_only ? STAGE_ENUMERATE : NUM_STAGES - 1;
+  for (int kind = 0; kind <= last; ++kind) {
+    print_stage(output, stages[kind]);
+    output << (kind < last ? ",\n" : "\n");
+  }
+  output << "  }\n}" << std::endl;
+}
+
+// Enumeration has no per-file latency, and doesn't run in the work queue.
+void Benchmark::print_stage(std::ostream& output, const Stage& stage) const {
+  StageKind kind = StageKind(&stage - stages);
+  double seconds = get_seconds(kind);
+  output << "    " << quote(stage.name) << ": {\n"
+         << "      \"seconds\": " << seconds << ",\n"
+         << "      \"files_per_second\": "
+         << (seconds > 0.0 ? stage.files / seconds : 0.0);
+  if (stage.latencies.empty()) {
+    output << "\n    }";
+    return;
+  }
+
+  double capacity = (stage.end_time - stage.start_time) *
+      double(WorkQueue::get_default().get_num_threads());
+  output << ",\n"
+         << "      \"failures\": " << stage.failures << ",\n"
+         << "      \"latency_ms\": {"
+         << "\"p50\": " << get_latency(kind, 50.0) << ", "
+         << "\"p95\": " << get_latency(kind, 95.0) << ", "
+         << "\"p99\": " << get_latency(kind, 99.0) << "},\n"
+         << "      \"thread_utilization\": "
+         << (capacity > 0.0 ?
+             (stage.end_busy_time - stage.start_busy_time) / capacity : 0.0);
+  if (kind == STAGE_THUMBNAILS)
+    output << ",\n"
+           << "      \"thumbnail_bytes\": {"
+           << "\"atlas\": " << thumbnail_atlas_bytes << ", "
+           << "\"separate\": " << thumbnail_separate_bytes << ", "
+           << "\"separate_rgba\": " << thumbnail_rgba_bytes << "}";
+  if (kind == STAGE_IMAGES)
+    print_switch_stages(output);
+  output << "\n    }";
+}
+
+// Only full images record the switch stages, and only the stages up to the
+// main thread taking the result run without a window.
+//
+// static
+void Benchmark::print_switch_stages(std::ostream& output) {
+  const Stats& stats = Stats::get_default();
+  output << ",\n      \"switch_stages_ms\": {";
+  bool first = true;
+  for (int i = 0; i < Stats::NUM_SWITCH_STAGES; ++i) {
+    Stats::SwitchStage stage = Stats::SwitchStage(i);
+    if (!stats.get_switch_count(stage))
+      continue;
+    output << (first ? "\n" : ",\n") << "        "
+           << quote(Stats::SWITCH_STAGE_NAMES[stage]) << ": {"
+           << "\"mean\": " << stats.get_switch_mean(stage) << ", "
+           << "\"p95\": " << stats.get_switch_percentile(stage, 95.0) << "}";
+    first = false;
+  }
+  output << "\n      }";
+}
+
+// static
+std::string Benchmark::quote(const std::string& string) {
+  std::string quoted = "\"";
+  for (char c : string) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escape[7];
+      std::snprintf(escape, sizeof escape, "\\u%04x", unsigned(c));
+      quoted += escape;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
@@ -0,0 +1,138 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_BENCHMARK_H
+#define LUMEE_BENCHMARK_H
+
+#include "image_list.h"
+#include "image_worker.h"
+
+#include <glibmm/main.h>
+
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Measures how fast a folder's images are listed and loaded, without showing
+// a window. The folder is opened by an `ImageList`, and then each image's
+// thumbnail and full image are loaded by an `ImageWorker`, as they would be
+// in the window. Results are printed as JSON.
+//
+// Thumbnails go through the `ThumbnailCache` and the folder through its
+// snapshot, so the first run on a folder measures cold loading and later runs
+// measure cached loading.
+class Benchmark {
+ public:
+  enum StageKind {
+    STAGE_ENUMERATE,   // Opening the folder.
+    STAGE_THUMBNAILS,  // Loading thumbnails, several at a time.
+    STAGE_IMAGES,      // Switching from image to image, one at a time.
+    NUM_STAGES
+  };
+
+  // If `enumerate_only` is true, only the folder is opened.
+  explicit Benchmark(const std::string& folder_path,
+                     bool enumerate_only = false);
+
+  // Runs every stage in a main loop, and then prints the results to `output`.
+  // Returns false if the folder couldn't be opened.
+  bool run(std::ostream& output);
+
+  // Results of a stage, after `run()`. The enumeration stage has no
+  // per-file latencies.
+  double get_seconds(StageKind kind) const;
+  int get_failures(StageKind kind) const { return stages[kind].failures; }
+
+  // Returns a percentile of a stage's per-file latencies, in milliseconds.
+  double get_latency(StageKind kind, double percentile) const;
+
+  // Returns the peak resident memory of the process, in bytes.
+  static std::size_t get_peak_rss();
+
+ private:
+  // Timings of one stage.
+  struct Stage {
+    explicit Stage(const char* name) : name(name) {}
+
+    const char* name;
+    gint64 start_time = 0;
+    gint64 end_time = 0;
+    gint64 start_busy_time = 0;  // `WorkQueue::get_busy_time()` at the start.
+    gint64 end_busy_time = 0;
+    int files = 0;
+    int failures = 0;
+    std::vector<gint64> latencies;  // Per file in microseconds, sorted.
+  };
+
+  // Maximum number of thumbnails loading at once. This matches the number
+  // `ImageList` loads in the background.
+  static const int MAX_THUMBNAILS_LOADING;
+
+  // Maximum number of loaded thumbnails kept to measure the memory they
+  // take, so large folders don't need memory for all of them.
+  static const std::size_t MAX_THUMBNAILS_KEPT;
+
+  void on_folder_ready(bool success);
+
+  // Starts a loading stage, or quits the main loop after the last one.
+  void start_stage(StageKind kind);
+
+  // Starts loading files until enough are loading for the current stage.
+  void load_files();
+  void on_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                 const std::string& path);
+
+  // Measures the kept thumbnails in the `ThumbnailAtlas`, against the memory
+  // they'd take as separate pixbufs, and then drops them.
+  void measure_thumbnails();
+
+  void print_results(std::ostream& output) const;
+  void print_stage(std::ostream& output, const Stage& stage) const;
+
+  // Prints the mean and 95th percentile of each stage of loading an image, as
+  // recorded in the `Stats`.
+  static void print_switch_stages(std::ostream& output);
+
+  // Returns a string as a JSON string literal.
+  static std::string quote(const std::string& string);
+
+  std::string folder_path;
+  bool enumerate_only = false;
+  Glib::RefPtr<Glib::MainLoop> main_loop;
+  Glib::RefPtr<ImageList> image_list;
+  ImageWorker image_worker;
+  bool opened = false;
+
+  // Time from the process starting until the benchmark starts, without a
+  // window, in microseconds.
+  gint64 startup_time = 0;
+
+  Stage stages[NUM_STAGES] = {
+      Stage("enumerate"), Stage("thumbnails"), Stage("images")};
+  StageKind current_stage = STAGE_ENUMERATE;
+
+  // Files found by the `ImageList`, with their modification times.
+  std::vector<std::pair<std::string, guint64>> files;
+  std::size_t next_file = 0;
+  std::unordered_map<std::string, gint64> load_start_times;
+
+  std::vector<Glib::RefPtr<Gdk::Pixbuf>> thumbnails;
+  std::size_t thumbnail_atlas_bytes = 0;     // Slabs in the atlas.
+  std::size_t thumbnail_separate_bytes = 0;  // In the same formats.
+  std::size_t thumbnail_rgba_bytes = 0;      // As RGBA, like before the atlas.
+};
+
+#endif  // LUMEE_BENCHMARK_H
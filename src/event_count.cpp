@@ -0,0 +1,54 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "event_count.h"
+
+const guint64 EventCount::EPOCH_INCREMENT = guint64(1) << 32;
+const guint64 EventCount::WAITERS_MASK = EPOCH_INCREMENT - 1;
+
+EventCount::Key EventCount::prepare_wait() {
+  guint64 previous = state.fetch_add(1, std::memory_order_seq_cst);
+  return previous >> 32;
+}
+
+void EventCount::cancel_wait() {
+  state.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+// The epoch is checked with the mutex held, and `notify()` takes the mutex
+// after changing the epoch, so it can't signal between the check and the wait.
+void EventCount::wait(Key key) {
+  {
+    Glib::Threads::Mutex::Lock lock(mutex);
+    while ((state.load(std::memory_order_acquire) >> 32) == key)
+      cond.wait(mutex);
+  }
+  state.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+// The fence orders the caller's change to the condition before the check for
+// waiters. A waiter that isn't counted yet will see the change when it checks
+// its condition after `prepare_wait()`.
+void EventCount::notify(bool all) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!(state.load(std::memory_order_relaxed) & WAITERS_MASK))
+    return;
+  state.fetch_add(EPOCH_INCREMENT, std::memory_order_seq_cst);
+  Glib::Threads::Mutex::Lock lock(mutex);
+  if (all)
+    cond.broadcast();
+  else
+    cond.signal();
+}
@@ -0,0 +1,62 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_EVENT_COUNT_H
+#define LUMEE_EVENT_COUNT_H
+
+#include <glibmm/threads.h>
+
+#include <atomic>
+
+// Lets threads sleep until a condition may have changed, without taking a lock
+// when nobody is sleeping. A waiting thread calls `prepare_wait()`, checks its
+// condition again, and then calls either `cancel_wait()` or `wait()`:
+//
+//     EventCount::Key key = event_count.prepare_wait();
+//     if (has_work())
+//       event_count.cancel_wait();
+//     else
+//       event_count.wait(key);
+//
+// A notifying thread makes the condition true and then calls `notify_one()` or
+// `notify_all()`. A notification between `prepare_wait()` and `wait()` isn't
+// lost.
+class EventCount {
+ public:
+  typedef guint32 Key;
+
+  Key prepare_wait();
+  void cancel_wait();
+  void wait(Key key);
+
+  void notify_one() { notify(false); }
+  void notify_all() { notify(true); }
+
+ private:
+  // The upper 32 bits of `state` are the epoch, which is incremented by each
+  // notification that has waiters. The lower 32 bits count the waiters.
+  static const guint64 EPOCH_INCREMENT;
+  static const guint64 WAITERS_MASK;
+
+  void notify(bool all);
+
+  std::atomic<guint64> state{0};
+
+  // Only used once a thread has to sleep.
+  Glib::Threads::Mutex mutex;
+  Glib::Threads::Cond cond;
+};
+
+#endif  // LUMEE_EVENT_COUNT_H
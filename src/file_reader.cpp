@@ -0,0 +1,670 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "file_reader.h"
+#include "trace.h"
+
+#include <glibmm/fileutils.h>
+#include <glibmm/miscutils.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#endif
+
+const int FileReader::MAX_THREADS = 16;
+const std::size_t FileReader::READAHEAD_SIZE = 128 * 1024;
+const std::size_t FileReader::MAP_SIZE = 256 * 1024;
+thread_local FileReader::MappingGuard::Guarded
+    FileReader::MappingGuard::guarded = {nullptr, 0, 0};
+struct sigaction FileReader::previous_sigbus_action;
+
+#ifdef HAVE_LIBURING
+
+// Reads files through io_uring in one thread. A request's file is opened and
+// its size queried with two submissions, and then it's either mapped or read
+// with one more. Submissions for every request that can start are made with
+// one system call, which also waits for completions.
+struct FileReader::Ring {
+  // Request being read, and its operations.
+  struct Slot {
+    Request* request = nullptr;
+    Mount* mount = nullptr;
+    int fd = -1;
+    int pending = 0;  // Submitted operations that haven't completed.
+    bool failed = false;
+    std::size_t done = 0;  // Bytes read so far.
+    struct statx stat_buf;
+  };
+
+  // Operations are tagged in the low bits of a submission's user data, next
+  // to its slot's address. The eventfd read has no slot.
+  enum Operation { OP_EVENT, OP_OPEN, OP_STATX, OP_READ, OP_CLOSE };
+  static const guint64 OPERATION_MASK = 7;
+
+  static const unsigned int ENTRIES = 256;
+  static const int SLOTS = 64;
+
+  explicit Ring(FileReader& reader) : reader(reader), slots(SLOTS) {
+    for (Slot& slot : slots)
+      free_slots.push_back(&slot);
+  }
+
+  ~Ring() {
+    if (event_fd >= 0)
+      ::close(event_fd);
+    if (initialized)
+      io_uring_queue_exit(&ring);
+  }
+
+  // Returns null if io_uring can't be used, such as when it's disabled by the
+  // system, or on a kernel older than 5.6. Older kernels can set up a ring,
+  // but fail every operation used here, so the operations are probed first.
+  static std::unique_ptr<Ring> create(FileReader& reader) {
+    std::unique_ptr<Ring> ring(new Ring(reader));
+    ring->initialized = io_uring_queue_init(ENTRIES, &ring->ring, 0) == 0;
+    ring->event_fd = eventfd(0, EFD_CLOEXEC);
+    if (!ring->initialized || ring->event_fd < 0 ||
+        !supports_operations(&ring->ring))
+      return nullptr;
+    Ring* r = ring.get();
+    ring->thread = Glib::Threads::Thread::create([r]() { r->run(); });
+    return ring;
+  }
+
+  // Probing itself needs 5.6, so a kernel without it fails the check.
+  static bool supports_operations(io_uring* ring) {
+    io_uring_probe* probe = io_uring_get_probe_ring(ring);
+    if (!probe)
+      return false;
+    bool supported = true;
+    for (int opcode : {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                       IORING_OP_CLOSE})
+      supported = supported && io_uring_opcode_supported(probe, opcode);
+    io_uring_free_probe(probe);
+    return supported;
+  }
+
+  // Interrupts the thread's wait, so it takes new requests. Only the first
+  // call until the thread wakes writes to the eventfd.
+  void wake() {
+    guint64 one = 1;
+    if (!wake_pending.exchange(true) &&
+        ::write(event_fd, &one, sizeof one) < 0) {}
+  }
+
+  // Requests whose mount needs looking up are looked up here before any
+  // submissions, and then taken again on the next pass.
+  void run() {
+    arm_event();
+    Slot* started[SLOTS];
+    std::vector<Request*> resolving;
+    while (true) {
+      int count = 0;
+      {
+        Glib::Threads::Mutex::Lock lock(reader.mutex);
+        if (reader.stopping && !in_flight)
+          break;
+        while (!reader.stopping && !free_slots.empty()) {
+          Mount* mount = nullptr;
+          Request* request = reader.take_request(mount);
+          if (!request)
+            break;
+          else if (mount == &reader.unresolved) {
+            resolving.push_back(request);
+            continue;
+          }
+          ++mount->active_reads;
+          Slot* slot = free_slots.back();
+          free_slots.pop_back();
+          slot->request = request;
+          slot->mount = mount;
+          started[count++] = slot;
+          ++in_flight;
+        }
+      }
+      for (Request* request : resolving)
+        reader.resolve_mount(request);
+      if (!resolving.empty()) {
+        resolving.clear();
+        if (!count)
+          continue;
+      }
+      for (int i = 0; i < count; ++i)
+        start(*started[i]);
+
+      io_uring_submit_and_wait(&ring, 1);
+      io_uring_cqe* cqe = nullptr;
+      while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+        guint64 data = cqe->user_data;
+        int result = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        complete(data, result);
+      }
+    }
+  }
+
+  void start(Slot& slot) {
+    if (slot.request->is_cancelled()) {
+      finish(slot, false);
+      return;
+    }
+    slot.fd = -1;
+    slot.pending = 2;
+    slot.failed = false;
+    slot.done = 0;
+    const char* path = slot.request->path.c_str();
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_openat(sqe, AT_FDCWD, path, O_RDONLY | O_CLOEXEC, 0);
+    set_data(sqe, &slot, OP_OPEN);
+    sqe = get_sqe();
+    io_uring_prep_statx(sqe, AT_FDCWD, path, 0, STATX_TYPE | STATX_SIZE,
+                        &slot.stat_buf);
+    set_data(sqe, &slot, OP_STATX);
+  }
+
+  void complete(guint64 data, int result) {
+    Operation operation = Operation(data & OPERATION_MASK);
+    Slot* slot = reinterpret_cast<Slot*>(data & ~OPERATION_MASK);
+    if (operation == OP_EVENT) {
+      // Cleared before the next requests are taken, so a request queued
+      // after that wakes the thread again.
+      wake_pending.store(false);
+      arm_event();
+      return;
+    } else if (operation == OP_CLOSE) {
+      return;
+    } else if (operation == OP_READ) {
+      if (result == -EINTR || result == -EAGAIN)
+        submit_read(*slot);
+      else if (result < 0)
+        finish(*slot, false);
+      else if (result == 0) {  // The file was truncated.
+        slot->request->data.resize(slot->done);
+        finish(*slot, true);
+      } else if ((slot->done += result) < slot->request->data.size())
+        submit_read(*slot);
+      else
+        finish(*slot, true);
+      return;
+    }
+
+    if (operation == OP_OPEN && result >= 0)
+      slot->fd = result;
+    else if (operation == OP_STATX && result >= 0 &&
+             !S_ISREG(slot->stat_buf.stx_mode))
+      slot->failed = true;
+    else if (result < 0)
+      slot->failed = true;
+    if (--slot->pending)
+      return;
+
+    if (slot->failed) {
+      finish(*slot, false);
+      return;
+    }
+    if (map_file(*slot->request, *slot->mount, slot->fd,
+                 slot->stat_buf.stx_size)) {
+      finish(*slot, true);
+      return;
+    }
+    slot->request->data.resize(slot->stat_buf.stx_size);
+    if (slot->request->data.empty())
+      finish(*slot, true);
+    else
+      submit_read(*slot);
+  }
+
+  void submit_read(Slot& slot) {
+    std::vector<guint8>& buffer = slot.request->data;
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_read(sqe, slot.fd, buffer.data() + slot.done,
+                       buffer.size() - slot.done, slot.done);
+    set_data(sqe, &slot, OP_READ);
+  }
+
+  // The file is closed asynchronously; nothing waits for it.
+  void finish(Slot& slot, bool success) {
+    if (slot.fd >= 0) {
+      io_uring_sqe* sqe = get_sqe();
+      io_uring_prep_close(sqe, slot.fd);
+      set_data(sqe, nullptr, OP_CLOSE);
+      slot.fd = -1;
+    }
+    Request* request = slot.request;
+    Mount* mount = slot.mount;
+    slot.request = nullptr;
+    free_slots.push_back(&slot);
+    --in_flight;
+    {
+      Glib::Threads::Mutex::Lock lock(reader.mutex);
+      --mount->active_reads;
+    }
+    request->read_finished(success);
+  }
+
+  void arm_event() {
+    io_uring_sqe* sqe = get_sqe();
+    io_uring_prep_read(sqe, event_fd, &event_value, sizeof event_value, 0);
+    set_data(sqe, nullptr, OP_EVENT);
+  }
+
+  // Gets a submission entry, submitting the queued ones if it's full.
+  io_uring_sqe* get_sqe() {
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    while (!sqe) {
+      io_uring_submit(&ring);
+      sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+  }
+
+  static void set_data(io_uring_sqe* sqe, Slot* slot, Operation operation) {
+    sqe->user_data = guint64(reinterpret_cast<guintptr>(slot)) | operation;
+  }
+
+  FileReader& reader;
+  io_uring ring;
+  bool initialized = false;
+  int event_fd = -1;
+  guint64 event_value = 0;
+  std::atomic<bool> wake_pending{false};
+  std::vector<Slot> slots;
+  std::vector<Slot*> free_slots;
+  int in_flight = 0;
+  Glib::Threads::Thread* thread = nullptr;
+};
+
+#else  // !HAVE_LIBURING
+
+struct FileReader::Ring {
+  static std::unique_ptr<Ring> create(FileReader&) { return nullptr; }
+  void wake() {}
+  Glib::Threads::Thread* thread = nullptr;
+};
+
+#endif  // HAVE_LIBURING
+
+FileReader::Request::~Request() {
+  release_contents();
+}
+
+void FileReader::Request::release_contents() {
+  if (mapping) {
+    ::munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+  }
+}
+
+FileReader::MappingGuard::MappingGuard(const Request& request) {
+  guarded.start = static_cast<const char*>(request.mapping);
+  guarded.size = request.mapping_size;
+  guarded.truncated = 0;
+}
+
+FileReader::MappingGuard::~MappingGuard() {
+  guarded.start = nullptr;
+  guarded.size = 0;
+}
+
+FileReader::~FileReader() {
+  stop();
+}
+
+// static
+FileReader& FileReader::get_default() {
+  static FileReader reader;
+  return reader;
+}
+
+// A new thread is only started when none is idle. An idle thread may still be
+// unable to take the request if its mount is at its limit, but then a thread
+// on that mount will take it when it finishes.
+void FileReader::read(Request* request, WorkQueue::Priority priority) {
+  request->next_request = nullptr;
+  request->read_priority = priority;
+  std::string folder = Glib::path_get_dirname(request->path);
+  Glib::Threads::Mutex::Lock lock(mutex);
+  if (stopping) {
+    lock.release();
+    request->read_finished(false);
+    return;
+  }
+  auto found = mounts_by_folder.find(folder);
+  push_request(found != mounts_by_folder.end() ? *found->second : unresolved,
+               request);
+
+  if (!ring_checked) {
+    ring_checked = true;
+    ring = Ring::create(*this);
+  }
+  if (ring)
+    ring->wake();
+  else if (idle_threads)
+    cond.signal();
+  else if (threads.size() < std::size_t(MAX_THREADS))
+    threads.push_back(Glib::Threads::Thread::create([this]() { run(); }));
+}
+
+void FileReader::stop() {
+  std::vector<Glib::Threads::Thread*> joining;
+  {
+    Glib::Threads::Mutex::Lock lock(mutex);
+    stopping = true;
+    joining.swap(threads);
+  }
+  cond.broadcast();
+  for (Glib::Threads::Thread* thread : joining)
+    thread->join();
+  // The ring's thread finishes the reads in flight first.
+  if (ring && ring->thread) {
+    ring->wake();
+    ring->thread->join();
+    ring->thread = nullptr;
+  }
+
+  // No thread can touch the queues anymore.
+  std::vector<Mount*> queues = {&unresolved};
+  for (auto& mount : mounts)
+    queues.push_back(mount.second.get());
+  for (Mount* mount : queues) {
+    for (int p = 0; p < WorkQueue::NUM_PRIORITIES; ++p) {
+      while (Request* request = mount->heads[p]) {
+        mount->heads[p] = request->next_request;
+        request->read_finished(false);
+      }
+      mount->tails[p] = nullptr;
+    }
+  }
+}
+
+// static
+void FileReader::push_request(Mount& mount, Request* request) {
+  int priority = request->read_priority;
+  request->next_request = nullptr;
+  if (mount.tails[priority])
+    mount.tails[priority]->next_request = request;
+  else
+    mount.heads[priority] = request;
+  mount.tails[priority] = request;
+}
+
+// Several threads may look up the same folder at once; the first to finish
+// adds it. The storage is only detected for devices that aren't known yet.
+void FileReader::resolve_mount(Request* request) {
+  std::string folder = Glib::path_get_dirname(request->path);
+  {
+    Glib::Threads::Mutex::Lock lock(mutex);
+    auto found = mounts_by_folder.find(folder);
+    if (found != mounts_by_folder.end()) {
+      push_request(*found->second, request);
+      return;
+    }
+  }
+
+  struct stat stat_buf;
+  guint64 device = ::stat(folder.c_str(), &stat_buf) == 0 ?
+      guint64(stat_buf.st_dev) : 0;
+  bool known = false;
+  {
+    Glib::Threads::Mutex::Lock lock(mutex);
+    known = mounts.count(device);
+  }
+  MountKind kind = known ? MOUNT_UNKNOWN : detect_mount_kind(folder);
+
+  Glib::Threads::Mutex::Lock lock(mutex);
+  std::unique_ptr<Mount>& mount = mounts[device];
+  if (!mount)
+    mount.reset(new Mount(kind));
+  mounts_by_folder[folder] = mount.get();
+  push_request(*mount, request);
+}
+
+// static
+FileReader::MountKind FileReader::detect_mount_kind(
+    const std::string& folder) {
+#ifdef __linux__
+  struct statfs fs_buf;
+  if (::statfs(folder.c_str(), &fs_buf) != 0)
+    return MOUNT_UNKNOWN;
+  // Filesystem magic numbers, from `statfs(2)`.
+  switch (guint32(fs_buf.f_type)) {
+    case 0x6969:      // NFS
+    case 0x517B:      // SMB
+    case 0xFF534D42:  // CIFS
+    case 0xFE534D42:  // SMB2
+    case 0x65735546:  // FUSE, such as sshfs or GVfs
+    case 0x00C36400:  // Ceph
+    case 0x01021997:  // 9p
+    case 0x6B414653:  // AFS
+      return MOUNT_NETWORK;
+    case 0x01021994:  // tmpfs
+    case 0x858458F6:  // ramfs
+      return MOUNT_MEMORY;
+  }
+
+  // For other filesystems, ask the block device whether it rotates. A
+  // partition's queue settings are in its parent device.
+  struct stat stat_buf;
+  if (::stat(folder.c_str(), &stat_buf) != 0)
+    return MOUNT_UNKNOWN;
+  std::string device_dir = Glib::build_filename(
+      "/sys/dev/block", std::to_string(major(stat_buf.st_dev)) + ":" +
+                        std::to_string(minor(stat_buf.st_dev)));
+  for (const char* queue_dir : {"queue", "../queue"}) {
+    try {
+      std::string rotational = Glib::file_get_contents(
+          Glib::build_filename(device_dir, queue_dir, "rotational"));
+      return rotational.compare(0, 1, "1") == 0 ? MOUNT_ROTATIONAL
+                                                : MOUNT_SOLID_STATE;
+    } catch (const Glib::FileError&) {}
+  }
+#else
+  (void)folder;
+#endif
+  return MOUNT_UNKNOWN;
+}
+
+// static
+int FileReader::get_max_reads(MountKind kind) {
+  switch (kind) {
+    case MOUNT_ROTATIONAL:
+      return 2;
+    case MOUNT_SOLID_STATE:
+      return 8;
+    case MOUNT_MEMORY:
+      return std::max(int(g_get_num_processors()), 2);
+    case MOUNT_NETWORK:
+      return MAX_THREADS;
+    case MOUNT_UNKNOWN:
+      break;
+  }
+  return 4;
+}
+
+void FileReader::run() {
+  Glib::Threads::Mutex::Lock lock(mutex);
+  while (true) {
+    Mount* mount = nullptr;
+    Request* request = nullptr;
+    while (!stopping && !(request = take_request(mount))) {
+      ++idle_threads;
+      cond.wait(mutex);
+      --idle_threads;
+    }
+    if (stopping)
+      break;
+    else if (mount == &unresolved) {
+      lock.release();
+      resolve_mount(request);
+      lock.acquire();
+      continue;
+    }
+
+    ++mount->active_reads;
+    lock.release();
+    // The request may be reused as soon as it's finished.
+    bool success = !request->is_cancelled() && read_file(*request, *mount);
+    request->read_finished(success);
+    lock.acquire();
+    --mount->active_reads;
+  }
+}
+
+FileReader::Request* FileReader::take_request(Mount*& mount) {
+  for (int p = 0; p < WorkQueue::NUM_PRIORITIES; ++p) {
+    if (Request* request = unresolved.heads[p]) {
+      unresolved.heads[p] = request->next_request;
+      if (!unresolved.heads[p])
+        unresolved.tails[p] = nullptr;
+      request->next_request = nullptr;
+      mount = &unresolved;
+      return request;
+    }
+    for (auto& candidate : mounts) {
+      Mount& m = *candidate.second;
+      Request* request = m.heads[p];
+      if (!request || m.active_reads >= m.max_reads)
+        continue;
+      m.heads[p] = request->next_request;
+      if (!m.heads[p])
+        m.tails[p] = nullptr;
+      request->next_request = nullptr;
+      mount = &m;
+      return request;
+    }
+  }
+  return nullptr;
+}
+
+// The whole file is read with one buffer. Sequential access doubles the
+// kernel's read-ahead window, and bigger files are read ahead in full, so the
+// disk sees a few large reads instead of many small ones.
+//
+// static
+bool FileReader::read_file(Request& request, const Mount& mount) {
+  Trace::Span span("FileReader::read_file");
+  int fd = ::open(request.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat stat_buf;
+  if (::fstat(fd, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode)) {
+    ::close(fd);
+    return false;
+  }
+  std::size_t size = stat_buf.st_size;
+  if (map_file(request, mount, fd, size)) {
+    ::close(fd);
+    return true;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#ifdef __linux__
+  if (size > READAHEAD_SIZE)
+    readahead(fd, 0, size);
+#endif
+
+  request.data.resize(size);
+  std::size_t done = 0;
+  while (done < size) {
+    ssize_t count = ::read(fd, request.data.data() + done, size - done);
+    if (count < 0 && errno == EINTR)
+      continue;
+    else if (count < 0) {
+      ::close(fd);
+      return false;
+    } else if (count == 0) {  // The file was truncated.
+      break;
+    }
+    done += count;
+  }
+  request.data.resize(done);
+  ::close(fd);
+  return true;
+}
+
+// Mapping saves copying the file into a buffer; the decoder reads the page
+// cache directly, and faults in pages as it goes. Asking for them up front
+// keeps the faults from waiting on the disk. Files on network or unknown mounts
+// aren't mapped, since a fault there can take a long time.
+//
+// Any process can truncate a mapped file, locally too, and reading a page past
+// its new end raises SIGBUS. The mapping is only read under a `MappingGuard`,
+// whose handler is installed before the first file is mapped.
+//
+// static
+bool FileReader::map_file(Request& request, const Mount& mount, int fd,
+                          std::size_t size) {
+  static const bool handler_installed = install_sigbus_handler();
+  if (size < MAP_SIZE || mount.kind == MOUNT_NETWORK ||
+      mount.kind == MOUNT_UNKNOWN || !handler_installed)
+    return false;
+  void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED)
+    return false;
+#ifdef MADV_SEQUENTIAL
+  ::madvise(mapping, size, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+  ::madvise(mapping, size, MADV_WILLNEED);
+#endif
+  request.mapping = mapping;
+  request.mapping_size = size;
+  return true;
+}
+
+// static
+bool FileReader::install_sigbus_handler() {
+  struct sigaction action = {};
+  action.sa_sigaction = &FileReader::on_sigbus;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  return sigaction(SIGBUS, &action, &previous_sigbus_action) == 0;
+}
+
+// Runs in the thread that faulted. The zero page replaces the missing one in
+// the mapping, so the read is retried and succeeds. Otherwise, the previous
+// handler is restored, and the retried read raises SIGBUS again for it.
+//
+// static
+void FileReader::on_sigbus(int /*signal*/, siginfo_t* info,
+                           void* /*context*/) {
+  MappingGuard::Guarded& guarded = MappingGuard::guarded;
+  const char* address = static_cast<const char*>(info->si_addr);
+  if (guarded.start && address >= guarded.start &&
+      address < guarded.start + guarded.size) {
+    std::size_t page_size = ::sysconf(_SC_PAGESIZE);
+    void* page = const_cast<char*>(
+        address - guintptr(address) % page_size);
+    if (::mmap(page, page_size, PROT_READ,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+      guarded.truncated = 1;
+      return;
+    }
+  }
+  sigaction(SIGBUS, &previous_sigbus_action, nullptr);
+}
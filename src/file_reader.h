@@ -0,0 +1,209 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_FILE_READER_H
+#define LUMEE_FILE_READER_H
+
+#include "work_queue.h"
+
+#include <glibmm/threads.h>
+
+#include <csignal>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Reads whole files into memory in a pool of I/O threads, separately from the
+// threads that decode them.
+//
+// Each mount has its own limit on reads in flight, chosen from its kind of
+// storage: a spinning disk only gets a couple, since seeking between files is
+// slow, while a network mount gets many to hide its latency. Within those
+// limits, requests are read in order of priority.
+//
+// If io_uring is available, a single thread submits the opens and reads of
+// many requests at once through it instead.
+class FileReader {
+ public:
+  // File to read. The reader doesn't own its requests.
+  class Request {
+   public:
+    virtual ~Request();
+
+    // Returns true if the request is no longer needed. It's checked before
+    // reading.
+    virtual bool is_cancelled() const = 0;
+
+    // Called in an I/O thread when the file's contents are available, or
+    // when the file couldn't be read or the request was cancelled.
+    virtual void read_finished(bool success) = 0;
+
+    // Returns the file's contents. They're either in `data`, or in a read-only
+    // mapping of the file.
+    const guint8* get_contents() const {
+      return mapping ? static_cast<const guint8*>(mapping) : data.data();
+    }
+    std::size_t get_size() const {
+      return mapping ? mapping_size : data.size();
+    }
+
+    // Unmaps the file if it was mapped. `data` is left alone.
+    void release_contents();
+
+    std::string path;
+    std::vector<guint8> data;
+
+   private:
+    friend class FileReader;
+    Request* next_request = nullptr;
+    WorkQueue::Priority read_priority = WorkQueue::PRIORITY_BACKGROUND;
+    void* mapping = nullptr;
+    std::size_t mapping_size = 0;
+  };
+
+  // Guards reads of a request's mapping in the calling thread for the rest of
+  // the scope. A file that's truncated while it's mapped would raise SIGBUS
+  // when the missing pages are read; instead, they read as zeros, and
+  // `truncated()` returns true, so the contents should be thrown away.
+  //
+  //     FileReader::MappingGuard guard(request);
+  class MappingGuard {
+   public:
+    explicit MappingGuard(const Request& request);
+    ~MappingGuard();
+
+    MappingGuard(const MappingGuard&) = delete;
+    MappingGuard& operator=(const MappingGuard&) = delete;
+
+    bool truncated() const { return guarded.truncated; }
+
+   private:
+    friend class FileReader;
+
+    // Mapping guarded in a thread, read by the signal handler.
+    struct Guarded {
+      const char* start;
+      std::size_t size;
+      volatile sig_atomic_t truncated;
+    };
+
+    static thread_local Guarded guarded;
+  };
+
+  ~FileReader();
+
+  // Returns the reader shared by the whole process.
+  static FileReader& get_default();
+
+  // Queues a request. Requests for a folder whose mount hasn't been looked up
+  // yet wait for an I/O thread to look it up, so this never blocks on the
+  // file system.
+  void read(Request* request, WorkQueue::Priority priority);
+
+  // Stops reading and waits for the threads to exit. Requests that are still
+  // queued are finished without success.
+  void stop();
+
+ private:
+  // Kinds of storage that get different limits.
+  enum MountKind {
+    MOUNT_UNKNOWN,
+    MOUNT_ROTATIONAL,  // Spinning disk.
+    MOUNT_SOLID_STATE,
+    MOUNT_MEMORY,      // Such as tmpfs.
+    MOUNT_NETWORK      // Such as NFS, SMB or FUSE.
+  };
+
+  // io_uring backend, defined in the source file.
+  struct Ring;
+
+  // Requests waiting for one mount.
+  struct Mount {
+    explicit Mount(MountKind kind)
+        : kind(kind), max_reads(get_max_reads(kind)) {}
+
+    const MountKind kind;
+    const int max_reads;
+    int active_reads = 0;
+    Request* heads[WorkQueue::NUM_PRIORITIES] = {};
+    Request* tails[WorkQueue::NUM_PRIORITIES] = {};
+  };
+
+  // Maximum number of I/O threads. Threads are created as needed.
+  static const int MAX_THREADS;
+
+  // Files bigger than this are read ahead in full when opened.
+  static const std::size_t READAHEAD_SIZE;
+
+  // Files on local mounts at least this big are mapped instead of read.
+  static const std::size_t MAP_SIZE;
+
+  // Adds a request to the end of a mount's queue for its priority. The mutex
+  // must be held.
+  static void push_request(Mount& mount, Request* request);
+
+  // Looks up the mount of a request from `unresolved`, and queues the request
+  // there. The lookup may stat the folder and read sysfs, so it's done
+  // without the mutex, and only once per folder. The mutex must not be held.
+  void resolve_mount(Request* request);
+
+  // Detects the kind of storage a folder is on, and returns its limit on
+  // reads in flight.
+  static MountKind detect_mount_kind(const std::string& folder);
+  static int get_max_reads(MountKind kind);
+
+  // Runs a loop in a thread waiting for requests.
+  void run();
+
+  // Takes the most urgent request on a mount that is below its limit, or one
+  // whose mount needs looking up, in which case `mount` is set to
+  // `&unresolved`. Returns null if there is none. The mutex must be held.
+  Request* take_request(Mount*& mount);
+
+  // Reads a request's file into its buffer, or maps it. Returns false on
+  // errors.
+  static bool read_file(Request& request, const Mount& mount);
+
+  // Maps an open file into a request if it's at least `MAP_SIZE` and on a
+  // local mount. Returns false if it wasn't mapped, so it should be read.
+  static bool map_file(Request& request, const Mount& mount, int fd,
+                       std::size_t size);
+
+  // Handles SIGBUS from reading a guarded mapping past the end of its file by
+  // mapping a page of zeros there. Other faults go to the previous handler.
+  static bool install_sigbus_handler();
+  static void on_sigbus(int signal, siginfo_t* info, void* context);
+  static struct sigaction previous_sigbus_action;
+
+  Glib::Threads::Mutex mutex;
+  Glib::Threads::Cond cond;
+  std::vector<Glib::Threads::Thread*> threads;
+  int idle_threads = 0;
+  bool stopping = false;
+
+  // Created when the first request is queued, if io_uring is available.
+  std::unique_ptr<Ring> ring;
+  bool ring_checked = false;
+
+  // Mounts by device number, and by folder path so each folder is only
+  // looked up once. Requests for other folders wait in `unresolved`, which
+  // has no limit.
+  std::unordered_map<guint64, std::unique_ptr<Mount>> mounts;
+  std::unordered_map<std::string, Mount*> mounts_by_folder;
+  Mount unresolved{MOUNT_UNKNOWN};
+};
+
+#endif  // LUMEE_FILE_READER_H
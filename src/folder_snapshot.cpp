@@ -0,0 +1,160 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "folder_snapshot.h"
+
+#include <glib/gstdio.h>
+#include <glibmm/checksum.h>
+#include <glibmm/fileutils.h>
+#include <glibmm/miscutils.h>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+const int FolderSnapshot::MAX_SNAPSHOTS = 32;
+const std::string FolderSnapshot::MAGIC = "lumee-folder-snapshot-1";
+
+// The file contains `MAGIC`, the folder path, the number of entries and then
+// the entries. Strings are prefixed with their length. Numbers are in the
+// machine's byte order, since the cache isn't shared between machines.
+//
+// static
+bool FolderSnapshot::load(const std::string& folder_path, bool recursive,
+                          std::vector<Entry>& entries) {
+  std::string data;
+  try {
+    data = Glib::file_get_contents(get_filename(folder_path, recursive));
+  } catch (const Glib::FileError&) {
+    return false;
+  }
+
+  std::size_t pos = 0;
+  auto read_bytes = [&](void* dest, std::size_t size) -> bool {
+    if (data.size() - pos < size)
+      return false;
+    std::memcpy(dest, data.data() + pos, size);
+    pos += size;
+    return true;
+  };
+  auto read_string = [&](std::string& string) -> bool {
+    guint32 size = 0;
+    if (!read_bytes(&size, sizeof size) || data.size() - pos < size)
+      return false;
+    string.assign(data, pos, size);
+    pos += size;
+    return true;
+  };
+
+  std::string magic, path;
+  guint32 count = 0;
+  if (!read_string(magic) || magic != MAGIC || !read_string(path) ||
+      path != folder_path || !read_bytes(&count, sizeof count))
+    return false;
+  // Each entry takes at least 16 bytes, which limits the count if the file is
+  // corrupt.
+  entries.clear();
+  entries.reserve(std::min<std::size_t>(count, data.size() / 16));
+  for (guint32 i = 0; i < count; ++i) {
+    Entry entry;
+    if (!read_string(entry.name) ||
+        !read_bytes(&entry.time_modified, sizeof entry.time_modified) ||
+        !read_string(entry.display_name_collation_key)) {
+      entries.clear();
+      return false;
+    }
+    entries.push_back(std::move(entry));
+  }
+  return true;
+}
+
+// static
+void FolderSnapshot::save(const std::string& folder_path, bool recursive,
+                          const std::vector<Entry>& entries) {
+  std::string data;
+  auto write_bytes = [&](const void* src, std::size_t size) {
+    data.append(static_cast<const char*>(src), size);
+  };
+  auto write_string = [&](const std::string& string) {
+    guint32 size = string.size();
+    write_bytes(&size, sizeof size);
+    data += string;
+  };
+
+  write_string(MAGIC);
+  write_string(folder_path);
+  guint32 count = entries.size();
+  write_bytes(&count, sizeof count);
+  for (const Entry& entry : entries) {
+    write_string(entry.name);
+    write_bytes(&entry.time_modified, sizeof entry.time_modified);
+    write_string(entry.display_name_collation_key);
+  }
+
+  // The snapshot is written to a uniquely named temporary file first and then
+  // renamed, so a partially written snapshot is never read, even when the
+  // same folder is saved from two threads at once.
+  std::string filename = get_filename(folder_path, recursive),
+              cache_dir = Glib::path_get_dirname(filename);
+  g_mkdir_with_parents(cache_dir.c_str(), 0700);
+  try {
+    Glib::file_set_contents(filename, data);
+  } catch (const Glib::FileError&) {
+    return;
+  }
+  remove_old_snapshots(cache_dir);
+}
+
+// static
+std::string FolderSnapshot::get_filename(const std::string& folder_path,
+                                         bool recursive) {
+  return Glib::build_filename(
+      Glib::build_filename(Glib::get_user_cache_dir(), "lumee", "folders"),
+      Glib::Checksum::compute_checksum(
+          Glib::Checksum::CHECKSUM_SHA1,
+          recursive ? folder_path + "\n" + "recursive" : folder_path));
+}
+
+// static
+void FolderSnapshot::remove_old_snapshots(const std::string& cache_dir) {
+  std::vector<std::pair<time_t, std::string>> snapshots;
+  try {
+    Glib::Dir dir(cache_dir);
+    for (const std::string& name : dir) {
+      if (!is_snapshot_name(name))
+        continue;  // Such as another thread's temporary file.
+      std::string filename = Glib::build_filename(cache_dir, name);
+      GStatBuf stat_buf;
+      if (g_stat(filename.c_str(), &stat_buf) == 0)
+        snapshots.emplace_back(stat_buf.st_mtime, filename);
+    }
+  } catch (const Glib::FileError&) {
+    return;
+  }
+  if (snapshots.size() <= std::size_t(MAX_SNAPSHOTS))
+    return;
+
+  std::sort(snapshots.begin(), snapshots.end(),
+            std::greater<std::pair<time_t, std::string>>());
+  for (std::size_t i = MAX_SNAPSHOTS; i < snapshots.size(); ++i)
+    g_remove(snapshots[i].second.c_str());
+}
+
+// static
+bool FolderSnapshot::is_snapshot_name(const std::string& name) {
+  return name.size() == 40 &&
+         std::all_of(name.begin(), name.end(),
+                     [](char c) { return g_ascii_isxdigit(c); });
+}
@@ -0,0 +1,64 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_FOLDER_SNAPSHOT_H
+#define LUMEE_FOLDER_SNAPSHOT_H
+
+#include <glibmm/ustring.h>
+
+#include <string>
+#include <vector>
+
+// Compact copy of a folder's image listing, saved in the user's cache folder.
+// It lets a folder be shown immediately when it's reopened, while it's
+// enumerated again in the background.
+class FolderSnapshot {
+ public:
+  // Image file in the listing.
+  struct Entry {
+    std::string name;  // Path relative to the folder.
+    guint64 time_modified = 0;
+    std::string display_name_collation_key;
+  };
+
+  // Reads the snapshot of a folder. `recursive` selects the snapshot that
+  // includes subfolders. Returns false if there is no valid snapshot.
+  static bool load(const std::string& folder_path, bool recursive,
+                   std::vector<Entry>& entries);
+
+  // Replaces the snapshot of a folder. Older snapshots are removed once there
+  // are more than `MAX_SNAPSHOTS`. Errors are ignored, since the snapshot is
+  // only a cache.
+  static void save(const std::string& folder_path, bool recursive,
+                   const std::vector<Entry>& entries);
+
+ private:
+  static const int MAX_SNAPSHOTS;
+
+  // Identifies the file format and version.
+  static const std::string MAGIC;
+
+  // Returns the snapshot's file name in the cache.
+  static std::string get_filename(const std::string& folder_path,
+                                  bool recursive);
+
+  // Removes all but the `MAX_SNAPSHOTS` most recently saved snapshots.
+  static void remove_old_snapshots(const std::string& dir);
+
+  // Returns true if `name` is a snapshot's file name, a SHA-1 checksum.
+  static bool is_snapshot_name(const std::string& name);
+};
+
+#endif  // LUMEE_FOLDER_SNAPSHOT_H
@@ -0,0 +1,151 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "image_cache.h"
+#include "memory_budget.h"
+
+#include <algorithm>
+
+const std::size_t ImageCache::MAX_IMAGES = 8;
+
+ImageCache::ImageCache() {
+  MemoryBudget::get_default().connect_shedder(
+      MemoryBudget::CATEGORY_CACHES, sigc::mem_fun(*this, &ImageCache::shed));
+}
+
+ImageCache::~ImageCache() {
+  MemoryBudget::get_default().remove(MemoryBudget::CATEGORY_CACHES,
+                                     cached_bytes);
+}
+
+Glib::RefPtr<Gdk::Pixbuf> ImageCache::take(const std::string& path) {
+  auto found = entries_by_path.find(path);
+  if (found == entries_by_path.end())
+    return Glib::RefPtr<Gdk::Pixbuf>();
+  Glib::RefPtr<Gdk::Pixbuf> pixbuf = found->second->pixbuf;
+  std::size_t size = MemoryBudget::get_size(pixbuf);
+  cached_bytes -= size;
+  MemoryBudget::get_default().remove(MemoryBudget::CATEGORY_CACHES, size);
+  entries.erase(found->second);
+  entries_by_path.erase(found);
+  return pixbuf;
+}
+
+// An image that's already cached is replaced, and becomes the most recently
+// used.
+void ImageCache::add(const std::string& path,
+                     const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) {
+  take(path);
+  while (entries.size() >= MAX_IMAGES)
+    remove_oldest();
+  entries.push_front({path, pixbuf});
+  entries_by_path[path] = entries.begin();
+  std::size_t size = MemoryBudget::get_size(pixbuf);
+  cached_bytes += size;
+  MemoryBudget::get_default().add(MemoryBudget::CATEGORY_CACHES, size);
+}
+
+// Prefetches that are still wanted keep going, even if the budget is full,
+// since they've already used memory for their files.
+void ImageCache::prefetch(const std::vector<std::string>& paths) {
+  std::vector<std::string> unwanted;
+  for (const auto& prefetch : prefetching) {
+    if (prefetch.first != awaited_path &&
+        std::find(paths.begin(), paths.end(), prefetch.first) == paths.end())
+      unwanted.push_back(prefetch.first);
+  }
+  for (const std::string& path : unwanted)
+    cancel_prefetch(path);
+  if (MemoryBudget::get_default().is_full())
+    return;
+  for (const std::string& file : paths) {
+    if (entries_by_path.count(file) || prefetching.count(file))
+      continue;
+    if (free_workers.empty()) {
+      workers.emplace_back(new ImageWorker());
+      free_workers.push_back(workers.back().get());
+    }
+    ImageWorker* worker = free_workers.back();
+    free_workers.pop_back();
+    prefetching[file] = worker;
+    worker->load([this, worker](const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                                const std::string& path) {
+                   on_prefetched(worker, pixbuf, path);
+                 }, file, WorkQueue::PRIORITY_PREFETCH);
+  }
+}
+
+bool ImageCache::await(const std::string& path,
+                       const ImageWorker::SlotFinished& slot) {
+  if (!prefetching.count(path))
+    return false;
+  awaited_path = path;
+  awaited_slot = slot;
+  return true;
+}
+
+void ImageCache::cancel_await() {
+  awaited_path.clear();
+  awaited_slot = nullptr;
+}
+
+void ImageCache::clear() {
+  cancel_await();
+  while (!prefetching.empty())
+    cancel_prefetch(prefetching.begin()->first);
+  while (!entries.empty())
+    remove_oldest();
+}
+
+// Results are only taken from the path's current worker. Images that failed
+// to load aren't cached, so they're tried again when they're selected. The
+// slot is moved out first, since it may await another image.
+void ImageCache::on_prefetched(ImageWorker* worker,
+                               const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                               const std::string& path) {
+  auto found = prefetching.find(path);
+  if (found == prefetching.end() || found->second != worker)
+    return;
+  free_workers.push_back(worker);
+  prefetching.erase(found);
+  if (path == awaited_path) {
+    ImageWorker::SlotFinished slot = std::move(awaited_slot);
+    cancel_await();
+    slot(pixbuf, path);
+  } else if (pixbuf) {
+    add(path, pixbuf);
+  }
+}
+
+void ImageCache::cancel_prefetch(const std::string& path) {
+  auto found = prefetching.find(path);
+  found->second->cancel_all();
+  free_workers.push_back(found->second);
+  prefetching.erase(found);
+}
+
+void ImageCache::remove_oldest() {
+  take(entries.back().path);
+}
+
+std::size_t ImageCache::shed(std::size_t bytes) {
+  std::size_t freed = 0;
+  while (freed < bytes && !entries.empty()) {
+    std::size_t old_bytes = cached_bytes;
+    remove_oldest();
+    freed += old_bytes - cached_bytes;
+  }
+  return freed;
+}
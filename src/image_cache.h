@@ -0,0 +1,100 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_IMAGE_CACHE_H
+#define LUMEE_IMAGE_CACHE_H
+
+#include "image_worker.h"
+
+#include <gdkmm/pixbuf.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Keeps decoded images that aren't shown, so switching back to a recent image,
+// or on to a prefetched one, doesn't decode it again. Images are counted in
+// the `MemoryBudget` as `CATEGORY_CACHES`, and the least recently used are
+// dropped first.
+//
+// Only used from the main thread.
+class ImageCache : public sigc::trackable {
+ public:
+  ImageCache();
+  ~ImageCache();
+
+  // Removes an image from the cache and returns it, or returns an empty
+  // pointer if it isn't cached.
+  Glib::RefPtr<Gdk::Pixbuf> take(const std::string& path);
+
+  // Adds an image, dropping the least recently used if the cache is full.
+  void add(const std::string& path, const Glib::RefPtr<Gdk::Pixbuf>& pixbuf);
+
+  // Starts loading the images that aren't cached or loading already, at
+  // `WorkQueue::PRIORITY_PREFETCH`, and cancels prefetches of other images.
+  // Nothing new is prefetched while the memory budget is full.
+  void prefetch(const std::vector<std::string>& paths);
+
+  // If an image is being prefetched, passes it to `slot` once it's loaded
+  // instead of caching it, and returns true. Only one image is awaited at a
+  // time, and it keeps loading when other images are prefetched.
+  bool await(const std::string& path, const ImageWorker::SlotFinished& slot);
+
+  // Stops awaiting an image. It's cached once it's loaded.
+  void cancel_await();
+
+  // Cancels prefetching and drops every image.
+  void clear();
+
+ private:
+  struct Entry {
+    std::string path;
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+  };
+
+  // Maximum number of images kept.
+  static const std::size_t MAX_IMAGES;
+
+  void on_prefetched(ImageWorker* worker,
+                     const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                     const std::string& path);
+
+  // Cancels a prefetch and makes its worker available again.
+  void cancel_prefetch(const std::string& path);
+
+  // Drops the least recently used image.
+  void remove_oldest();
+
+  // Drops images until `bytes` are freed. Returns the number of bytes freed.
+  std::size_t shed(std::size_t bytes);
+
+  std::list<Entry> entries;  // Most recently used first.
+  std::unordered_map<std::string, std::list<Entry>::iterator> entries_by_path;
+  std::size_t cached_bytes = 0;
+
+  // Workers of the prefetches in progress by path. Each prefetch has a
+  // worker of its own, so it can be cancelled without the others. Workers
+  // are kept for reuse.
+  std::unordered_map<std::string, ImageWorker*> prefetching;
+  std::vector<std::unique_ptr<ImageWorker>> workers;
+  std::vector<ImageWorker*> free_workers;
+
+  std::string awaited_path;
+  ImageWorker::SlotFinished awaited_slot;
+};
+
+#endif  // LUMEE_IMAGE_CACHE_H
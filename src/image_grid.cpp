@@ -0,0 +1,310 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "image_grid.h"
+#include "utils.h"
+
+#include <gdkmm/general.h>
+#include <glibmm/main.h>
+#include <gtkmm/icontheme.h>
+#include <gtkmm/tooltip.h>
+
+const int ImageGrid::CELL_PADDING = 8;
+
+ImageGrid::ImageGrid(BaseObjectType* cobject,
+                     const Glib::RefPtr<Gtk::Builder>& /*builder*/)
+    : Gtk::DrawingArea(cobject) {
+  add_events(Gdk::SCROLL_MASK | Gdk::SMOOTH_SCROLL_MASK |
+             Gdk::BUTTON_PRESS_MASK | Gdk::KEY_PRESS_MASK);
+  set_can_focus();
+  set_has_tooltip();
+  get_style_context()->add_class(GTK_STYLE_CLASS_VIEW);
+
+  vadjust->signal_value_changed().connect([this]() {
+    queue_draw();
+    update_visible_range();
+  });
+
+  // Same size as the list view's icons (`GTK_ICON_SIZE_DIALOG`).
+  Glib::RefPtr<Gtk::IconTheme> icon_theme = Gtk::IconTheme::get_default();
+  try {
+    icon_loading = icon_theme->load_icon("image-loading", 48);
+    icon_failed = icon_theme->load_icon("image-x-generic", 48);
+  } catch (const Glib::Error&) {}  // Cells are left empty without icons.
+}
+
+void ImageGrid::set_model(const Glib::RefPtr<ImageList>& model,
+                          const Glib::RefPtr<Gtk::TreeSelection>& selection) {
+  for (sigc::connection& connection : model_connections)
+    connection.disconnect();
+  model_connections.clear();
+  this->model = model;
+  this->selection = selection;
+
+  // Inserting or removing rows changes the number of grid rows, so the scroll
+  // bounds are updated. This is deferred, since folders are loaded one row at
+  // a time.
+  model_connections.push_back(model->signal_row_inserted().connect(
+      [this](const Gtk::TreeModel::Path&, const Gtk::TreeModel::iterator&) {
+        on_model_changed();
+      }));
+  model_connections.push_back(model->signal_row_deleted().connect(
+      [this](const Gtk::TreeModel::Path&) { on_model_changed(); }));
+  model_connections.push_back(model->signal_rows_reordered().connect(
+      [this](const Gtk::TreeModel::Path&, const Gtk::TreeModel::iterator&,
+             int*) { queue_draw(); }));
+  // A changed row (for example, a new thumbnail) only needs a redraw if its
+  // cell is visible.
+  model_connections.push_back(model->signal_row_changed().connect(
+      [this](const Gtk::TreeModel::Path& path,
+             const Gtk::TreeModel::iterator&) {
+        if (path[0] >= visible_first && path[0] <= visible_last) {
+          int size = cell_size();
+          queue_draw_area(x_offset + path[0] % columns * size,
+                          path[0] / columns * size -
+                              std::round(vadjust->get_value()),
+                          size, size);
+        }
+      }));
+  model_connections.push_back(model->signal_thumbnail_size_changed.connect(
+      sigc::mem_fun(*this, &ImageGrid::update_adjustment)));
+  model_connections.push_back(selection->signal_changed().connect(
+      sigc::mem_fun(*this, &ImageGrid::on_selection_changed)));
+  update_adjustment();
+}
+
+void ImageGrid::scroll_to_index(int index) {
+  int size = cell_size();
+  double top = index / columns * size, value = vadjust->get_value(),
+         page_size = vadjust->get_page_size();
+  if (top < value)
+    vadjust->set_value(top);
+  else if (top + size > value + page_size)
+    vadjust->set_value(top + size - page_size);
+}
+
+void ImageGrid::get_visible_range(int& first, int& last) const {
+  int size = cell_size();
+  double top = vadjust->get_value();
+  first = int(top / size) * columns;
+  last = std::min(cell_count(),
+                  (int((top + get_allocated_height() - 1) / size) + 1) *
+                      columns) - 1;
+}
+
+bool ImageGrid::on_draw(const Cairo::RefPtr<Cairo::Context>& cr) {
+  Glib::RefPtr<Gtk::StyleContext> style = get_style_context();
+  style->render_background(cr, 0, 0, get_allocated_width(),
+                           get_allocated_height());
+  int first = 0, last = -1;
+  get_visible_range(first, last);
+  if (first > last)
+    return true;
+
+  int size = cell_size(), top = std::round(vadjust->get_value()),
+      selected = selected_index();
+  Gtk::TreeModel::iterator iter = model->children()[first];
+  for (int index = first; index <= last && iter; ++index, ++iter) {
+    int x = x_offset + index % columns * size,
+        y = index / columns * size - top;
+    if (index == selected) {
+      style->context_save();
+      style->set_state(Gtk::STATE_FLAG_SELECTED);
+      style->render_background(cr, x, y, size, size);
+      style->context_restore();
+    }
+
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf = (*iter)[model->columns.thumbnail];
+    double factor = 1.0;
+    if ((*iter)[model->columns.thumbnail_failed])
+      pixbuf = icon_failed;
+    else if (!pixbuf)
+      pixbuf = icon_loading;
+    else  // It may be from before the size changed.
+      factor = std::min(1.0 / model->get_thumbnail_scale(),
+                        Dimensions(pixbuf).fit(model->get_thumbnail_size()));
+    if (pixbuf) {  // Center the pixbuf in the cell.
+      double width = pixbuf->get_width() * factor,
+             height = pixbuf->get_height() * factor;
+      cr->save();
+      cr->translate(std::round(x + (size - width) / 2),
+                    std::round(y + (size - height) / 2));
+      cr->scale(factor, factor);
+      Gdk::Cairo::set_source_pixbuf(cr, pixbuf, 0, 0);
+      cr->rectangle(0, 0, pixbuf->get_width(), pixbuf->get_height());
+      cr->fill();
+      cr->restore();
+    }
+  }
+  return true;
+}
+
+void ImageGrid::on_size_allocate(Gtk::Allocation& allocation) {
+  Gtk::DrawingArea::on_size_allocate(allocation);
+  update_adjustment();
+}
+
+bool ImageGrid::on_scroll_event(GdkEventScroll* event) {
+  double delta = 0.0;
+  if (event->direction == GDK_SCROLL_UP)
+    delta = -cell_size();
+  else if (event->direction == GDK_SCROLL_DOWN)
+    delta = cell_size();
+  else if (event->direction == GDK_SCROLL_SMOOTH)
+    delta = event->delta_y * cell_size();
+  else
+    return false;
+  vadjust->set_value(vadjust->get_value() + delta);
+  return true;
+}
+
+bool ImageGrid::on_button_press_event(GdkEventButton* event) {
+  if (event->button != 1)
+    return false;
+  grab_focus();
+  int index = index_at(event->x, event->y);
+  if (index == -1)
+    return true;
+  if (event->type == GDK_BUTTON_PRESS)
+    select_index(index);
+  else if (event->type == GDK_2BUTTON_PRESS)
+    signal_activated.emit(index);
+  return true;
+}
+
+bool ImageGrid::on_key_press_event(GdkEventKey* event) {
+  int count = cell_count(), index = selected_index(),
+      page = columns * std::max(1, get_allocated_height() / cell_size());
+  if (!count)
+    return Gtk::DrawingArea::on_key_press_event(event);
+
+  switch (event->keyval) {
+    case GDK_KEY_Left: case GDK_KEY_KP_Left:
+      index -= 1; break;
+    case GDK_KEY_Right: case GDK_KEY_KP_Right:
+      index += 1; break;
+    case GDK_KEY_Up: case GDK_KEY_KP_Up:
+      index -= columns; break;
+    case GDK_KEY_Down: case GDK_KEY_KP_Down:
+      index += columns; break;
+    case GDK_KEY_Page_Up: case GDK_KEY_KP_Page_Up:
+      index -= page; break;
+    case GDK_KEY_Page_Down: case GDK_KEY_KP_Page_Down:
+      index += page; break;
+    case GDK_KEY_Home: case GDK_KEY_KP_Home:
+      index = 0; break;
+    case GDK_KEY_End: case GDK_KEY_KP_End:
+      index = count - 1; break;
+    case GDK_KEY_Return: case GDK_KEY_KP_Enter: case GDK_KEY_ISO_Enter:
+      if (index != -1)
+        signal_activated.emit(index);
+      return true;
+    default:
+      return Gtk::DrawingArea::on_key_press_event(event);
+  }
+  select_index(std::max(0, std::min(count - 1, index)));
+  return true;
+}
+
+bool ImageGrid::on_query_tooltip(int x, int y, bool keyboard_tooltip,
+                                 const Glib::RefPtr<Gtk::Tooltip>& tooltip) {
+  int index = keyboard_tooltip ? selected_index() : index_at(x, y);
+  if (index == -1)
+    return false;
+  int size = cell_size();
+  Glib::ustring markup = model->children()[index][model->columns.tooltip];
+  tooltip->set_markup(markup);
+  tooltip->set_tip_area(Gdk::Rectangle(
+      x_offset + index % columns * size,
+      index / columns * size - std::round(vadjust->get_value()), size, size));
+  return true;
+}
+
+int ImageGrid::cell_size() const {
+  return (model ? model->get_thumbnail_size() :
+          ImageList::DEFAULT_THUMBNAIL_SIZE) + CELL_PADDING * 2;
+}
+
+int ImageGrid::index_at(double x, double y) const {
+  int size = cell_size();
+  if (x < x_offset || x >= x_offset + columns * size)
+    return -1;
+  int index = int((y + vadjust->get_value()) / size) * columns +
+              int((x - x_offset) / size);
+  return index < cell_count() ? index : -1;
+}
+
+int ImageGrid::selected_index() const {
+  if (!selection)
+    return -1;
+  Gtk::TreeModel::iterator iter = selection->get_selected();
+  return iter ? model->get_path(iter)[0] : -1;
+}
+
+void ImageGrid::select_index(int index) {
+  Gtk::TreeModel::Path path;
+  path.push_back(index);
+  selection->select(path);
+  scroll_to_index(index);
+}
+
+// When the number of columns changes, cells move to different rows. This
+// keeps either the selected cell or the first visible cell in view.
+void ImageGrid::update_adjustment() {
+  update_pending = false;
+  int size = cell_size(), anchor = selected_index();
+  if (anchor == -1 || anchor < visible_first || anchor > visible_last)
+    anchor = visible_first;
+
+  int prev_columns = columns;
+  columns = std::max(1, get_allocated_width() / size);
+  x_offset = (get_allocated_width() - columns * size) / 2;
+  int rows = (cell_count() + columns - 1) / columns,
+      height = get_allocated_height();
+  vadjust->configure(vadjust->get_value(), 0, rows * size, size / 2.0,
+                     std::max(size, height - size), height);
+  if (columns != prev_columns)
+    scroll_to_index(anchor);
+  queue_draw();
+  update_visible_range();
+}
+
+void ImageGrid::update_visible_range() {
+  int first = 0, last = -1;
+  get_visible_range(first, last);
+  if (first != visible_first || last != visible_last) {
+    visible_first = first;
+    visible_last = last;
+    signal_visible_range_changed.emit(first, last);
+  }
+}
+
+// Runs before the next redraw, so a burst of changes updates the scroll
+// bounds once.
+void ImageGrid::on_model_changed() {
+  if (!update_pending) {
+    update_pending = true;
+    Glib::signal_idle().connect_once(
+        sigc::mem_fun(*this, &ImageGrid::update_adjustment),
+        Glib::PRIORITY_HIGH_IDLE + 10);
+  }
+}
+
+void ImageGrid::on_selection_changed() {
+  queue_draw();
+  int index = selected_index();
+  if (index != -1 && is_drawable())
+    scroll_to_index(index);
+}
@@ -0,0 +1,115 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_IMAGE_GRID_H
+#define LUMEE_IMAGE_GRID_H
+
+#include "image_list.h"
+
+#include <gtkmm/adjustment.h>
+#include <gtkmm/builder.h>
+#include <gtkmm/drawingarea.h>
+#include <gtkmm/treeselection.h>
+
+// Displays an `ImageList` as a grid of fixed-size thumbnail cells.
+//
+// Unlike `Gtk::TreeView`, rows are never measured. Cell positions are
+// calculated from their index, and only the visible cells are drawn, so the
+// cost of scrolling doesn't depend on the number of images.
+class ImageGrid : public Gtk::DrawingArea {
+ public:
+  ImageGrid(BaseObjectType* cobject,
+            const Glib::RefPtr<Gtk::Builder>& builder);
+
+  // Sets the model and the selection. The selection normally belongs to
+  // another view of the same model, so that both views stay in sync.
+  void set_model(const Glib::RefPtr<ImageList>& model,
+                 const Glib::RefPtr<Gtk::TreeSelection>& selection);
+
+  // Returns the adjustment for scrolling vertically. Attach it to a scrollbar.
+  Glib::RefPtr<Gtk::Adjustment> get_vadjustment() { return vadjust; }
+
+  // Scrolls the least amount needed to show the cell at `index`.
+  void scroll_to_index(int index);
+
+  // Gets the indices of the first and last visible cells. If no cells are
+  // visible, `last` is less than `first`.
+  void get_visible_range(int& first, int& last) const;
+
+  // Emitted with the first and last visible indices when they change.
+  sigc::signal<void, int, int> signal_visible_range_changed;
+
+  // Emitted with a cell's index when it's double-clicked, or when Enter is
+  // pressed on the selected cell.
+  sigc::signal<void, int> signal_activated;
+
+ protected:
+  virtual bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr);
+  virtual void on_size_allocate(Gtk::Allocation& allocation);
+  virtual bool on_scroll_event(GdkEventScroll* event);
+  virtual bool on_button_press_event(GdkEventButton* event);
+  virtual bool on_key_press_event(GdkEventKey* event);
+  virtual bool on_query_tooltip(int x, int y, bool keyboard_tooltip,
+                                const Glib::RefPtr<Gtk::Tooltip>& tooltip);
+
+ private:
+  // Space around each thumbnail, in pixels.
+  static const int CELL_PADDING;
+
+  // Width and height of a cell, including padding.
+  int cell_size() const;
+
+  // Number of cells in the model.
+  int cell_count() const { return model ? model->children().size() : 0; }
+
+  // Returns the index of the cell at a point in widget coordinates, or -1 if
+  // there is none.
+  int index_at(double x, double y) const;
+
+  // Returns the index of the selected cell, or -1 if there is none.
+  int selected_index() const;
+
+  // Selects the cell at `index` and scrolls to it.
+  void select_index(int index);
+
+  // Updates the layout and scroll bounds after the size of the widget or model
+  // changes.
+  void update_adjustment();
+
+  // Emits `signal_visible_range_changed` if the range has changed.
+  void update_visible_range();
+
+  // Schedules `update_adjustment()` when rows are inserted or deleted.
+  void on_model_changed();
+  void on_selection_changed();
+
+  Glib::RefPtr<ImageList> model;
+  Glib::RefPtr<Gtk::TreeSelection> selection;
+  Glib::RefPtr<Gtk::Adjustment> vadjust = Gtk::Adjustment::create(
+      0, 0, 0);
+  std::vector<sigc::connection> model_connections;
+
+  int columns = 1;
+  int x_offset = 0;  // Centers the columns horizontally.
+  bool update_pending = false;
+
+  // Last range emitted by `signal_visible_range_changed`.
+  int visible_first = 0, visible_last = -1;
+
+  // Icons for cells that are loading or failed to load.
+  Glib::RefPtr<Gdk::Pixbuf> icon_loading, icon_failed;
+};
+
+#endif  // LUMEE_IMAGE_GRID_H
@@ -14,56 +14,139 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "image_list.h"
+#include "stats.h"
+#include "thumbnail_atlas.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <giomm/file.h>
+#include <glibmm/convert.h>
 #include <glibmm/fileutils.h>
+#include <glibmm/main.h>
 #include <glibmm/markup.h>
 #include <glibmm/miscutils.h>
 
-const int ImageList::THUMBNAIL_SIZE = 96;
-const int ImageList::ASYNC_NUM_FILES = 100;
+const int ImageList::DEFAULT_THUMBNAIL_SIZE = 96;
+const int ImageList::MIN_ASYNC_NUM_FILES = 100;
+const int ImageList::MAX_ASYNC_NUM_FILES = 3200;
+const gint64 ImageList::FAST_CHUNK_TIME = 10000;
+const gint64 ImageList::INSERT_TIME_SLICE = 4000;
+const std::size_t ImageList::MAX_PENDING_FILES = 10000;
 const std::string ImageList::FILE_ATTRIBUTES =
     G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN ","
+    G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","
     G_FILE_ATTRIBUTE_STANDARD_NAME ","
+    G_FILE_ATTRIBUTE_STANDARD_TYPE ","
     G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME ","
     G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","
     G_FILE_ATTRIBUTE_TIME_MODIFIED;
+const int ImageList::CHANGE_DELAY = 250;
+const int ImageList::THUMBNAIL_UPDATE_DELAY = 16;
+const int ImageList::THUMBNAIL_SIZE_DELAY = 300;
+const int ImageList::MAX_ACTIVE_FOLDERS = 8;
+const int ImageList::MAX_THUMBNAILS_LOADING = 16;
+
+std::size_t ImageList::charged_thumbnail_bytes = 0;
+
+// Builds the table of supported formats when run by the work queue.
+struct ImageList::FormatsItem : public WorkQueue::Item {
+  virtual void run() {
+    get_supported_mime_types();
+    delete this;
+  }
+  virtual void discard() { delete this; }
+};
+
+// Reads a folder's snapshot when run by the work queue, and passes it to the
+// main thread.
+struct ImageList::SnapshotLoadItem : public WorkQueue::Item {
+  virtual void run() {
+    found = FolderSnapshot::load(folder_path, recursive, entries);
+    g_idle_add_full(G_PRIORITY_HIGH_IDLE, &ImageList::on_snapshot_loaded, this,
+                    nullptr);
+  }
+  virtual void discard() { delete this; }
+
+  ImageList* list = nullptr;
+  std::weak_ptr<FolderScan> scan;
+  std::string folder_path;
+  bool recursive = false;
+  bool found = false;
+  std::vector<FolderSnapshot::Entry> entries;
+};
+
+// Writes a folder's snapshot when run by the work queue.
+struct ImageList::SnapshotSaveItem : public WorkQueue::Item {
+  virtual void run() {
+    FolderSnapshot::save(folder_path, recursive, entries);
+    delete this;
+  }
+  virtual void discard() { delete this; }
+
+  std::string folder_path;
+  bool recursive = false;
+  std::vector<FolderSnapshot::Entry> entries;
+};
 
 ImageList::ImageList() {
   set_column_types(columns);
   set_sort_func(columns.display_name_collation_key,
                 sigc::mem_fun(*this, &ImageList::compare_display_names));
+  MemoryBudget::get_default().connect_shedder(
+      MemoryBudget::CATEGORY_THUMBNAILS,
+      sigc::mem_fun(*this, &ImageList::shed_thumbnails));
+}
 
-  // Build a list of supported image MIME types.
-  for (Gdk::PixbufFormat format : Gdk::Pixbuf::get_formats()) {
-    std::vector<Glib::ustring> mime_types = format.get_mime_types();
-    supported_mime_types.insert(end(supported_mime_types),
-                                begin(mime_types), end(mime_types));
-  }
+// A snapshot that's still being read is dropped once it's back in the main
+// thread. Rows are cleared here, so the slabs freed with their thumbnails
+// are taken out of the memory budget.
+ImageList::~ImageList() {
+  if (current_scan)
+    current_scan->cancellable->cancel();
+  clear();
+  update_thumbnail_bytes();
 }
 
 void ImageList::open_folder(const SlotFolderReady& slot,
-                            const Glib::RefPtr<Gio::File>& folder) {
+                            const Glib::RefPtr<Gio::File>& folder,
+                            bool recursive) {
   // Cancel everything from the previous folder.
-  if (cancellable)
-    cancellable->cancel();
-  image_worker.cancel_all();
+  if (current_scan) {
+    current_scan->cancellable->cancel();
+    current_scan->paused_folders.clear();  // They refer back to the scan.
+  }
+  cancel_thumbnails();
+  thumbnails_wanted.clear();
+  if (monitor)
+    monitor->cancel();
+  change_timeout.disconnect();
+  changed_paths.clear();
+  rows_by_path.clear();
   clear();
+  update_thumbnail_bytes();
 
-  AsyncFolderData data(slot, folder);
-  cancellable = data.cancellable;
+  current_scan = std::make_shared<FolderScan>(slot, folder, recursive);
+  load_snapshot(current_scan);
+  // Start monitoring first, so changes made during enumeration aren't missed.
+  try {
+    monitor = folder->monitor_directory(current_scan->cancellable,
+                                        Gio::FILE_MONITOR_SEND_MOVED);
+    monitor->signal_changed().connect(sigc::mem_fun(
+        *this, &ImageList::on_folder_changed));
+  } catch (const Gio::Error&) {
+    monitor.reset();  // The list just won't be updated.
+  }
+  ++current_scan->active_folders;
   folder->enumerate_children_async(
       sigc::bind(sigc::mem_fun(*this, &ImageList::on_enumerate_children),
-                 data), cancellable, FILE_ATTRIBUTES);
+                 AsyncFolderData(current_scan, folder, true)),
+      current_scan->cancellable, FILE_ATTRIBUTES, Gio::FILE_QUERY_INFO_NONE,
+      current_scan->io_priority);
 }
 
 Gtk::TreeModel::iterator ImageList::find(const std::string& path) {
-  for (iterator iter : children()) {
-    if (std::string((*iter)[columns.path]) == path)
-      return iter;
-  }
-  return iterator();
+  auto found = rows_by_path.find(path);
+  return found != rows_by_path.end() ? found->second : iterator();
 }
 
 // static
@@ -71,78 +154,605 @@ Glib::RefPtr<ImageList> ImageList::create() {
   return Glib::RefPtr<ImageList>(new ImageList());
 }
 
+// The formats are needed as soon as a folder is listed, so they're built
+// ahead of the background work.
+//
+// static
+void ImageList::load_formats_async() {
+  WorkQueue::get_default().push(new FormatsItem,
+                                WorkQueue::PRIORITY_INTERACTIVE);
+}
+
+// On network file systems, each folder takes at least one round trip, so
+// enumerating several at once keeps the connection busy.
+void ImageList::start_folders(const std::shared_ptr<FolderScan>& scan) {
+  while (scan->active_folders < MAX_ACTIVE_FOLDERS &&
+         !scan->pending_folders.empty()) {
+    Glib::RefPtr<Gio::File> folder = scan->pending_folders.front();
+    scan->pending_folders.pop_front();
+    ++scan->active_folders;
+    folder->enumerate_children_async(
+        sigc::bind(sigc::mem_fun(*this, &ImageList::on_enumerate_children),
+                   AsyncFolderData(scan, folder, false)),
+        scan->cancellable, FILE_ATTRIBUTES, Gio::FILE_QUERY_INFO_NONE,
+        scan->io_priority);
+  }
+}
+
 // Gets the enumerator and starts the file loop.
 void ImageList::on_enumerate_children(
     const Glib::RefPtr<Gio::AsyncResult>& result, AsyncFolderData& data) {
+  Trace::add_span("ImageList enumerate_children", data.request_time,
+                  g_get_monotonic_time());
+  Trace::Span span("ImageList::on_enumerate_children");
   try {
     data.enumerator = data.folder->enumerate_children_finish(result);
   } catch (const Gio::Error& error) {
     if (error.code() != Gio::Error::CANCELLED)
-      data.slot_folder_ready(false);
+      finish_folder(data, false);
     return;
   }
-  data.enumerator->next_files_async(
-      sigc::bind(sigc::mem_fun(*this, &ImageList::on_next_files), data),
-      data.cancellable, ASYNC_NUM_FILES, Glib::PRIORITY_HIGH_IDLE);
+  request_next_files(data);
 }
 
-// Appends all the images in this chunk of files.
+// Queues the images in this chunk of files, and queues subfolders in
+// recursive mode. Symbolic links to folders are skipped to avoid loops.
 void ImageList::on_next_files(const Glib::RefPtr<Gio::AsyncResult>& result,
-                              const AsyncFolderData& data) {
+                              AsyncFolderData& data) {
+  Trace::add_span("ImageList next_files", data.request_time,
+                  g_get_monotonic_time());
+  Trace::Span span("ImageList::on_next_files");
   std::vector<Glib::RefPtr<Gio::FileInfo>> files;
   try {
     files = data.enumerator->next_files_finish(result);
   } catch (const Gio::Error& error) {
     if (error.code() != Gio::Error::CANCELLED)
-      data.slot_folder_ready(false);
+      finish_folder(data, false);
     return;
   }
+
+  FolderScan& scan = *data.scan;
+  if (scan.failed)  // Finished just before the scan was cancelled.
+    return;
+  if (int(files.size()) == scan.num_files && !scan.over_budget &&
+      g_get_monotonic_time() - data.request_time < FAST_CHUNK_TIME)
+    scan.num_files = std::min(scan.num_files * 2, MAX_ASYNC_NUM_FILES);
+  // The first chunk is fetched quickly so the window isn't empty for long.
+  // After that, rendering and input take priority.
+  scan.io_priority = Glib::PRIORITY_DEFAULT_IDLE;
+
   for (Glib::RefPtr<Gio::FileInfo> info : files) {
-    if (!info->is_hidden() && is_supported_mime_type(info->get_content_type()))
-      append_file(data.folder->get_path(), info);
+    if (is_image(info))
+      scan.pending_files.emplace_back(
+          Glib::build_filename(data.folder_path, info->get_name()), info);
+    else if (scan.recursive && !info->is_hidden() && !info->is_symlink() &&
+             info->get_file_type() == Gio::FILE_TYPE_DIRECTORY)
+      scan.pending_folders.push_back(data.folder->get_child(
+          info->get_name()));
   }
+  if (!scan.insert_scheduled && !scan.pending_files.empty()) {
+    scan.insert_scheduled = true;
+    Glib::signal_idle().connect(sigc::bind(sigc::mem_fun(
+        *this, &ImageList::insert_files), data.scan),
+        Glib::PRIORITY_DEFAULT_IDLE);
+  }
+  start_folders(data.scan);
 
-  if (files.size())  // Recurse until there are no more files.
-    data.enumerator->next_files_async(
-        sigc::bind(sigc::mem_fun(*this, &ImageList::on_next_files), data),
-        data.cancellable, ASYNC_NUM_FILES, Glib::PRIORITY_HIGH_IDLE);
+  if (!files.size())  // Recurse until there are no more files.
+    finish_folder(data, true);
+  else if (scan.pending_files.size() >= MAX_PENDING_FILES)
+    scan.paused_folders.push_back(data);
   else
-    data.slot_folder_ready(true);
+    request_next_files(data);
 }
 
-void ImageList::append_file(const std::string& folder_path,
-                            const Glib::RefPtr<Gio::FileInfo>& info) {
-  iterator iter = append();
-  Row row = *iter;
-  row[columns.path] = Glib::build_filename(folder_path, info->get_name());
-  row[columns.time_modified] = info->get_attribute_uint64(
+void ImageList::request_next_files(AsyncFolderData& data) {
+  FolderScan& scan = *data.scan;
+  if (scan.over_budget) {
+    scan.num_files = std::max(scan.num_files / 2, MIN_ASYNC_NUM_FILES);
+    scan.over_budget = false;
+  }
+  data.request_time = g_get_monotonic_time();
+  data.enumerator->next_files_async(
+      sigc::bind(sigc::mem_fun(*this, &ImageList::on_next_files), data),
+      scan.cancellable, scan.num_files, scan.io_priority);
+}
+
+// Runs at a lower priority than redrawing, and returns to the main loop before
+// a frame's worth of time has passed.
+bool ImageList::insert_files(const std::shared_ptr<FolderScan>& scan) {
+  if (scan->cancellable->is_cancelled())
+    return false;
+
+  Trace::Span span("ImageList::insert_files");
+  gint64 end_time = g_get_monotonic_time() + INSERT_TIME_SLICE;
+  while (!scan->pending_files.empty() && g_get_monotonic_time() < end_time) {
+    const PendingFile& file = scan->pending_files.front();
+    add_file(file.path, file.info);
+    scan->pending_files.pop_front();
+  }
+
+  if (scan->pending_files.size() < MAX_PENDING_FILES / 2) {
+    std::vector<AsyncFolderData> paused;
+    paused.swap(scan->paused_folders);
+    for (AsyncFolderData& data : paused)
+      request_next_files(data);
+  }
+  if (!scan->pending_files.empty()) {
+    scan->over_budget = true;
+    return true;
+  }
+  scan->insert_scheduled = false;
+  check_scan_finished(*scan);
+  return false;
+}
+
+void ImageList::finish_folder(const AsyncFolderData& data, bool success) {
+  FolderScan& scan = *data.scan;
+  --scan.active_folders;
+  if (scan.failed)
+    return;
+  else if (!success && data.is_top) {
+    // Subfolders that are still being listed are stopped now, rather than
+    // filling the queues until they finish.
+    scan.failed = true;
+    scan.cancellable->cancel();
+    scan.pending_folders.clear();
+    scan.pending_files.clear();
+    scan.paused_folders.clear();
+    scan.slot_folder_ready(false);
+    return;
+  }
+  start_folders(data.scan);
+  check_scan_finished(scan);
+}
+
+void ImageList::check_scan_finished(FolderScan& scan) {
+  if (scan.failed || scan.finished || scan.active_folders ||
+      !scan.pending_files.empty() || &scan != current_scan.get())
+    return;
+  scan.finished = true;
+
+  if (scan.from_snapshot) {  // Remove rows for files that no longer exist.
+    std::vector<std::string> missing_paths;
+    for (const auto& row : rows_by_path) {
+      if (!scan.found_paths.count(row.first))
+        missing_paths.push_back(row.first);
+    }
+    for (const std::string& path : missing_paths)
+      remove_file(path);
+    scan.found_paths.clear();
+  }
+  save_snapshot(scan);
+  scan.slot_folder_ready(true);
+}
+
+// The snapshot is read at interactive priority, since it's one small file and
+// the list is shown from it. At a lower priority, it could wait behind other
+// work until the folder's own enumeration had finished.
+void ImageList::load_snapshot(const std::shared_ptr<FolderScan>& scan) {
+  SnapshotLoadItem* item = new SnapshotLoadItem;
+  item->list = this;
+  item->scan = scan;
+  item->folder_path = scan->folder_path;
+  item->recursive = scan->recursive;
+  WorkQueue::get_default().push(item, WorkQueue::PRIORITY_INTERACTIVE);
+}
+
+// Runs in the main thread. A scan that's been cancelled belongs to a folder
+// that's no longer open, or to a list that's been destroyed.
+//
+// static
+gboolean ImageList::on_snapshot_loaded(gpointer data) {
+  SnapshotLoadItem* item = static_cast<SnapshotLoadItem*>(data);
+  std::shared_ptr<FolderScan> scan = item->scan.lock();
+  if (scan && !scan->cancellable->is_cancelled() && !scan->finished) {
+    Stats::get_default().increment(item->found ?
+                                   Stats::COUNTER_SNAPSHOT_HITS :
+                                   Stats::COUNTER_SNAPSHOT_MISSES);
+    if (item->found)
+      item->list->add_snapshot(*scan, item->entries);
+  }
+  delete item;
+  return false;
+}
+
+// Files that were enumerated before the snapshot arrived are already in the
+// list, so they count as found, and their entries are skipped. Rows are
+// sorted as they're added, like enumerated files.
+void ImageList::add_snapshot(
+    FolderScan& scan, const std::vector<FolderSnapshot::Entry>& entries) {
+  Trace::Span span("ImageList::add_snapshot");
+  for (const auto& row : rows_by_path)
+    scan.found_paths.insert(row.first);
+  scan.from_snapshot = true;
+  for (const FolderSnapshot::Entry& entry : entries) {
+    std::string path = Glib::build_filename(scan.folder_path, entry.name);
+    if (!rows_by_path.count(path))
+      set_file(iterator(), path, Glib::filename_display_basename(path),
+               entry.display_name_collation_key, entry.time_modified);
+  }
+}
+
+void ImageList::save_snapshot(const FolderScan& scan) {
+  // Paths in the list start with the folder path and a separator.
+  std::size_t prefix_size =
+      Glib::build_filename(scan.folder_path, "x").size() - 1;
+  SnapshotSaveItem* item = new SnapshotSaveItem;
+  item->folder_path = scan.folder_path;
+  item->recursive = scan.recursive;
+  item->entries.reserve(rows_by_path.size());
+  for (iterator iter : children()) {
+    FolderSnapshot::Entry entry;
+    entry.name = std::string((*iter)[columns.path]).substr(prefix_size);
+    entry.time_modified = (*iter)[columns.time_modified];
+    entry.display_name_collation_key = std::string(
+        (*iter)[columns.display_name_collation_key]);
+    item->entries.push_back(std::move(entry));
+  }
+  WorkQueue::get_default().push(item, WorkQueue::PRIORITY_BACKGROUND);
+}
+
+// A file can be added more than once if it changes during enumeration.
+void ImageList::add_file(const std::string& path,
+                         const Glib::RefPtr<Gio::FileInfo>& info) {
+  if (current_scan->from_snapshot && !current_scan->finished)
+    current_scan->found_paths.insert(path);
+  guint64 time_modified = info->get_attribute_uint64(
       G_FILE_ATTRIBUTE_TIME_MODIFIED);
-  row[columns.display_name_collation_key] = collate_key_for_filename(
-      info->get_display_name());
-  row[columns.tooltip] = "<b>" +
-      Glib::Markup::escape_text(info->get_display_name()) + "</b>\n" +
-      Glib::Markup::escape_text(Glib::DateTime::create_now_local(
-          row[columns.time_modified]).format("%c"));
+  iterator iter = find(path);
+  if (!iter || guint64((*iter)[columns.time_modified]) != time_modified)
+    set_file(iter, path, info->get_display_name(),
+             collate_key_for_filename(info->get_display_name()),
+             time_modified);
+}
+
+void ImageList::set_file(iterator iter, const std::string& path,
+                         const Glib::ustring& display_name,
+                         const std::string& display_name_collation_key,
+                         guint64 time_modified) {
+  bool exists = bool(iter);
+  if (!exists) {
+    iter = append();
+    rows_by_path[path] = iter;
+  }
 
+  Row row = *iter;
+  row[columns.path] = path;
+  row[columns.time_modified] = time_modified;
+  row[columns.display_name_collation_key] = display_name_collation_key;
+  row[columns.tooltip] = "<b>" + Glib::Markup::escape_text(display_name) +
+      "</b>\n" + Glib::Markup::escape_text(Glib::DateTime::create_now_local(
+          time_modified).format("%c"));
+
+  // An existing row keeps its old thumbnail until the new one is loaded.
   row[columns.thumbnail_failed] = false;
-  image_worker.load(std::bind(&ImageList::on_thumbnail_loaded, this,
-                              std::placeholders::_1, iter),
-                    row[columns.path], THUMBNAIL_SIZE);
+  thumbnails_wanted.insert(path);
+  thumbnail_queue.push_back(path);
+  schedule_thumbnails();
+  if (exists)
+    signal_file_changed.emit(iter);
+}
+
+void ImageList::remove_file(const std::string& path) {
+  auto found = rows_by_path.find(path);
+  if (found != rows_by_path.end()) {
+    set_thumbnail(found->second, Glib::RefPtr<Gdk::Pixbuf>());
+    erase(found->second);
+    rows_by_path.erase(found);
+    thumbnails_wanted.erase(path);
+  }
 }
 
+bool ImageList::is_image(const Glib::RefPtr<Gio::FileInfo>& info) {
+  return !info->is_hidden() && is_supported_mime_type(
+      info->get_content_type());
+}
+
+// static
 bool ImageList::is_supported_mime_type(const Glib::ustring& mime_type) {
-  return std::find(begin(supported_mime_types), end(supported_mime_types),
-                   mime_type) != end(supported_mime_types);
+  const std::vector<Glib::ustring>& mime_types = get_supported_mime_types();
+  return std::find(begin(mime_types), end(mime_types), mime_type) !=
+         end(mime_types);
 }
 
-void ImageList::on_thumbnail_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
-                                    const iterator& iter) {
-  if (!iter)  // The file may have been removed from the list by this point.
+// static
+const std::vector<Glib::ustring>& ImageList::get_supported_mime_types() {
+  static const std::vector<Glib::ustring> mime_types =
+      load_supported_mime_types();
+  return mime_types;
+}
+
+// static
+std::vector<Glib::ustring> ImageList::load_supported_mime_types() {
+  Trace::Span span("ImageList::load_supported_mime_types");
+  gint64 start_time = g_get_monotonic_time();
+  std::vector<Glib::ustring> supported_mime_types;
+  for (Gdk::PixbufFormat format : Gdk::Pixbuf::get_formats()) {
+    std::vector<Glib::ustring> mime_types = format.get_mime_types();
+    supported_mime_types.insert(end(supported_mime_types),
+                                begin(mime_types), end(mime_types));
+  }
+  Stats::get_default().set_formats_time(g_get_monotonic_time() - start_time);
+  return supported_mime_types;
+}
+
+// `CHANGED` events aren't used, since they're sent repeatedly while a file is
+// being written. `CHANGES_DONE_HINT` follows them once writing is finished.
+void ImageList::on_folder_changed(const Glib::RefPtr<Gio::File>& file,
+                                  const Glib::RefPtr<Gio::File>& other_file,
+                                  Gio::FileMonitorEvent event) {
+  if (event == Gio::FILE_MONITOR_EVENT_MOVED && other_file)
+    changed_paths.insert(other_file->get_path());
+  if (event == Gio::FILE_MONITOR_EVENT_MOVED ||
+      event == Gio::FILE_MONITOR_EVENT_CREATED ||
+      event == Gio::FILE_MONITOR_EVENT_DELETED ||
+      event == Gio::FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+      event == Gio::FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+    changed_paths.insert(file->get_path());
+  else
+    return;
+
+  if (!change_timeout.connected())
+    change_timeout = Glib::signal_timeout().connect(sigc::bind_return(
+        sigc::mem_fun(*this, &ImageList::query_changed_files), false),
+        CHANGE_DELAY);
+}
+
+// Events only say which files changed. Querying each file afterward gives its
+// current state, regardless of how many events there were or in what order.
+void ImageList::query_changed_files() {
+  auto batch = std::make_shared<ChangeBatch>();
+  batch->queries_pending = changed_paths.size();
+  for (const std::string& path : changed_paths) {
+    Glib::RefPtr<Gio::File> file = Gio::File::create_for_path(path);
+    file->query_info_async(
+        sigc::bind(sigc::mem_fun(*this, &ImageList::on_query_info), file,
+                   batch), current_scan->cancellable, FILE_ATTRIBUTES);
+  }
+  changed_paths.clear();
+}
+
+// A file that can't be queried (usually because it was deleted or moved) is
+// removed from the list, along with files that are no longer images.
+void ImageList::on_query_info(const Glib::RefPtr<Gio::AsyncResult>& result,
+                              const Glib::RefPtr<Gio::File>& file,
+                              const std::shared_ptr<ChangeBatch>& batch) {
+  Glib::RefPtr<Gio::FileInfo> info;
+  try {
+    info = file->query_info_finish(result);
+  } catch (const Gio::Error& error) {
+    if (error.code() == Gio::Error::CANCELLED)
+      return;
+  }
+  batch->results.emplace_back(file->get_path(), info);
+  if (--batch->queries_pending)
+    return;
+
+  for (const auto& change : batch->results) {
+    if (change.second && is_image(change.second))
+      add_file(change.first, change.second);
+    else
+      remove_file(change.first);
+  }
+}
+
+void ImageList::set_visible_range(int first, int last) {
+  visible_first = first;
+  visible_last = last;
+  schedule_thumbnails();
+}
+
+// Thumbnails that already loaded are added at the old size, and ones still
+// loading are cancelled, so nothing loads until the size settles.
+void ImageList::set_thumbnail_size(int size, int scale) {
+  if (size == thumbnail_size && scale == thumbnail_scale)
     return;
-  else if (pixbuf)
-    (*iter)[columns.thumbnail] = pixbuf;
+  update_thumbnails();
+  cancel_thumbnails();
+  thumbnail_size = size;
+  thumbnail_scale = scale;
+  thumbnail_size_timeout.disconnect();
+  thumbnail_size_timeout = Glib::signal_timeout().connect(sigc::bind_return(
+      sigc::mem_fun(*this, &ImageList::requeue_thumbnails), false),
+      THUMBNAIL_SIZE_DELAY);
+  signal_thumbnail_size_changed.emit();
+}
+
+void ImageList::set_thumbnails_enabled(bool enabled) {
+  thumbnails_enabled = enabled;
+  if (enabled)
+    schedule_thumbnails();
   else
-    (*iter)[columns.thumbnail_failed] = true;
+    thumbnail_idle.disconnect();
+}
+
+void ImageList::schedule_thumbnails() {
+  if (thumbnails_enabled && !thumbnail_idle.connected())
+    thumbnail_idle = Glib::signal_idle().connect(sigc::bind_return(
+        sigc::mem_fun(*this, &ImageList::load_thumbnails), false),
+        Glib::PRIORITY_HIGH_IDLE);
+}
+
+// Visible thumbnails aren't limited, since there are only as many as fit in
+// the view. Other thumbnails stop loading once the memory budget is full and
+// cached images have been shed to make room.
+void ImageList::load_thumbnails() {
+  if (visible_first >= 0 && !thumbnails_wanted.empty()) {
+    Gtk::TreeModel::Path first_path;
+    first_path.push_back(visible_first);
+    iterator iter = get_iter(first_path);
+    for (int i = visible_first; iter && i <= visible_last; ++i, ++iter) {
+      std::string path = (*iter)[columns.path];
+      if (thumbnails_wanted.count(path))
+        load_thumbnail(path, WorkQueue::PRIORITY_VISIBLE);
+    }
+  }
+  while (thumbnails_loading.size() < std::size_t(MAX_THUMBNAILS_LOADING) &&
+         !thumbnail_queue.empty() &&
+         MemoryBudget::get_default().make_room(
+             MemoryBudget::CATEGORY_THUMBNAILS)) {
+    std::string path = std::move(thumbnail_queue.front());
+    thumbnail_queue.pop_front();
+    if (thumbnails_wanted.count(path))
+      load_thumbnail(path, WorkQueue::PRIORITY_BACKGROUND);
+  }
+}
+
+void ImageList::cancel_thumbnails() {
+  image_worker.cancel_all();
+  thumbnail_queue.clear();
+  thumbnails_loading.clear();
+  thumbnail_idle.disconnect();
+  thumbnail_timeout.disconnect();
+  loaded_thumbnails.clear();
+}
+
+void ImageList::load_thumbnail(const std::string& path,
+                               WorkQueue::Priority priority) {
+  guint64 time_modified = 0;
+  if (iterator iter = find(path))
+    time_modified = (*iter)[columns.time_modified];
+  thumbnails_wanted.erase(path);
+  thumbnails_loading.insert(path);
+  image_worker.load_thumbnail(
+      [this](const Glib::RefPtr<Gdk::Pixbuf>& pixbuf, const std::string& path) {
+        on_thumbnail_loaded(pixbuf, path);
+      }, path, time_modified, thumbnail_size * thumbnail_scale, priority);
+}
+
+void ImageList::on_thumbnail_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                                    const std::string& path) {
+  thumbnails_loading.erase(path);
+  schedule_thumbnails();
+  loaded_thumbnails.emplace_back(path, pixbuf);
+  if (!thumbnail_timeout.connected())
+    thumbnail_timeout = Glib::signal_timeout().connect(sigc::bind_return(
+        sigc::mem_fun(*this, &ImageList::update_thumbnails), false),
+        THUMBNAIL_UPDATE_DELAY);
+}
+
+void ImageList::update_thumbnails() {
+  Trace::Span span("ImageList::update_thumbnails");
+  for (const auto& thumbnail : loaded_thumbnails) {
+    iterator iter = find(thumbnail.first);
+    if (!iter)  // The file may have been removed from the list by this point.
+      continue;
+    if (thumbnail.second) {
+      set_thumbnail(iter, thumbnail.second);
+      (*iter)[columns.thumbnail_level] = thumbnail_size * thumbnail_scale;
+    } else {
+      (*iter)[columns.thumbnail_failed] = true;
+    }
+  }
+  loaded_thumbnails.clear();
+}
+
+// Rows with a failed thumbnail stay failed, since their files haven't
+// changed. Thumbnails that started loading since the size changed are
+// already at the current size.
+void ImageList::requeue_thumbnails() {
+  update_thumbnails();
+  thumbnails_wanted.clear();
+  thumbnail_queue.clear();
+  int pixel_size = thumbnail_size * thumbnail_scale;
+  for (iterator iter : children()) {
+    Row row = *iter;
+    Glib::RefPtr<Gdk::Pixbuf> thumbnail = row[columns.thumbnail];
+    int level = row[columns.thumbnail_level];
+    if (row[columns.thumbnail_failed] || (thumbnail && level >= pixel_size))
+      continue;
+    std::string path = row[columns.path];
+    if (thumbnails_loading.count(path))
+      continue;
+    thumbnails_wanted.insert(path);
+    thumbnail_queue.push_back(path);
+  }
+  schedule_thumbnails();
+}
+
+void ImageList::set_thumbnail(const iterator& iter,
+                              const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) {
+  (*iter)[columns.thumbnail] = pixbuf;
+  update_thumbnail_bytes();
+}
+
+// Thumbnails that are still loading are counted too, since they're already
+// in slabs.
+//
+// static
+void ImageList::update_thumbnail_bytes() {
+  MemoryBudget& budget = MemoryBudget::get_default();
+  std::size_t size = ThumbnailAtlas::get_default().get_size();
+  budget.remove(MemoryBudget::CATEGORY_THUMBNAILS, charged_thumbnail_bytes);
+  charged_thumbnail_bytes = size;
+  budget.add(MemoryBudget::CATEGORY_THUMBNAILS, size);
+}
+
+// Rows within a screenful of the visible range keep their thumbnails. Slabs
+// are shed starting with the one whose furthest thumbnail is furthest away:
+// its other thumbnails are dropped, and the ones being kept are copied to
+// other slabs. Slabs with more thumbnails to keep than to drop are left
+// alone. Slabs may still be held elsewhere, such as by other lists, so the
+// bytes freed are measured from the atlas.
+//
+// A dropped thumbnail is wanted again but not queued, so it's only reloaded
+// once it's visible.
+std::size_t ImageList::shed_thumbnails(std::size_t bytes) {
+  struct Slab {
+    int distance = 0;  // Of its furthest thumbnail.
+    std::vector<iterator> dropped, kept;
+  };
+  ThumbnailAtlas& atlas = ThumbnailAtlas::get_default();
+  int margin = visible_last - visible_first + 1;
+  std::unordered_map<const void*, Slab> slabs_by_key;
+  int i = 0;
+  for (iterator iter = children().begin(); iter; ++iter, ++i) {
+    Glib::RefPtr<Gdk::Pixbuf> thumbnail = (*iter)[columns.thumbnail];
+    const void* key = thumbnail ? atlas.get_slab(thumbnail) : nullptr;
+    if (!key)
+      continue;
+    int distance = i;
+    if (visible_first >= 0)
+      distance = i < visible_first ? visible_first - i : i - visible_last;
+    Slab& slab = slabs_by_key[key];
+    slab.distance = std::max(slab.distance, distance);
+    if (visible_first < 0 || distance > margin)
+      slab.dropped.push_back(iter);
+    else
+      slab.kept.push_back(iter);
+  }
+  std::vector<std::pair<const void*, const Slab*>> slabs;
+  for (const auto& slab : slabs_by_key) {
+    if (!slab.second.dropped.empty() &&
+        slab.second.kept.size() <= slab.second.dropped.size())
+      slabs.emplace_back(slab.first, &slab.second);
+  }
+  std::sort(slabs.begin(), slabs.end(),
+            [](const std::pair<const void*, const Slab*>& a,
+               const std::pair<const void*, const Slab*>& b) {
+              return a.second->distance > b.second->distance;
+            });
+
+  std::size_t start_size = atlas.get_size(), freed = 0;
+  for (const auto& slab : slabs) {
+    if (freed >= bytes)
+      break;
+    atlas.retire(slab.first);
+    for (const iterator& iter : slab.second->dropped) {
+      (*iter)[columns.thumbnail] = Glib::RefPtr<Gdk::Pixbuf>();
+      std::string path = (*iter)[columns.path];
+      thumbnails_wanted.insert(path);
+    }
+    for (const iterator& iter : slab.second->kept) {
+      Glib::RefPtr<Gdk::Pixbuf> thumbnail = (*iter)[columns.thumbnail];
+      (*iter)[columns.thumbnail] = atlas.copy(thumbnail);
+    }
+    std::size_t size = atlas.get_size();
+    freed = size < start_size ? start_size - size : 0;
+  }
+  update_thumbnail_bytes();
+  return freed;
 }
 
 int ImageList::compare_display_names(const iterator& iter_a,
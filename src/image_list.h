@@ -16,11 +16,20 @@
 #ifndef LUMEE_IMAGE_LIST_H
 #define LUMEE_IMAGE_LIST_H
 
+#include "folder_snapshot.h"
 #include "image_worker.h"
+#include "memory_budget.h"
 
 #include <giomm/fileenumerator.h>
+#include <giomm/filemonitor.h>
 #include <gtkmm/liststore.h>
 
+#include <deque>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
 // Model that stores a list of image files with thumbnails.
 class ImageList : public Gtk::ListStore {
  public:
@@ -33,7 +42,7 @@ class ImageList : public Gtk::ListStore {
   struct Columns : public Gtk::TreeModelColumnRecord {
     Columns() { add(path); add(time_modified); add(thumbnail);
                 add(display_name_collation_key); add(tooltip);
-                add(thumbnail_failed); }
+                add(thumbnail_failed); add(thumbnail_level); }
 
     Gtk::TreeModelColumn<std::string> path;
     Gtk::TreeModelColumn<guint64> time_modified;
@@ -41,67 +50,331 @@ class ImageList : public Gtk::ListStore {
     Gtk::TreeModelColumn<std::string> display_name_collation_key;
     Gtk::TreeModelColumn<Glib::ustring> tooltip;
     Gtk::TreeModelColumn<bool> thumbnail_failed;
+    Gtk::TreeModelColumn<int> thumbnail_level;  // Pixel size it loaded at.
   };
 
   ImageList();
+  ~ImageList();
 
   // Opens a folder asynchronously, clearing the list and adding images from
-  // this folder.
+  // this folder. Afterward, the list is kept up to date as files in the folder
+  // are created, deleted, renamed or modified.
+  //
+  // If the folder has a snapshot from when it was last opened, the list is
+  // filled from it as soon as the work queue has read it. The folder is
+  // enumerated meanwhile to reconcile the differences, and the snapshot is
+  // updated in the background when it's ready.
+  //
+  // If `recursive` is true, images in subfolders are added too. Subfolders are
+  // enumerated concurrently, and images are added while enumeration is still
+  // running. Only the top folder is monitored for changes.
   void open_folder(const SlotFolderReady& slot,
-                   const Glib::RefPtr<Gio::File>& folder);
+                   const Glib::RefPtr<Gio::File>& folder,
+                   bool recursive = false);
 
   // Searches for an image with a given file path. If not found, returns an
   // empty iterator.
   iterator find(const std::string& path);
 
+  // Sets the rows shown by the view, which get their thumbnails first. `first`
+  // is -1 if no rows are shown.
+  void set_visible_range(int first, int last);
+
+  // Sets the maximum width and height of thumbnails, and the scale factor of
+  // the display they're shown on. Thumbnails are `size * scale` pixels, and
+  // should be drawn at `1 / scale`.
+  //
+  // Rows keep their old thumbnails, which are drawn scaled down if they're
+  // too big. Once the size has settled, rows whose thumbnails loaded at a
+  // smaller size are queued to load again, normally from the
+  // `ThumbnailCache`.
+  void set_thumbnail_size(int size, int scale);
+  int get_thumbnail_size() const { return thumbnail_size; }
+  int get_thumbnail_scale() const { return thumbnail_scale; }
+
+  // Sets whether thumbnails are loaded. They are by default. Thumbnails that
+  // are already loading still finish.
+  void set_thumbnails_enabled(bool enabled);
+
   // Creates a new instance.
   static Glib::RefPtr<ImageList> create();
 
+  // Starts building the table of supported image formats in the work queue,
+  // so it's ready by the time a folder is listed. Otherwise, it's built when
+  // the first folder is listed.
+  static void load_formats_async();
+
+  // Default maximum width and height of thumbnails.
+  static const int DEFAULT_THUMBNAIL_SIZE;
+
   const Columns columns;
 
+  // Emitted after a row is updated because its file was modified.
+  sigc::signal<void, const iterator&> signal_file_changed;
+
+  // Emitted after the thumbnail size or scale changes.
+  sigc::signal<void> signal_thumbnail_size_changed;
+
  private:
-  // Data used while asynchronously opening a folder.
+  struct FolderScan;
+  struct FormatsItem;
+  struct SnapshotLoadItem;
+  struct SnapshotSaveItem;
+
+  // Data used while asynchronously enumerating one folder.
   struct AsyncFolderData {
-    AsyncFolderData(const SlotFolderReady& slot,
-                    const Glib::RefPtr<Gio::File>& folder)
-        : slot_folder_ready(slot), folder(folder) {}
+    AsyncFolderData(const std::shared_ptr<FolderScan>& scan,
+                    const Glib::RefPtr<Gio::File>& folder, bool is_top)
+        : scan(scan), folder(folder), folder_path(folder->get_path()),
+          is_top(is_top), request_time(g_get_monotonic_time()) {}
 
-    SlotFolderReady slot_folder_ready;
+    std::shared_ptr<FolderScan> scan;
     Glib::RefPtr<Gio::File> folder;
+    std::string folder_path;
+    bool is_top = false;  // True for the folder being opened.
     Glib::RefPtr<Gio::FileEnumerator> enumerator;
+    // When the enumerator or the last chunk of files was requested.
+    gint64 request_time = 0;
+  };
+
+  // Image file that has been enumerated but not yet added to the list.
+  struct PendingFile {
+    PendingFile(const std::string& path,
+                const Glib::RefPtr<Gio::FileInfo>& info)
+        : path(path), info(info) {}
+
+    std::string path;
+    Glib::RefPtr<Gio::FileInfo> info;
+  };
+
+  // Data shared by all of the folders enumerated while opening a folder.
+  struct FolderScan {
+    FolderScan(const SlotFolderReady& slot,
+               const Glib::RefPtr<Gio::File>& folder, bool recursive)
+        : slot_folder_ready(slot), folder_path(folder->get_path()),
+          recursive(recursive) {}
+
+    SlotFolderReady slot_folder_ready;
+    std::string folder_path;
+    bool recursive = false;
     Glib::RefPtr<Gio::Cancellable> cancellable = Gio::Cancellable::create();
+
+    // Subfolders waiting for an enumerator, and the number of folders being
+    // enumerated.
+    std::deque<Glib::RefPtr<Gio::File>> pending_folders;
+    int active_folders = 0;
+    bool failed = false;
+
+    // Files waiting for `insert_files()`, and folders whose enumeration is
+    // paused until there are fewer of them.
+    std::deque<PendingFile> pending_files;
+    std::vector<AsyncFolderData> paused_folders;
+    bool insert_scheduled = false;
+
+    // Adaptive enumeration settings; see `request_next_files()`.
+    int num_files = MIN_ASYNC_NUM_FILES;
+    int io_priority = Glib::PRIORITY_HIGH_IDLE;
+    bool over_budget = false;  // An insert time slice ran out.
+
+    // When the list was filled from a snapshot, files that are found are
+    // recorded. Rows that weren't found are removed once the scan finishes.
+    bool from_snapshot = false;
+    std::unordered_set<std::string> found_paths;
+    bool finished = false;
+  };
+
+  // Results of querying files that changed in a burst of events. The changes
+  // are applied together once every query has finished.
+  struct ChangeBatch {
+    int queries_pending = 0;
+    std::vector<std::pair<std::string, Glib::RefPtr<Gio::FileInfo>>> results;
   };
 
-  static const int THUMBNAIL_SIZE;
-  static const int ASYNC_NUM_FILES;
+  // Range of the number of files requested at a time from an enumerator.
+  static const int MIN_ASYNC_NUM_FILES;
+  static const int MAX_ASYNC_NUM_FILES;
+
+  // A full chunk of files arriving faster than this (in microseconds) grows
+  // the number of files requested.
+  static const gint64 FAST_CHUNK_TIME;
+
+  // Maximum time spent adding files to the list per idle callback, in
+  // microseconds. Enumeration is paused when more than `MAX_PENDING_FILES`
+  // are waiting to be added.
+  static const gint64 INSERT_TIME_SLICE;
+  static const std::size_t MAX_PENDING_FILES;
+
   static const std::string FILE_ATTRIBUTES;
 
+  // Maximum number of folders to enumerate at once in recursive mode.
+  static const int MAX_ACTIVE_FOLDERS;
+
+  // Time to collect file changes before applying them, in milliseconds.
+  static const int CHANGE_DELAY;
+
+  // Time to collect loaded thumbnails before updating their rows, in
+  // milliseconds. This is about one frame.
+  static const int THUMBNAIL_UPDATE_DELAY;
+
+  // Time the thumbnail size must stay the same before thumbnails are queued
+  // to load at it, in milliseconds. This skips the sizes passed while the
+  // slider is dragged.
+  static const int THUMBNAIL_SIZE_DELAY;
+
+  // Maximum number of thumbnails loading at once, besides visible ones. The
+  // rest wait in `thumbnail_queue`, so thumbnails that become visible don't
+  // wait behind them.
+  static const int MAX_THUMBNAILS_LOADING;
+
+  // Starts enumerating pending folders, up to `MAX_ACTIVE_FOLDERS`.
+  void start_folders(const std::shared_ptr<FolderScan>& scan);
+
   // Handlers for asynchronously opening a folder.
   void on_enumerate_children(const Glib::RefPtr<Gio::AsyncResult>& result,
                              AsyncFolderData& data);
   void on_next_files(const Glib::RefPtr<Gio::AsyncResult>& result,
-                     const AsyncFolderData& data);
+                     AsyncFolderData& data);
+
+  // Requests the next chunk of files, adapting the chunk size and priority to
+  // how fast chunks arrive and how fast they can be added to the list.
+  void request_next_files(AsyncFolderData& data);
+
+  // Adds pending files to the list for up to `INSERT_TIME_SLICE`. Returns true
+  // if there are more files, so the idle callback runs again.
+  bool insert_files(const std::shared_ptr<FolderScan>& scan);
+
+  // Reports that the folder is ready if enumeration has finished and all of
+  // its files have been added. Also reconciles and saves the snapshot.
+  void check_scan_finished(FolderScan& scan);
 
-  // Appends an image file to the list. `folder_path` is the folder containing
-  // the image, and `info` is the image file itself.
-  void append_file(const std::string& folder_path,
-                   const Glib::RefPtr<Gio::FileInfo>& info);
+  // Reads the folder's snapshot in the work queue, and then fills the list
+  // from it in the main thread, unless the scan has finished or been
+  // cancelled by then.
+  void load_snapshot(const std::shared_ptr<FolderScan>& scan);
+  static gboolean on_snapshot_loaded(gpointer data);
+  void add_snapshot(FolderScan& scan,
+                    const std::vector<FolderSnapshot::Entry>& entries);
+
+  // Saves the list as the folder's snapshot in the work queue.
+  void save_snapshot(const FolderScan& scan);
+
+  // Handles a folder that has finished enumerating or failed to open. Errors
+  // are only reported for the top folder, and stop the whole scan right away;
+  // subfolders that fail are skipped.
+  void finish_folder(const AsyncFolderData& data, bool success);
+
+  // Adds an image file to the list, or updates its row if it's already in the
+  // list and has been modified. `path` is the path of the file, and `info` is
+  // its information.
+  void add_file(const std::string& path,
+                const Glib::RefPtr<Gio::FileInfo>& info);
+
+  // Adds a row, or updates the row at `iter` if it's valid, and loads its
+  // thumbnail.
+  void set_file(iterator iter, const std::string& path,
+                const Glib::ustring& display_name,
+                const std::string& display_name_collation_key,
+                guint64 time_modified);
+
+  // Removes an image file from the list, if it's there.
+  void remove_file(const std::string& path);
+
+  // Returns true if the file is a visible image in a supported format.
+  bool is_image(const Glib::RefPtr<Gio::FileInfo>& info);
 
   // Returns true if the MIME type is a supported image format.
-  bool is_supported_mime_type(const Glib::ustring& mime_type);
+  static bool is_supported_mime_type(const Glib::ustring& mime_type);
+
+  // Returns the MIME types of the supported image formats. The first call
+  // builds them, which loads the metadata of every gdk-pixbuf loader, and
+  // calls from other threads wait for it.
+  static const std::vector<Glib::ustring>& get_supported_mime_types();
+  static std::vector<Glib::ustring> load_supported_mime_types();
 
-  // Updates a row with its thumbnail.
+  // Handlers for folder changes. Changed paths are collected for
+  // `CHANGE_DELAY` after the first event, and then queried in a batch.
+  void on_folder_changed(const Glib::RefPtr<Gio::File>& file,
+                         const Glib::RefPtr<Gio::File>& other_file,
+                         Gio::FileMonitorEvent event);
+  void query_changed_files();
+  void on_query_info(const Glib::RefPtr<Gio::AsyncResult>& result,
+                     const Glib::RefPtr<Gio::File>& file,
+                     const std::shared_ptr<ChangeBatch>& batch);
+
+  // Loads wanted thumbnails in an idle callback.
+  void schedule_thumbnails();
+
+  // Stops loading thumbnails. Thumbnails that were loading aren't wanted
+  // anymore.
+  void cancel_thumbnails();
+
+  // Starts loading the thumbnails of visible rows, and then queued thumbnails
+  // up to `MAX_THUMBNAILS_LOADING`.
+  void load_thumbnails();
+  void load_thumbnail(const std::string& path, WorkQueue::Priority priority);
+
+  // Queues a loaded thumbnail. Thumbnails are added to their rows together,
+  // so views redraw once for many thumbnails.
   void on_thumbnail_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
-                           const iterator& iter);
+                           const std::string& path);
+
+  // Updates the rows of queued thumbnails. Rows are looked up by path, since
+  // they may have been removed while the thumbnails were loading.
+  void update_thumbnails();
+
+  // Queues the thumbnails that are missing or smaller than the current size.
+  void requeue_thumbnails();
+
+  // Sets a row's thumbnail and updates the memory budget.
+  void set_thumbnail(const iterator& iter,
+                     const Glib::RefPtr<Gdk::Pixbuf>& pixbuf);
+
+  // Counts the `ThumbnailAtlas` in the memory budget. Thumbnails are counted
+  // by the slabs they're in, since a slab is only freed once all of its
+  // thumbnails are.
+  static void update_thumbnail_bytes();
+
+  // Sheds slabs of thumbnails of rows away from the visible range until
+  // `bytes` are freed. Returns the number of bytes freed.
+  std::size_t shed_thumbnails(std::size_t bytes);
 
   // Compares the order of two file display names.
   int compare_display_names(const iterator& iter_a, const iterator& iter_b);
 
-  std::vector<Glib::ustring> supported_mime_types;
   ImageWorker image_worker;
 
-  // Cancellable from the most recent `AsyncFolderData`.
-  Glib::RefPtr<Gio::Cancellable> cancellable;
+  // Most recent folder scan. Its cancellable is also used for file changes.
+  std::shared_ptr<FolderScan> current_scan;
+
+  // Rows indexed by file path. The iterators stay valid until their rows are
+  // removed.
+  std::unordered_map<std::string, iterator> rows_by_path;
+
+  // Paths whose thumbnails need loading, in the order they were added, and
+  // the set of them that hasn't started loading. Paths that were removed or
+  // already loaded stay in the queue and are skipped.
+  std::deque<std::string> thumbnail_queue;
+  std::unordered_set<std::string> thumbnails_wanted;
+  std::unordered_set<std::string> thumbnails_loading;
+  sigc::connection thumbnail_idle;
+  int visible_first = -1;
+  int visible_last = -1;
+  int thumbnail_size = DEFAULT_THUMBNAIL_SIZE;
+  int thumbnail_scale = 1;
+  bool thumbnails_enabled = true;
+
+  std::vector<std::pair<std::string, Glib::RefPtr<Gdk::Pixbuf>>>
+      loaded_thumbnails;
+  sigc::connection thumbnail_timeout;
+  sigc::connection thumbnail_size_timeout;
+
+  // Bytes of the `ThumbnailAtlas` counted in the memory budget. The atlas is
+  // shared by every list.
+  static std::size_t charged_thumbnail_bytes;
+
+  Glib::RefPtr<Gio::FileMonitor> monitor;
+  std::set<std::string> changed_paths;
+  sigc::connection change_timeout;
 };
 
 #endif  // LUMEE_IMAGE_LIST_H
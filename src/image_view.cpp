@@ -14,6 +14,8 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "image_view.h"
+#include "memory_budget.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <gtkmm/adjustment.h>
@@ -46,16 +48,37 @@ ImageView::ImageView(BaseObjectType* cobject,
       *this, &ImageView::on_adjustment_changed), Gtk::ORIENTATION_VERTICAL));
 }
 
-void ImageView::set(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) {
+void ImageView::set(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf, bool fitted) {
   this->pixbuf = pixbuf;
+  this->fitted = fitted;
+  count_memory(MemoryBudget::get_size(pixbuf), render_bytes);
   prev_zoom_factor = hadjust_zoom_factor = vadjust_zoom_factor = 0.0;
   update();
   anchor = {pixbuf->get_width() / 2.0, 0.0};  // Scroll to the top center.
 }
 
+// The preview is scaled once, and isn't scaled again if the view is resized,
+// since it's soon replaced.
+void ImageView::set_preview(const Glib::RefPtr<Gdk::Pixbuf>& thumbnail) {
+  pixbuf.reset();
+  Glib::RefPtr<Gdk::Pixbuf> scaled = thumbnail;
+  double factor = Dimensions(thumbnail).fit(get_allocation(), true);
+  if (factor != 1.0) {
+    Trace::Span span("ImageView scale preview");
+    scaled = thumbnail->scale_simple(
+        std::max(1.0, std::round(thumbnail->get_width() * factor)),
+        std::max(1.0, std::round(thumbnail->get_height() * factor)),
+        Gdk::INTERP_BILINEAR);
+  }
+  image.set(scaled);
+  count_memory(0, MemoryBudget::get_size(scaled));
+  signal_zoom_changed.emit();
+}
+
 void ImageView::clear() {
   pixbuf.reset();
   image.clear();
+  count_memory(0, 0);
   signal_zoom_changed.emit();
 }
 
@@ -100,6 +123,10 @@ void ImageView::on_size_allocate(Gtk::Allocation& allocation) {
 void ImageView::update(const Gtk::Allocation& allocation) {
   if (empty())
     return;
+  else if (fitted && zoom_fit != ZOOM_FIT_NONE &&
+           pixbuf->get_width() <= allocation.get_width() &&
+           pixbuf->get_height() <= allocation.get_height())
+    zoom_factor = 1.0;
   else if (zoom_fit == ZOOM_FIT_BEST)
     zoom_factor = Dimensions(pixbuf).fit(allocation, zoom_fit_expand);
   else if (zoom_fit == ZOOM_FIT_WIDTH) {
@@ -112,16 +139,36 @@ void ImageView::update(const Gtk::Allocation& allocation) {
 
   if (zoom_factor != prev_zoom_factor) {
     anchor = get_center();
-    image.set(zoom_factor == 1.0 ? pixbuf : pixbuf->scale_simple(
-                  std::round(pixbuf->get_width() * zoom_factor),
-                  std::round(pixbuf->get_height() * zoom_factor),
-                  Gdk::INTERP_BILINEAR));
+    if (zoom_factor == 1.0) {
+      image.set(pixbuf);
+      count_memory(image_bytes, 0);
+    } else {
+      // The old copy is released first, so both aren't held at once.
+      image.clear();
+      Trace::Span span("ImageView scale");
+      Glib::RefPtr<Gdk::Pixbuf> scaled = pixbuf->scale_simple(
+          std::round(pixbuf->get_width() * zoom_factor),
+          std::round(pixbuf->get_height() * zoom_factor),
+          Gdk::INTERP_BILINEAR);
+      image.set(scaled);
+      count_memory(image_bytes, MemoryBudget::get_size(scaled));
+    }
     prev_zoom_factor = zoom_factor;
   }
   // Regardless of the if-statement above, a zoom setting may have changed.
   signal_zoom_changed.emit();
 }
 
+void ImageView::count_memory(std::size_t image_size, std::size_t render_size) {
+  MemoryBudget& budget = MemoryBudget::get_default();
+  budget.remove(MemoryBudget::CATEGORY_IMAGES, image_bytes);
+  budget.remove(MemoryBudget::CATEGORY_RENDERS, render_bytes);
+  image_bytes = image_size;
+  render_bytes = render_size;
+  budget.add(MemoryBudget::CATEGORY_IMAGES, image_bytes);
+  budget.add(MemoryBudget::CATEGORY_RENDERS, render_bytes);
+}
+
 // Defaults to the absolute center of the pixbuf. If the scaled image is larger
 // than the view, calculates the visible center based on scroll position and
 // zoom factor.
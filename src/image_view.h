@@ -36,13 +36,22 @@ class ImageView : public Gtk::ScrolledWindow {
   ImageView(BaseObjectType* cobject,
             const Glib::RefPtr<Gtk::Builder>& builder);
 
-  // Sets or clears the image.
-  void set(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf);
+  // Sets or clears the image. If `fitted` is true, the image has already been
+  // scaled to fit the view, such as a slide, so zoom-to-fit doesn't scale it
+  // again as long as it fits.
+  void set(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf, bool fitted = false);
   void clear();
 
+  // Shows a stand-in for an image that isn't loaded, such as its thumbnail,
+  // scaled to fit. The view is empty until an image is set.
+  void set_preview(const Glib::RefPtr<Gdk::Pixbuf>& thumbnail);
+
   // Returns true if no image is displayed.
   bool empty() const { return !bool(pixbuf); }
 
+  // Returns the displayed image, unscaled.
+  Glib::RefPtr<Gdk::Pixbuf> get_pixbuf() const { return pixbuf; }
+
   // Returns the current zoom factor.
   double get_zoom() const { return zoom_factor; }
 
@@ -92,6 +101,10 @@ class ImageView : public Gtk::ScrolledWindow {
   void update() { update(get_allocation()); }
   void update(const Gtk::Allocation& allocation);
 
+  // Counts the image and its scaled copy in the memory budget, replacing the
+  // previous sizes.
+  void count_memory(std::size_t image_size, std::size_t render_size);
+
   // Returns the point (in image coordinates) at the center of the viewport.
   Point get_center() const;
 
@@ -104,6 +117,7 @@ class ImageView : public Gtk::ScrolledWindow {
   bool on_motion(GdkEventMotion* event);
 
   Glib::RefPtr<Gdk::Pixbuf> pixbuf;  // Original unscaled pixbuf.
+  bool fitted = false;  // True if `pixbuf` was scaled to fit ahead of time.
   Gtk::Image image;
   Glib::RefPtr<Gtk::Adjustment> hadjust = get_hadjustment(),
                                 vadjust = get_vadjustment();
@@ -125,6 +139,9 @@ class ImageView : public Gtk::ScrolledWindow {
 
   // Point (in screen coordinates) of the last motion event. Used for panning.
   Point last_motion;
+
+  // Bytes counted in the memory budget for `pixbuf` and the scaled copy.
+  std::size_t image_bytes = 0, render_bytes = 0;
 };
 
 #endif
@@ -14,81 +14,328 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "image_worker.h"
+#include "stats.h"
+#include "thumbnail_atlas.h"
+#include "thumbnail_cache.h"
+#include "trace.h"
 #include "utils.h"
 
+#include <gdkmm/pixbufloader.h>
 #include <giomm/error.h>
 
+const std::size_t ImageWorker::MAX_KEPT_BUFFER = 1024 * 1024;
+
 ImageWorker::ImageWorker() {
-  // Since a single cancellable is reused, it should be reset before each task.
-  work_queue.slot_popped = [this]() { cancellable->reset(); };
-  dispatcher.connect(sigc::mem_fun(*this, &ImageWorker::finish_task));
+  dispatcher.connect(sigc::mem_fun(*this, &ImageWorker::finish_tasks));
 }
 
+// The queue is shared, so tasks can't be removed from it. Once they're
+// cancelled, they are dropped as soon as a thread reaches them. Results that
+// were never delivered are deleted along with the free list.
 ImageWorker::~ImageWorker() {
   cancel_all();
-  work_queue.stop();
+  {
+    Glib::Threads::Mutex::Lock lock(pool_mutex);
+    while (tasks_queued)
+      pool_cond.wait(pool_mutex);
+  }
+  delete_tasks(results_head);
+  delete_tasks(free_tasks);
 }
 
-void ImageWorker::load(const SlotFinished& slot, const std::string& path,
-                       int scale_size) {
-  work_queue.push(sigc::bind(sigc::mem_fun(*this, &ImageWorker::process),
-                             sigc::mem_fun(*this, &ImageWorker::load_task),
-                             Task(slot, path, scale_size)));
+void ImageWorker::load(SlotFinished slot, const std::string& path,
+                       WorkQueue::Priority priority) {
+  load_scaled(std::move(slot), path, 0, 0, false, priority);
 }
 
-// Since the cancellable is reset after a task is popped, `clear()` needs to
-// run first. Otherwise, a task could start between `cancel()` and `clear()`.
-// This function would need to lock `work_queue`'s mutex to avoid that.
+// A size of 0 loads the image unscaled.
+void ImageWorker::load_scaled(SlotFinished slot, const std::string& path,
+                              int width, int height, bool expand,
+                              WorkQueue::Priority priority) {
+  Task* task = acquire_task();
+  task->generation = generation.load(std::memory_order_relaxed);
+  task->slot_finished = std::move(slot);
+  task->source_path.assign(path);
+  task->path.assign(path);
+  task->scale_size = 0;
+  task->fit_width = width;
+  task->fit_height = height;
+  task->fit_expand = expand;
+  task->cache_level = -1;
+  task->priority = priority;
+  task->request_time = g_get_monotonic_time();
+  FileReader::get_default().read(task, priority);
+}
+
+void ImageWorker::load_thumbnail(SlotFinished slot, const std::string& path,
+                                 guint64 time_modified, int size,
+                                 WorkQueue::Priority priority) {
+  Task* task = acquire_task();
+  task->generation = generation.load(std::memory_order_relaxed);
+  task->slot_finished = std::move(slot);
+  task->source_path.assign(path);
+  task->time_modified = time_modified;
+  task->scale_size = size;
+  task->fit_width = task->fit_height = 0;
+  task->cache_level = ThumbnailCache::get_level(size);
+  task->path = ThumbnailCache::get_filename(path, time_modified,
+                                            task->cache_level);
+  task->priority = priority;
+  FileReader::get_default().read(task, priority);
+}
+
+// Running tasks see that they've been cancelled at their next check.
 void ImageWorker::cancel_all() {
-  work_queue.clear();
-  cancellable->cancel();
+  generation.fetch_add(1, std::memory_order_release);
+}
+
+// Runs in a worker thread. `worker` is copied first, since the task may be
+// reused once it's processed.
+void ImageWorker::Task::run() {
+  Trace::Span span("ImageWorker::Task::run");
+  run_time = g_get_monotonic_time();
+  ImageWorker* worker = this->worker;
+  if (worker->is_cancelled(*this))
+    worker->release_task(this);
+  else if (!worker->process(*this))
+    return;  // It's still queued, reading its image.
+  worker->finish_queued_task();
+}
+
+void ImageWorker::Task::discard() {
+  ImageWorker* worker = this->worker;
+  worker->release_task(this);
+  worker->finish_queued_task();
+}
+
+bool ImageWorker::Task::is_cancelled() const {
+  return worker->is_cancelled(*this);
+}
+
+// Runs in an I/O thread. Cancelled tasks are still passed on, so they leave
+// the queue in one place.
+void ImageWorker::Task::read_finished(bool success) {
+  if (!success && cache_level >= 0 && !is_cancelled()) {
+    read_source();
+    return;
+  }
+  read_success = success;
+  read_time = g_get_monotonic_time();
+  WorkQueue::get_default().push(this, priority);
+}
+
+void ImageWorker::Task::read_source() {
+  Stats::get_default().increment(Stats::COUNTER_THUMBNAIL_CACHE_MISSES);
+  cache_level = -1;
+  release_contents();
+  path = source_path;
+  FileReader::get_default().read(this, priority);
+}
+
+ImageWorker::Task* ImageWorker::acquire_task() {
+  {
+    Glib::Threads::Mutex::Lock lock(pool_mutex);
+    ++tasks_queued;
+    if (free_tasks) {
+      Task* task = free_tasks;
+      free_tasks = task->next_task;
+      task->next_task = nullptr;
+      return task;
+    }
+  }
+  Task* task = new Task;
+  task->worker = this;
+  return task;
+}
+
+// The path's buffer is kept, so the next path usually fits without
+// allocating.
+void ImageWorker::release_task(Task* task) {
+  task->release_contents();
+  task->result.reset();
+  task->slot_finished = nullptr;
+  if (task->data.capacity() > MAX_KEPT_BUFFER)
+    std::vector<guint8>().swap(task->data);
+  else
+    task->data.clear();
+  Glib::Threads::Mutex::Lock lock(pool_mutex);
+  task->next_task = free_tasks;
+  free_tasks = task;
+}
+
+void ImageWorker::finish_queued_task() {
+  Glib::Threads::Mutex::Lock lock(pool_mutex);
+  if (!--tasks_queued)
+    pool_cond.broadcast();
 }
 
 // Runs in a worker thread.
-void ImageWorker::process(const sigc::slot<void, Task&>& slot, Task& task) {
+bool ImageWorker::process(Task& task) {
   try {
-    slot(task);
+    if (!load_task(task))
+      return false;
   } catch (const Gio::Error& error) {
-    if (error.code() == Gio::Error::CANCELLED)
-      return;
-    else throw;
+    if (error.code() == Gio::Error::CANCELLED) {
+      release_task(&task);
+      return true;
+    }
+    release_task(&task);
+    throw;
   } catch (const Glib::Error&) {
     task.result.reset();
   }
+  task.result_time = g_get_monotonic_time();
+  bool emit = false;
   {
     Glib::Threads::Mutex::Lock lock(mutex);
-    results.push(std::move(task));
+    task.next_task = nullptr;
+    if (results_tail)
+      results_tail->next_task = &task;
+    else
+      results_head = &task;
+    results_tail = &task;
+    emit = !finish_pending;
+    finish_pending = true;
+    if (emit)
+      emit_time = Trace::is_enabled() ? g_get_monotonic_time() : 0;
   }
-  dispatcher.emit();
+  if (emit)
+    dispatcher.emit();
+  return true;
 }
 
-// Runs in a worker thread.
-void ImageWorker::load_task(Task& task) {
-  // TODO: Compare `Pixbuf::create_from_file()`'s speed with `PixbufLoader`.
-  // TODO: Check if network-mounted or very large images can stall the thread.
+// Runs in a worker thread. A cached thumbnail that can't be decoded is
+// replaced by reading the image again.
+bool ImageWorker::load_task(Task& task) {
   // TODO: Support animated images.
-  Glib::RefPtr<Gdk::Pixbuf> pixbuf = Gdk::Pixbuf::create_from_file(task.path);
-  if (cancellable->is_cancelled())
+  Glib::RefPtr<Gdk::Pixbuf> pixbuf = decode(task);
+  if (is_cancelled(task))
     throw Gio::Error(Gio::Error::CANCELLED, "");
+  if (!pixbuf && task.cache_level >= 0) {
+    task.read_source();
+    return false;
+  } else if (!pixbuf) {
+    task.result.reset();
+    return true;
+  }
+
+  Stats& stats = Stats::get_default();
+  if (task.cache_level >= 0)
+    stats.increment(Stats::COUNTER_THUMBNAIL_CACHE_HITS);
+  stats.increment(task.scale_size ? Stats::COUNTER_THUMBNAILS_LOADED :
+                                    Stats::COUNTER_IMAGES_LOADED);
 
   if (task.scale_size) {
+    Trace::Span span("ImageWorker::scale");
+    if (task.cache_level < 0) {
+      pixbuf = ThumbnailCache::save(task.source_path, task.time_modified,
+                                    pixbuf)[ThumbnailCache::get_level(
+                                        task.scale_size)];
+    }
     double factor = Dimensions(pixbuf).fit(task.scale_size);
-    pixbuf = pixbuf->scale_simple(std::round(pixbuf->get_width() * factor),
-                                  std::round(pixbuf->get_height() * factor),
-                                  Gdk::INTERP_BILINEAR);
-    if (cancellable->is_cancelled())
+    pixbuf = ThumbnailAtlas::get_default().scale(
+        pixbuf, std::max(1.0, std::round(pixbuf->get_width() * factor)),
+        std::max(1.0, std::round(pixbuf->get_height() * factor)));
+    if (is_cancelled(task))
+      throw Gio::Error(Gio::Error::CANCELLED, "");
+  } else if (task.fit_width && task.fit_height) {
+    // Scaled the same way as in `ImageView`.
+    double factor = Dimensions(pixbuf).fit(
+        Dimensions(task.fit_width, task.fit_height), task.fit_expand);
+    if (factor != 1.0) {
+      Trace::Span span("ImageWorker::scale");
+      pixbuf = pixbuf->scale_simple(
+          std::max(1.0, std::round(pixbuf->get_width() * factor)),
+          std::max(1.0, std::round(pixbuf->get_height() * factor)),
+          Gdk::INTERP_BILINEAR);
+    }
+    if (is_cancelled(task))
       throw Gio::Error(Gio::Error::CANCELLED, "");
   }
   task.result = pixbuf;
+  return true;
+}
+
+// The loader reads the file straight from its mapping if it was mapped, which
+// is released as soon as the image is decoded. A file that's truncated while
+// it's being read fails to load. Only images are counted in the decode times,
+// since cached thumbnails are much smaller.
+//
+// static
+Glib::RefPtr<Gdk::Pixbuf> ImageWorker::decode(Task& task) {
+  if (!task.read_success)
+    return Glib::RefPtr<Gdk::Pixbuf>();
+  Trace::Span span("ImageWorker::decode");
+  gint64 start_time = g_get_monotonic_time();
+  Glib::RefPtr<Gdk::PixbufLoader> loader = Gdk::PixbufLoader::create();
+  try {
+    FileReader::MappingGuard guard(task);
+    loader->write(task.get_contents(), task.get_size());
+    if (guard.truncated())
+      throw Gio::Error(Gio::Error::PARTIAL_INPUT, "File was truncated");
+    loader->close();
+  } catch (const Glib::Error&) {
+    try {
+      loader->close();  // A loader shouldn't be freed without being closed.
+    } catch (const Glib::Error&) {}
+    task.release_contents();
+    return Glib::RefPtr<Gdk::Pixbuf>();
+  }
+  task.release_contents();
+  if (task.cache_level < 0)
+    Stats::get_default().add_decode_time(g_get_monotonic_time() - start_time);
+  return loader->get_pixbuf();
 }
 
-// Runs in the main thread.
-void ImageWorker::finish_task() {
-  Task task;
+// Runs in the main thread. Results that arrive while the slots are being
+// called will emit the dispatcher again. Results of tasks that were cancelled
+// after they finished are dropped.
+//
+// The time from emitting the dispatcher to getting here is traced as its own
+// span.
+void ImageWorker::finish_tasks() {
+  Trace::Span span("ImageWorker::finish_tasks");
+  Task* tasks = nullptr;
+  gint64 emitted = 0;
   {
     Glib::Threads::Mutex::Lock lock(mutex);
-    task = results.front();
-    results.pop();
+    tasks = results_head;
+    results_head = results_tail = nullptr;
+    finish_pending = false;
+    emitted = emit_time;
+  }
+  gint64 now = g_get_monotonic_time();
+  if (emitted)
+    Trace::add_span("ImageWorker dispatch", emitted, now);
+  while (tasks) {
+    Task* task = tasks;
+    tasks = task->next_task;
+    if (!task->scale_size && task->result &&
+        task->priority == WorkQueue::PRIORITY_INTERACTIVE)
+      add_switch_times(*task, now);
+    if (!is_cancelled(*task))
+      task->slot_finished(task->result, task->source_path);
+    release_task(task);
+  }
+}
+
+// static
+void ImageWorker::add_switch_times(const Task& task, gint64 finish_time) {
+  Stats& stats = Stats::get_default();
+  stats.add_switch_time(Stats::SWITCH_READ,
+                        task.read_time - task.request_time);
+  stats.add_switch_time(Stats::SWITCH_QUEUE, task.run_time - task.read_time);
+  stats.add_switch_time(Stats::SWITCH_DECODE,
+                        task.result_time - task.run_time);
+  stats.add_switch_time(Stats::SWITCH_DISPATCH,
+                        finish_time - task.result_time);
+}
+
+// static
+void ImageWorker::delete_tasks(Task* tasks) {
+  while (tasks) {
+    Task* task = tasks;
+    tasks = task->next_task;
+    delete task;
   }
-  task.slot_finished(task.result);
 }
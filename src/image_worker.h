@@ -16,66 +16,158 @@
 #ifndef LUMEE_IMAGE_WORKER_H
 #define LUMEE_IMAGE_WORKER_H
 
+#include "file_reader.h"
 #include "work_queue.h"
 
 #include <gdkmm/pixbuf.h>
 #include <glibmm/dispatcher.h>
 #include <glibmm/threads.h>
 
-#include <queue>
+#include <functional>
 
-// Loads images in a thread and returns the results asynchronously.
+// Loads images in two stages and returns the results asynchronously. Files are
+// read by the process's shared `FileReader`, and then decoded in its shared
+// `WorkQueue`.
 class ImageWorker {
  public:
   // Function that will be called when an image has finished loading or failed
   // to load. If it failed, the pixbuf pointer will be empty.
-  typedef sigc::slot<void, Glib::RefPtr<Gdk::Pixbuf>> SlotFinished;
+  //
+  //     void on_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+  //                    const std::string& path)
+  typedef std::function<void(const Glib::RefPtr<Gdk::Pixbuf>&,
+                             const std::string&)> SlotFinished;
 
   ImageWorker();
+
+  // Waits for this instance's queued tasks to be dropped by the queue.
   ~ImageWorker();
 
   // Loads an image file asynchronously.
   //
-  // `slot` will be called when finished. If it's a non-static member function
-  // and the class derives from `sigc::trackable`, don't use `sigc::mem_fun()`
-  // - it's not thread-safe. Use `std::bind()` or a lambda instead.
+  // `slot` will be called when finished. Don't use `sigc::mem_fun()` on a
+  // class that derives from `sigc::trackable` - it's not thread-safe. A lambda
+  // that only captures `this` is best, since it's stored without allocating.
   //
-  // `scale_size` (optional) is the maximum width and height of the image. It
-  // will be scaled if needed.
-  void load(const SlotFinished& slot, const std::string& path,
-            int scale_size = 0);
+  // `priority` decides which loads in the process start first; see
+  // `WorkQueue::Priority`.
+  void load(SlotFinished slot, const std::string& path,
+            WorkQueue::Priority priority = WorkQueue::PRIORITY_INTERACTIVE);
+
+  // Loads an image file asynchronously, scaled to fit within `width` and
+  // `height` as `Dimensions::fit()` would, so it can be shown at that size
+  // without scaling it in the main thread.
+  void load_scaled(SlotFinished slot, const std::string& path, int width,
+                   int height, bool expand, WorkQueue::Priority priority);
 
-  // Cancels the running task and removes all queued tasks.
+  // Loads a thumbnail of an image file asynchronously, no bigger than `size`
+  // in either dimension. It's loaded from the `ThumbnailCache` if possible;
+  // otherwise, the image is loaded and the cache is filled. The thumbnail is
+  // stored in the shared `ThumbnailAtlas`.
+  void load_thumbnail(SlotFinished slot, const std::string& path,
+                      guint64 time_modified, int size,
+                      WorkQueue::Priority priority);
+
+  // Cancels this instance's running tasks and removes its queued tasks.
+  // Results that haven't been passed to their slots yet are dropped.
   void cancel_all();
 
  private:
-  // Task that can be processed.
-  struct Task {
-    Task(const SlotFinished& slot_finished, const std::string& path,
-         int scale_size)
-        : slot_finished(slot_finished), path(path), scale_size(scale_size) {}
-    Task() {}
+  // Buffers bigger than this aren't kept when a task is reused, in bytes.
+  static const std::size_t MAX_KEPT_BUFFER;
+
+  // Task that can be processed. Tasks are kept in a free list and reused, so
+  // loading an image doesn't allocate once the pool has grown. A task is
+  // first a read request, and then a decode item. A thumbnail task that
+  // misses the cache is a read request again, for its image.
+  struct Task : public WorkQueue::Item, public FileReader::Request {
+    virtual void run();
+    virtual void discard();
+    virtual bool is_cancelled() const;
+    virtual void read_finished(bool success);
 
+    // Reads the image instead of its cached thumbnail.
+    void read_source();
+
+    ImageWorker* worker = nullptr;
+    guint64 generation = 0;  // Value of `ImageWorker::generation` when queued.
+    WorkQueue::Priority priority = WorkQueue::PRIORITY_INTERACTIVE;
     SlotFinished slot_finished;
-    std::string path;
-    int scale_size = 0;
+    std::string source_path;  // `path` is the cached thumbnail's at first.
+    guint64 time_modified = 0;
+    int scale_size = 0;  // Thumbnail size, or 0 for full images.
+    int fit_width = 0;   // Size a full image is scaled to fit, if nonzero.
+    int fit_height = 0;
+    bool fit_expand = false;
+    int cache_level = -1;  // Level being read, or -1 for the image.
+    bool read_success = false;
     Glib::RefPtr<Gdk::Pixbuf> result;
+
+    // When the task was requested, read, started decoding and finished, for
+    // the image switch statistics.
+    gint64 request_time = 0;
+    gint64 read_time = 0;
+    gint64 run_time = 0;
+    gint64 result_time = 0;
+
+    // Next task in the result list or the free list.
+    Task* next_task = nullptr;
   };
 
-  // Processes a slot and task, passing the result to the main thread.
-  void process(const sigc::slot<void, Task&>& slot, Task& task);
+  // Takes a task from the free list, or creates one if it's empty.
+  Task* acquire_task();
 
-  // Does the actual loading of an image file.
-  void load_task(Task& task);
+  // Clears a task and returns it to the free list.
+  void release_task(Task* task);
 
-  // Removes a task from the result queue and calls its slot.
-  void finish_task();
+  // Returns true if `cancel_all()` has been called since a task was queued.
+  bool is_cancelled(const Task& task) const {
+    return task.generation != generation.load(std::memory_order_acquire);
+  }
+
+  // Called after a task has left the queue, whether it ran or not.
+  void finish_queued_task();
+
+  // Processes a task, passing the result to the main thread. Returns false if
+  // the task was queued again to read its image.
+  bool process(Task& task);
+  bool load_task(Task& task);
+
+  // Decodes an image file from the task's contents. Returns null if it isn't
+  // a valid image.
+  static Glib::RefPtr<Gdk::Pixbuf> decode(Task& task);
+
+  // Removes all tasks from the result list and calls their slots.
+  void finish_tasks();
+
+  // Records the stages of loading a full image in the statistics. Only
+  // interactive loads are counted, since prefetches aren't waited on.
+  static void add_switch_times(const Task& task, gint64 finish_time);
+
+  // Deletes a list of tasks linked by `next_task`.
+  static void delete_tasks(Task* tasks);
 
-  WorkQueue work_queue;
-  Glib::RefPtr<Gio::Cancellable> cancellable = Gio::Cancellable::create();
-  Glib::Threads::Mutex mutex;
-  std::queue<Task> results;
   Glib::Dispatcher dispatcher;
+
+  // Incremented by `cancel_all()`. Tasks from an older generation are dropped.
+  std::atomic<guint64> generation{0};
+
+  // Finished tasks, in the order they finished.
+  Glib::Threads::Mutex mutex;
+  Task* results_head = nullptr;
+  Task* results_tail = nullptr;
+
+  // True if the dispatcher has been emitted and `finish_tasks()` hasn't run
+  // yet. Results pushed in the meantime don't emit it again.
+  bool finish_pending = false;
+  gint64 emit_time = 0;  // When it was emitted, if tracing.
+
+  // Tasks that can be reused, and the number of tasks in the queue. Tasks are
+  // released from both threads.
+  Glib::Threads::Mutex pool_mutex;
+  Glib::Threads::Cond pool_cond;
+  Task* free_tasks = nullptr;
+  int tasks_queued = 0;
 };
 
 #endif  // LUMEE_IMAGE_WORKER_H
@@ -14,6 +14,7 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "application.h"
+#include "trace.h"
 
 #include <glibmm/miscutils.h>
 
@@ -21,5 +22,10 @@ int main(int argc, char* argv[]) {
   RuntimeInfo::init();
   if (!RuntimeInfo::is_installed())
     Glib::setenv("GSETTINGS_SCHEMA_DIR", RuntimeInfo::get_data_dir());
-  return Application::create()->run(argc, argv);
+  // `--trace` does the same.
+  if (const char* trace_file = g_getenv("LUMEE_TRACE"))
+    Trace::start(trace_file);
+  int status = Application::create()->run(argc, argv);
+  Trace::stop();
+  return status;
 }
@@ -14,22 +14,37 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "main_window.h"
+#include "memory_budget.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <glibmm/convert.h>
 #include <glibmm/i18n.h>
 #include <gtkmm/filechooserdialog.h>
+#include <gtkmm/scrollbar.h>
+
+const int MainWindow::LIST_WIDTH_PADDING = 23;
+const int MainWindow::STATS_INTERVAL = 500;
+const int MainWindow::DWELL_TIME = 150;
+const int MainWindow::PREFETCH_AHEAD = 2;
+const int MainWindow::PREFETCH_BEHIND = 1;
+const guint32 MainWindow::MAX_EVENT_AGE = 10000;
 
 MainWindow::MainWindow(BaseObjectType* cobject,
                        const Glib::RefPtr<Gtk::Builder>& builder)
     : Gtk::ApplicationWindow(cobject) {
   builder->get_widget("header-bar", header_bar);
   builder->get_widget("zoom-label", zoom_label);
+  builder->get_widget("thumbnail-size-scale", thumbnail_size_scale);
+  builder->get_widget("list-scrolled-window", list_scrolled_window);
   builder->get_widget("list-view", list_view);
   builder->get_widget("stack", stack);
+  builder->get_widget_derived("image-grid", image_grid);
   builder->get_widget_derived("image-view", image_view);
   builder->get_widget("message-icon", message_icon);
   builder->get_widget("message", message);
+  builder->get_widget("stats-label", stats_label);
   add_actions();
 
   list_view->set_model(image_list);
@@ -39,21 +54,55 @@ MainWindow::MainWindow(BaseObjectType* cobject,
       sigc::mem_fun(*this, &MainWindow::on_thumbnail_cell_data));
   list_view->get_selection()->signal_changed().connect(sigc::mem_fun(
       *this, &MainWindow::on_selection_changed));
+
+  // The grid shares the list view's selection.
+  Gtk::Scrollbar* grid_scrollbar = nullptr;
+  builder->get_widget("grid-scrollbar", grid_scrollbar);
+  grid_scrollbar->set_adjustment(image_grid->get_vadjustment());
+  image_grid->set_model(image_list, list_view->get_selection());
+  image_grid->signal_activated.connect(sigc::mem_fun(
+      *this, &MainWindow::on_grid_activated));
+
+  // Thumbnails load first for the rows the current view shows.
+  Glib::RefPtr<Gtk::Adjustment> list_vadjustment =
+      list_scrolled_window->get_vadjustment();
+  list_vadjustment->signal_value_changed().connect(sigc::mem_fun(
+      *this, &MainWindow::update_visible_range));
+  list_vadjustment->signal_changed().connect(sigc::mem_fun(
+      *this, &MainWindow::update_visible_range));
+  image_grid->signal_visible_range_changed.connect(sigc::hide(sigc::hide(
+      sigc::mem_fun(*this, &MainWindow::update_visible_range))));
+
+  thumbnail_size_scale->signal_value_changed().connect(sigc::mem_fun(
+      *this, &MainWindow::on_thumbnail_size_scale_changed));
+  connect_property_changed("scale-factor", sigc::mem_fun(
+      *this, &MainWindow::update_thumbnail_size));
+
+  image_list->signal_file_changed.connect(sigc::mem_fun(
+      *this, &MainWindow::on_file_changed));
   image_view->signal_zoom_changed.connect(sigc::mem_fun(
       *this, &MainWindow::on_zoom_changed));
   settings->signal_changed().connect(sigc::mem_fun(
       *this, &MainWindow::on_setting_changed));
+  signal_realize().connect(sigc::mem_fun(*this, &MainWindow::watch_frames));
+  signal_unrealize().connect(sigc::mem_fun(*this,
+                                           &MainWindow::unwatch_frames));
 
   // Call some signal handlers now to initialize them.
   on_zoom_changed();
   on_setting_changed("sort-by");
   on_setting_changed("zoom-to-fit-expand");
+  on_setting_changed("memory-budget");
+  on_setting_changed("thumbnail-size");
   if (settings->get_boolean("maximized"))
     maximize();
   show_all_children();
+  on_setting_changed("view-mode");  // Needs to run after showing the list.
 }
 
-void MainWindow::open(Glib::RefPtr<Gio::File> file) {
+// A file's image is loaded alongside its folder, since a big folder can take
+// much longer to list than one image takes to decode.
+void MainWindow::open(Glib::RefPtr<Gio::File> file, bool file_loading) {
   Glib::RefPtr<Gio::File> file_to_select;
   if (file->query_file_type() == Gio::FILE_TYPE_REGULAR) {
     // Open the folder the file is in, and select it.
@@ -61,26 +110,103 @@ void MainWindow::open(Glib::RefPtr<Gio::File> file) {
     file = file->get_parent();
   }
 
+  if (slideshow.is_running())
+    stop_slideshow();
   list_view->get_selection()->unselect_all();
+  image_cache.clear();
+  early_path.clear();
+  if (file_to_select && !grid_mode) {
+    early_path = file_to_select->get_path();
+    selection_time = g_get_monotonic_time();
+    shown_time = 0;
+    if (!file_loading) {
+      image_worker.load([this](const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                               const std::string& path) {
+                          show_early_image(pixbuf, path);
+                        }, early_path);
+    }
+  }
   image_list->open_folder(sigc::bind(sigc::mem_fun(
-      *this, &MainWindow::on_folder_ready), file_to_select), file);
+      *this, &MainWindow::on_folder_ready), file_to_select), file,
+      settings->get_boolean("recursive"));
   folder_path = file->get_path();
   header_bar->set_title(Glib::filename_display_basename(folder_path));
+  if (grid_mode)
+    stack->set_visible_child("grid-area");
 }
 
+// Until the folder is ready, nothing is selected, and the image is kept if
+// it's still the early one.
+void MainWindow::show_early_image(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                                  const std::string& path) {
+  std::string selected_path = early_path;
+  if (Gtk::TreeModel::iterator iter =
+          list_view->get_selection()->get_selected())
+    selected_path = std::string((*iter)[image_list->columns.path]);
+  if (path == selected_path)
+    on_image_loaded(pixbuf, path);
+}
+
+// The time of the key press is kept while it's handled, so a selection it
+// changes is timed from the key press. GTK+ 3.10 doesn't mark repeated key
+// presses, so a key that's pressed again without being released is taken to
+// be repeating.
+//
 // Hack: Trap certain keys and activate a different key's accelerator, so
 // zooming in and out can have multiple keyboard shortcuts.
 //
 // TODO: In gtkmm 3.12, this could be replaced by
 //       `Gtk::Application::set_accels_for_action()`.
 bool MainWindow::on_key_press_event(GdkEventKey* event) {
-  if (event->keyval == GDK_KEY_equal || event->keyval == GDK_KEY_KP_Add)
+  key_repeating = event->keyval == held_keyval;
+  held_keyval = event->keyval;
+  if (event->keyval == GDK_KEY_Escape && slideshow.is_running()) {
+    stop_slideshow();
+    return true;
+  } else if (event->keyval == GDK_KEY_equal || event->keyval == GDK_KEY_KP_Add)
     return gtk_accel_groups_activate(G_OBJECT(gobj()), GDK_KEY_plus,
                                      GdkModifierType(event->state));
   else if (event->keyval == GDK_KEY_KP_Subtract)
     return gtk_accel_groups_activate(G_OBJECT(gobj()), GDK_KEY_minus,
                                      GdkModifierType(event->state));
-  return Gtk::ApplicationWindow::on_key_press_event(event);
+  key_press_time = get_event_time(event->time);
+  bool handled = Gtk::ApplicationWindow::on_key_press_event(event);
+  key_press_time = 0;
+  return handled;
+}
+
+// When a held key is released, the image the selection stopped on is loaded
+// without waiting for the dwell time.
+bool MainWindow::on_key_release_event(GdkEventKey* event) {
+  if (event->keyval == held_keyval) {
+    held_keyval = 0;
+    key_repeating = false;
+    if (dwell_timeout.connected()) {
+      dwell_timeout.disconnect();
+      load_selected_image();
+    }
+  }
+  return Gtk::ApplicationWindow::on_key_release_event(event);
+}
+
+bool MainWindow::on_focus_out_event(GdkEventFocus* event) {
+  held_keyval = 0;
+  key_repeating = false;
+  return Gtk::ApplicationWindow::on_focus_out_event(event);
+}
+
+// X servers and Wayland compositors normally take event times from the
+// monotonic clock, in milliseconds that wrap at 32 bits. A time that's in the
+// future or older than `MAX_EVENT_AGE` is from some other clock, so the
+// current time is used instead.
+//
+// static
+gint64 MainWindow::get_event_time(guint32 time) {
+  gint64 now = g_get_monotonic_time();
+  guint32 age = guint32(now / 1000) - time;
+  if (time == GDK_CURRENT_TIME || age > MAX_EVENT_AGE)
+    return now;
+  return now - gint64(age) * 1000;
 }
 
 bool MainWindow::on_window_state_event(GdkEventWindowState* event) {
@@ -112,6 +238,12 @@ void MainWindow::add_actions() {
   action_zoom_to_fit_expand = settings->create_action("zoom-to-fit-expand");
   add_action(settings->create_action("sort-by"));
   add_action(settings->create_action("sort-reversed"));
+  add_action(settings->create_action("view-mode"));
+  add_action(settings->create_action("recursive"));
+  action_show_stats = add_action_bool(
+      "show-stats", sigc::mem_fun(*this, &MainWindow::toggle_stats));
+  action_slideshow = add_action_bool(
+      "slideshow", sigc::mem_fun(*this, &MainWindow::toggle_slideshow));
 }
 
 void MainWindow::open_file_chooser() {
@@ -126,25 +258,102 @@ void MainWindow::open_file_chooser() {
 
 // In addition to showing a thumbnail, thumbnail cells can be in a "failed" or
 // "loading" state.
+//
+// A thumbnail for a scaled display, or one from before the size changed, is
+// shown as a surface with a scale factor, since the renderer doesn't scale
+// pixbufs. The surface is cached, since this runs on every redraw.
 void MainWindow::on_thumbnail_cell_data(Gtk::CellRenderer* cell_base,
                                         const Gtk::TreeModel::iterator& iter) {
   auto cell = dynamic_cast<Gtk::CellRendererPixbuf*>(cell_base);
   Glib::RefPtr<Gdk::Pixbuf> thumbnail = (*iter)[image_list->columns.thumbnail];
-  if ((*iter)[image_list->columns.thumbnail_failed])
+  if ((*iter)[image_list->columns.thumbnail_failed]) {
     cell->property_icon_name() = "image-x-generic";
-  else if (!thumbnail)
+    return;
+  } else if (!thumbnail) {
     cell->property_icon_name() = "image-loading";
-  else
+    return;
+  }
+  int size = image_list->get_thumbnail_size(),
+      scale = std::max(image_list->get_thumbnail_scale(), int(std::ceil(
+          std::max(thumbnail->get_width(), thumbnail->get_height()) /
+          double(size))));
+  if (scale == 1) {
     cell->property_pixbuf() = thumbnail;
+    return;
+  }
+  g_object_set(cell->gobj(), "surface",
+               get_thumbnail_surface(thumbnail, scale), nullptr);
+}
+
+cairo_surface_t* MainWindow::get_thumbnail_surface(
+    const Glib::RefPtr<Gdk::Pixbuf>& thumbnail, int scale) {
+  GObject* object = G_OBJECT(thumbnail->gobj());
+  auto cached = static_cast<ThumbnailSurface*>(
+      g_object_get_qdata(object, get_surface_quark()));
+  if (cached && cached->scale == scale)
+    return cached->surface;
+  cached = new ThumbnailSurface{scale, gdk_cairo_surface_create_from_pixbuf(
+      thumbnail->gobj(), scale, get_window() ? get_window()->gobj() : nullptr)};
+  g_object_set_qdata_full(object, get_surface_quark(), cached,
+                          &MainWindow::free_thumbnail_surface);
+  return cached->surface;
 }
 
+// static
+void MainWindow::free_thumbnail_surface(gpointer data) {
+  auto cached = static_cast<ThumbnailSurface*>(data);
+  cairo_surface_destroy(cached->surface);
+  delete cached;
+}
+
+// static
+GQuark MainWindow::get_surface_quark() {
+  static GQuark quark = g_quark_from_static_string("lumee-thumbnail-surface");
+  return quark;
+}
+
+// Images are only loaded in list mode. The grid only shows thumbnails. The
+// switch to the image is timed from here until it's painted.
+//
+// Holding a key down would otherwise start decoding every image it passes,
+// and cancel each one before it finished. While it's held, only cached
+// images are shown right away.
+//
+// A slideshow keeps its own place, and leaves the selection on its last image
+// when it stops.
 void MainWindow::on_selection_changed() {
-  image_worker.cancel_all();  // Only one image should be loading at a time.
+  Trace::Span span("MainWindow::on_selection_changed");
+  if (slideshow.is_running())
+    return;
   Gtk::TreeModel::iterator iter = list_view->get_selection()->get_selected();
-  if (iter) {
+  if (iter && !early_path.empty() && !grid_mode &&
+      std::string((*iter)[image_list->columns.path]) == early_path) {
+    early_path.clear();  // It's already shown, or will be.
+    return;
+  }
+  early_path.clear();
+  image_worker.cancel_all();  // Only one image should be loading at a time.
+  image_cache.cancel_await();
+  dwell_timeout.disconnect();
+  if (grid_mode) {
+    header_bar->set_subtitle(iter ? Glib::filename_display_basename(
+        std::string((*iter)[image_list->columns.path])) : Glib::ustring());
+  } else if (iter) {
     std::string path = (*iter)[image_list->columns.path];
-    image_worker.load(std::bind(&MainWindow::on_image_loaded, this,
-                                std::placeholders::_1, path), path);
+    selection_time = g_get_monotonic_time();
+    shown_time = 0;
+    if (key_press_time) {
+      Stats::get_default().add_switch_time(Stats::SWITCH_SELECT,
+                                           selection_time - key_press_time);
+      selection_time = key_press_time;
+    }
+    if (Glib::RefPtr<Gdk::Pixbuf> pixbuf = image_cache.take(path)) {
+      Stats::get_default().increment(Stats::COUNTER_IMAGE_CACHE_HITS);
+      on_image_loaded(pixbuf, path);
+    } else if (key_repeating)
+      show_preview(iter);
+    else
+      load_selected_image();
   } else {  // No selection.
     image_view->clear();
     stack->set_visible_child(*image_view);
@@ -152,11 +361,130 @@ void MainWindow::on_selection_changed() {
   }
 }
 
+// An image that's being prefetched isn't loaded again.
+void MainWindow::load_selected_image() {
+  Gtk::TreeModel::iterator iter = list_view->get_selection()->get_selected();
+  if (!iter || grid_mode)
+    return;
+  ImageWorker::SlotFinished slot =
+      [this](const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+             const std::string& path) { on_image_loaded(pixbuf, path); };
+  std::string path = (*iter)[image_list->columns.path];
+  if (!image_cache.await(path, slot))
+    image_worker.load(slot, path);
+}
+
+// Without a thumbnail, the view is cleared, so it doesn't show the wrong
+// image.
+void MainWindow::show_preview(const Gtk::TreeModel::iterator& iter) {
+  std::string path = (*iter)[image_list->columns.path];
+  Glib::RefPtr<Gdk::Pixbuf> thumbnail = (*iter)[image_list->columns.thumbnail];
+  Stats::get_default().increment(Stats::COUNTER_IMAGES_PREVIEWED);
+  cache_shown_image(path);
+  if (thumbnail)
+    image_view->set_preview(thumbnail);
+  else
+    image_view->clear();
+  stack->set_visible_child(*image_view);
+  header_bar->set_subtitle(Glib::filename_display_basename(path));
+  dwell_timeout = Glib::signal_timeout().connect(sigc::bind_return(
+      sigc::mem_fun(*this, &MainWindow::load_selected_image), false),
+      DWELL_TIME);
+}
+
+// The image is left in the view, which releases it when it's replaced. A
+// slide isn't cached, since it's scaled down.
+void MainWindow::cache_shown_image(const std::string& next_path) {
+  if (!image_view->empty() && !shown_path.empty() && shown_path != next_path)
+    image_cache.add(shown_path, image_view->get_pixbuf());
+}
+
+// Images ahead are prefetched first, since the selection usually moves on.
+void MainWindow::prefetch_around(const Gtk::TreeModel::iterator& iter) {
+  Gtk::TreeModel::Children rows = image_list->children();
+  int index = image_list->get_path(iter)[0], size = rows.size();
+  std::vector<std::string> paths;
+  for (int i = index + 1; i <= index + PREFETCH_AHEAD && i < size; ++i)
+    paths.push_back(std::string(rows[i][image_list->columns.path]));
+  for (int i = index - 1; i >= index - PREFETCH_BEHIND && i >= 0; --i)
+    paths.push_back(std::string(rows[i][image_list->columns.path]));
+  image_cache.prefetch(paths);
+}
+
+// gtkmm 3.10 doesn't wrap the frame clock, so its signals are connected with
+// the C API. A frame is timed from its "before-paint" phase, which follows
+// event handling, until painting is done. The first frame after an image is
+// shown finishes its switch, and the window's first frame finishes startup.
+void MainWindow::watch_frames() {
+  frame_clock = gtk_widget_get_frame_clock(Gtk::Widget::gobj());
+  before_paint_handler = g_signal_connect(
+      frame_clock, "before-paint", G_CALLBACK(on_before_paint), this);
+  after_paint_handler = g_signal_connect(
+      frame_clock, "after-paint", G_CALLBACK(on_after_paint), this);
+}
+
+// The frame clock belongs to the window's `GdkWindow`, which still exists
+// while the "unrealize" handlers run.
+void MainWindow::unwatch_frames() {
+  if (!frame_clock)
+    return;
+  g_signal_handler_disconnect(frame_clock, before_paint_handler);
+  g_signal_handler_disconnect(frame_clock, after_paint_handler);
+  frame_clock = nullptr;
+}
+
+// static
+void MainWindow::on_before_paint(GdkFrameClock* /*frame_clock*/,
+                                 gpointer data) {
+  static_cast<MainWindow*>(data)->paint_start_time = g_get_monotonic_time();
+}
+
+// static
+void MainWindow::on_after_paint(GdkFrameClock* /*frame_clock*/,
+                                gpointer data) {
+  MainWindow* window = static_cast<MainWindow*>(data);
+  gint64 start_time = window->paint_start_time,
+         end_time = g_get_monotonic_time();
+  Stats& stats = Stats::get_default();
+  stats.set_frame_time(end_time - start_time);
+  if (!window->painted) {
+    stats.set_startup_time(end_time - RuntimeInfo::get_start_time());
+    window->painted = true;
+  }
+  if (window->shown_time) {
+    stats.add_switch_time(Stats::SWITCH_PAINT, end_time - window->shown_time);
+    stats.add_switch_time(Stats::SWITCH_TOTAL,
+                          end_time - window->selection_time);
+    window->shown_time = 0;
+  }
+  Trace::add_span("MainWindow frame", start_time, end_time);
+}
+
+// A cached copy of the image is out of date.
+void MainWindow::on_file_changed(const Gtk::TreeModel::iterator& iter) {
+  image_cache.take(std::string((*iter)[image_list->columns.path]));
+  if (list_view->get_selection()->is_selected(iter))
+    on_selection_changed();
+}
+
 void MainWindow::on_image_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
                                  const std::string& path) {
-  if (pixbuf) {
+  Trace::Span span("MainWindow::on_image_loaded");
+  if (grid_mode)  // The result arrived after switching to grid mode.
+    return;
+  else if (pixbuf) {
+    gint64 start_time = g_get_monotonic_time();
+    cache_shown_image(path);
     image_view->set(pixbuf);
+    shown_path = path;
     stack->set_visible_child(*image_view);
+    shown_time = g_get_monotonic_time();
+    Stats::get_default().add_switch_time(Stats::SWITCH_SHOW,
+                                         shown_time - start_time);
+    if (!key_repeating) {
+      if (Gtk::TreeModel::iterator iter = image_list->find(path))
+        prefetch_around(iter);
+    }
   } else {
     show_message(_("Could not load this image"));
     image_view->clear();
@@ -164,6 +492,165 @@ void MainWindow::on_image_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
   header_bar->set_subtitle(Glib::filename_display_basename(path));
 }
 
+// The overlay is refreshed on a timer only while it's shown.
+void MainWindow::toggle_stats() {
+  bool shown = false;
+  action_show_stats->get_state(shown);
+  shown = !shown;
+  action_show_stats->change_state(shown);
+  stats_label->set_visible(shown);
+  stats_timeout.disconnect();
+  if (shown) {
+    update_stats();
+    stats_timeout = Glib::signal_timeout().connect(sigc::bind_return(
+        sigc::mem_fun(*this, &MainWindow::update_stats), true),
+        STATS_INTERVAL);
+  }
+}
+
+void MainWindow::update_stats() {
+  stats_label->set_text(Stats::get_default().format());
+}
+
+void MainWindow::toggle_slideshow() {
+  if (slideshow.is_running())
+    stop_slideshow();
+  else
+    start_slideshow();
+}
+
+// The slideshow starts after the selected image if it's shown, or from the
+// selected image otherwise. Slides are scaled to fit the screen, and then to
+// the view's size once it's allocated.
+void MainWindow::start_slideshow() {
+  int size = image_list->children().size();
+  if (!size)
+    return;
+  Gtk::TreeModel::iterator iter = list_view->get_selection()->get_selected();
+  int first = iter ? image_list->get_path(iter)[0] : 0;
+  bool shown = iter && !grid_mode && !image_view->empty() &&
+               shown_path == std::string((*iter)[image_list->columns.path]);
+  if (shown)
+    first = (first + 1) % size;
+
+  image_worker.cancel_all();
+  dwell_timeout.disconnect();
+  early_path.clear();
+  image_cache.clear();  // Make room for the slideshow's images.
+  action_slideshow->change_state(true);
+  list_scrolled_window->hide();
+  zoom_to_fit("fit-best");
+  stack->set_visible_child(*image_view);
+  fullscreen();
+
+  Glib::RefPtr<Gdk::Screen> screen = get_screen();
+  Gdk::Rectangle monitor;
+  screen->get_monitor_geometry(screen->get_monitor_at_window(get_window()),
+                               monitor);
+  slideshow.start(sigc::mem_fun(*this, &MainWindow::on_slide_shown), first,
+                  !shown, settings->get_uint("slideshow-interval"),
+                  monitor.get_width(), monitor.get_height(),
+                  settings->get_boolean("zoom-to-fit-expand"));
+  slideshow_size = image_view->signal_size_allocate().connect(
+      [this](Gtk::Allocation& allocation) {
+        slideshow.set_size(allocation.get_width(), allocation.get_height());
+      });
+}
+
+// The last slide is selected, and loaded again at full size.
+void MainWindow::stop_slideshow() {
+  slideshow.stop();
+  slideshow_size.disconnect();
+  action_slideshow->change_state(false);
+  unfullscreen();
+  list_scrolled_window->set_visible(!grid_mode);
+  if (grid_mode) {
+    image_view->clear();
+    stack->set_visible_child("grid-area");
+  }
+  std::string path = slideshow_path;
+  slideshow_path.clear();
+  if (path.empty())  // No slide was shown.
+    return;
+  Gtk::TreeModel::iterator iter = image_list->find(path);
+  if (iter && !list_view->get_selection()->is_selected(iter)) {
+    list_view->get_selection()->select(iter);
+    list_view->scroll_to_row(image_list->get_path(iter));
+  } else
+    on_selection_changed();
+}
+
+void MainWindow::on_slide_shown(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                                const std::string& path) {
+  image_view->set(pixbuf, true);
+  shown_path.clear();
+  slideshow_path = path;
+  header_bar->set_subtitle(Glib::filename_display_basename(path));
+}
+
+void MainWindow::set_grid_mode(bool grid_mode) {
+  if (slideshow.is_running())
+    stop_slideshow();
+  this->grid_mode = grid_mode;
+  list_scrolled_window->set_visible(!grid_mode);
+  if (grid_mode) {
+    image_worker.cancel_all();
+    dwell_timeout.disconnect();
+    // Don't hold on to full images in grid mode.
+    image_view->clear();
+    image_cache.clear();
+    stack->set_visible_child("grid-area");
+    image_grid->grab_focus();
+  } else {
+    on_selection_changed();
+    list_view->grab_focus();
+    if (Gtk::TreeModel::iterator iter =
+            list_view->get_selection()->get_selected())
+      list_view->scroll_to_row(image_list->get_path(iter));
+  }
+  update_visible_range();
+}
+
+// The list is kept wide enough for thumbnails, and its rows tall enough,
+// whether or not they've loaded.
+void MainWindow::update_thumbnail_size() {
+  int size = settings->get_int("thumbnail-size");
+  image_list->set_thumbnail_size(size, get_scale_factor());
+  list_view->get_column_cell_renderer(0)->set_fixed_size(size, size);
+  list_view->columns_autosize();
+  list_scrolled_window->set_min_content_width(size + LIST_WIDTH_PADDING);
+}
+
+// Sizes snap to steps of the adjustment, so dragging the slider doesn't save
+// the setting at every pixel.
+void MainWindow::on_thumbnail_size_scale_changed() {
+  Glib::RefPtr<Gtk::Adjustment> adjustment =
+      thumbnail_size_scale->get_adjustment();
+  double step = adjustment->get_step_increment();
+  int size = std::round(adjustment->get_value() / step) * step;
+  if (size != settings->get_int("thumbnail-size"))
+    settings->set_int("thumbnail-size", size);
+}
+
+void MainWindow::update_visible_range() {
+  int first = -1, last = -1;
+  if (grid_mode) {
+    image_grid->get_visible_range(first, last);
+  } else {
+    Gtk::TreeModel::Path start_path, end_path;
+    if (list_view->get_visible_range(start_path, end_path)) {
+      first = start_path[0];
+      last = end_path[0];
+    }
+  }
+  image_list->set_visible_range(first, last);
+}
+
+void MainWindow::on_grid_activated(int /*index*/) {
+  // The activated cell is already selected.
+  settings->set_string("view-mode", "list");
+}
+
 void MainWindow::on_folder_ready(
     bool success, const Glib::RefPtr<Gio::File>& file_to_select) {
   if (!success)
@@ -190,6 +677,16 @@ void MainWindow::on_setting_changed(const Glib::ustring& key) {
          settings->get_boolean("sort-reversed"));
   else if (key == "zoom-to-fit-expand")
     image_view->zoom_to_fit_expand(settings->get_boolean(key));
+  else if (key == "view-mode")
+    set_grid_mode(settings->get_string(key) == "grid");
+  else if (key == "thumbnail-size") {
+    thumbnail_size_scale->set_value(settings->get_int(key));
+    update_thumbnail_size();
+  } else if (key == "memory-budget")
+    MemoryBudget::get_default().set_limit(std::size_t(settings->get_uint(key))
+                                          << 20);
+  else if (key == "recursive" && !folder_path.empty())
+    open(Gio::File::create_for_path(folder_path));  // Reopen the folder.
 }
 
 void MainWindow::zoom_to_fit(const Glib::ustring& fit) {
@@ -16,14 +16,19 @@
 #ifndef LUMEE_MAIN_WINDOW_H
 #define LUMEE_MAIN_WINDOW_H
 
+#include "image_cache.h"
+#include "image_grid.h"
 #include "image_list.h"
 #include "image_view.h"
 #include "image_worker.h"
+#include "slideshow.h"
 
 #include <giomm/settings.h>
 #include <gtkmm/applicationwindow.h>
 #include <gtkmm/builder.h>
 #include <gtkmm/headerbar.h>
+#include <gtkmm/scale.h>
+#include <gtkmm/scrolledwindow.h>
 #include <gtkmm/stack.h>
 #include <gtkmm/treeview.h>
 
@@ -33,17 +38,57 @@ class MainWindow : public Gtk::ApplicationWindow {
   MainWindow(BaseObjectType* cobject,
              const Glib::RefPtr<Gtk::Builder>& builder);
 
-  // Opens a folder. If given a file, opens its containing folder.
-  void open(Glib::RefPtr<Gio::File> file);
+  // Opens a folder. If given a file, opens its containing folder, and shows
+  // the file's image without waiting for the folder. If `file_loading` is
+  // true, the caller is already loading the image, and will pass it to
+  // `show_early_image()`.
+  void open(Glib::RefPtr<Gio::File> file, bool file_loading = false);
+
+  // Shows the image of a file passed to `open()`, unless another image has
+  // been selected since.
+  void show_early_image(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                        const std::string& path);
 
  protected:
-  // Handles additional accelerators for zooming in and out.
+  // Handles additional accelerators for zooming in and out, times key
+  // presses that change the selection, and notices keys being held. Escape
+  // stops a slideshow.
   virtual bool on_key_press_event(GdkEventKey* event);
+  virtual bool on_key_release_event(GdkEventKey* event);
+
+  // Forgets the held key, whose release goes to another window.
+  virtual bool on_focus_out_event(GdkEventFocus* event);
 
   // Saves the window's maximized state to a setting.
   virtual bool on_window_state_event(GdkEventWindowState* event);
 
  private:
+  // Width of the list beyond its thumbnails, for the padding and border.
+  static const int LIST_WIDTH_PADDING;
+
+  // Time between updates of the statistics overlay, in milliseconds.
+  static const int STATS_INTERVAL;
+
+  // While a key is held, a selected image that isn't cached is only loaded
+  // once the selection stays put this long, in milliseconds.
+  static const int DWELL_TIME;
+
+  // Number of images after and before the shown one that are prefetched.
+  static const int PREFETCH_AHEAD;
+  static const int PREFETCH_BEHIND;
+
+  // Oldest an event's time can be and still be trusted, in milliseconds.
+  static const guint32 MAX_EVENT_AGE;
+
+  // Surface made from a thumbnail, and the scale factor it was made with.
+  struct ThumbnailSurface {
+    int scale;
+    cairo_surface_t* surface;
+  };
+
+  // Converts an event's time to the monotonic clock.
+  static gint64 get_event_time(guint32 time);
+
   // Creates and adds the window actions.
   void add_actions();
 
@@ -54,13 +99,69 @@ class MainWindow : public Gtk::ApplicationWindow {
   void on_thumbnail_cell_data(Gtk::CellRenderer* cell,
                               const Gtk::TreeModel::iterator& iter);
 
+  // Returns a surface of a thumbnail with a scale factor. The surface is kept
+  // with the thumbnail, so it's only created again if the scale changes.
+  cairo_surface_t* get_thumbnail_surface(
+      const Glib::RefPtr<Gdk::Pixbuf>& thumbnail, int scale);
+
+  // Frees a `ThumbnailSurface` along with its thumbnail.
+  static void free_thumbnail_surface(gpointer data);
+
+  // Key of the `ThumbnailSurface` attached to a thumbnail.
+  static GQuark get_surface_quark();
+
   // Loads an image based on the file list's selection.
   void on_selection_changed();
+  void load_selected_image();
+
+  // Shows the selected row's thumbnail while a key is held, and loads its
+  // image if the selection stays put.
+  void show_preview(const Gtk::TreeModel::iterator& iter);
+
+  // Moves the shown image into the cache before another image replaces it.
+  void cache_shown_image(const std::string& next_path);
+
+  // Prefetches the images around a row.
+  void prefetch_around(const Gtk::TreeModel::iterator& iter);
+
+  // Times each frame the window paints, for the statistics and the trace.
+  // The handlers are disconnected when the window is unrealized.
+  void watch_frames();
+  void unwatch_frames();
+  static void on_before_paint(GdkFrameClock* frame_clock, gpointer data);
+  static void on_after_paint(GdkFrameClock* frame_clock, gpointer data);
+
+  // Reloads the image if its file was modified while selected.
+  void on_file_changed(const Gtk::TreeModel::iterator& iter);
 
   // Shows an image that has finished loading.
   void on_image_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
                        const std::string& path);
 
+  // Shows or hides the statistics overlay, and updates it.
+  void toggle_stats();
+  void update_stats();
+
+  // Starts or stops a full-screen slideshow of the folder.
+  void toggle_slideshow();
+  void start_slideshow();
+  void stop_slideshow();
+  void on_slide_shown(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                      const std::string& path);
+
+  // Switches between the list and grid browsing modes.
+  void set_grid_mode(bool grid_mode);
+
+  // Tells the image list which rows the current view shows.
+  void update_visible_range();
+
+  // Sets the thumbnail size from its setting and the window's scale factor.
+  void update_thumbnail_size();
+  void on_thumbnail_size_scale_changed();
+
+  // Leaves grid mode to show the image at `index`.
+  void on_grid_activated(int index);
+
   // Handler for when a folder has finished opening. Selects `file_to_select`
   // in the list, if valid.
   void on_folder_ready(bool success,
@@ -87,18 +188,55 @@ class MainWindow : public Gtk::ApplicationWindow {
                                   action_zoom_out, action_zoom_out_slight,
                                   action_zoom_to_fit;
   Glib::RefPtr<Gio::Action> action_zoom_to_fit_expand;
+  Glib::RefPtr<Gio::SimpleAction> action_show_stats, action_slideshow;
 
   Gtk::HeaderBar* header_bar = nullptr;
   Gtk::Label* zoom_label = nullptr;
+  Gtk::Scale* thumbnail_size_scale = nullptr;
+  Gtk::ScrolledWindow* list_scrolled_window = nullptr;
   Gtk::TreeView* list_view = nullptr;
   Gtk::Stack* stack = nullptr;
+  ImageGrid* image_grid = nullptr;
   ImageView* image_view = nullptr;
   Gtk::Image* message_icon = nullptr;
   Gtk::Label* message = nullptr;
+  Gtk::Label* stats_label = nullptr;
+  sigc::connection stats_timeout;
 
   Glib::RefPtr<ImageList> image_list = ImageList::create();
   std::string folder_path;
   ImageWorker image_worker;
+  ImageCache image_cache;
+  std::string shown_path;  // File of the image in the view.
+  bool grid_mode = false;
+
+  // Slides are scaled to the view, and aren't kept in the image cache.
+  Slideshow slideshow{image_list};
+  std::string slideshow_path;  // File of the slide in the view.
+  sigc::connection slideshow_size;
+
+  // Key that's held down, and whether it has repeated. A selection that
+  // changes while it repeats shows a preview until it stays put.
+  guint held_keyval = 0;
+  bool key_repeating = false;
+  sigc::connection dwell_timeout;
+
+  GdkFrameClock* frame_clock = nullptr;  // Watched by `watch_frames()`.
+  gulong before_paint_handler = 0;
+  gulong after_paint_handler = 0;
+  gint64 paint_start_time = 0;
+  bool painted = false;  // True after the first frame.
+  // Times of the image switch in progress: when the key press that changes
+  // the selection started, when the loading image was selected, and when it
+  // was shown and is waiting to be painted. The key press and shown times are
+  // 0 when not in progress.
+  gint64 key_press_time = 0;
+  gint64 selection_time = 0;
+  gint64 shown_time = 0;
+
+  // File passed to `open()` whose image is shown, or loading, before its
+  // folder is ready. When the folder selects it, it isn't loaded again.
+  std::string early_path;
 };
 
 #endif  // LUMEE_MAIN_WINDOW_H
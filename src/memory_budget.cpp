@@ -0,0 +1,191 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "memory_budget.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+const double MemoryBudget::LOW_WATER = 0.8;
+const std::size_t MemoryBudget::MIN_AUTO_LIMIT = std::size_t(256) << 20;
+const std::size_t MemoryBudget::MAX_AUTO_LIMIT = std::size_t(4) << 30;
+const char* const MemoryBudget::PRESSURE_TRIGGER = "some 150000 2000000";
+const int MemoryBudget::PRESSURE_INTERVAL = 2000;
+const double MemoryBudget::PRESSURE_THRESHOLD = 10.0;
+const double MemoryBudget::PRESSURE_POLL_LEVEL = 0.5;
+
+MemoryBudget::MemoryBudget() : limit(get_auto_limit()) {
+  start_pressure_monitor();
+}
+
+MemoryBudget::~MemoryBudget() {
+  shed_idle.disconnect();
+  pressure_connection.disconnect();
+  if (pressure_fd >= 0)
+    ::close(pressure_fd);
+}
+
+// static
+MemoryBudget& MemoryBudget::get_default() {
+  static MemoryBudget budget;
+  return budget;
+}
+
+// The row stride isn't used, since a sub-pixbuf's stride is its parent's.
+//
+// static
+std::size_t MemoryBudget::get_size(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) {
+  return pixbuf ? std::size_t(pixbuf->get_width()) * pixbuf->get_height() *
+      pixbuf->get_n_channels() : 0;
+}
+
+void MemoryBudget::add(Category category, std::size_t bytes) {
+  used[category] += bytes;
+  total_used += bytes;
+  check();
+  update_pressure_polling();
+}
+
+void MemoryBudget::remove(Category category, std::size_t bytes) {
+  bytes = std::min(bytes, used[category]);
+  used[category] -= bytes;
+  total_used -= bytes;
+  update_pressure_polling();
+}
+
+// Shedding down to the low-water mark leaves room for a while, so this doesn't
+// shed again on every call.
+bool MemoryBudget::make_room(Category category) {
+  if (!is_full())
+    return true;
+  shed(total_used - std::size_t(limit * LOW_WATER), category);
+  return !is_full();
+}
+
+void MemoryBudget::set_limit(std::size_t bytes) {
+  limit = bytes ? bytes : get_auto_limit();
+  check();
+  update_pressure_polling();
+}
+
+void MemoryBudget::connect_shedder(Category category, const SlotShed& slot) {
+  shedders[category].push_back(slot);
+}
+
+// A quarter of physical memory, so a few instances can run side by side on a
+// shared machine.
+//
+// static
+std::size_t MemoryBudget::get_auto_limit() {
+  long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page_size <= 0)
+    return MIN_AUTO_LIMIT;
+  std::size_t physical = std::size_t(pages) * std::size_t(page_size);
+  return std::max(MIN_AUTO_LIMIT, std::min(MAX_AUTO_LIMIT, physical / 4));
+}
+
+// Memory is usually added while a caller is in the middle of updating its
+// own state, so shedding waits until it's done.
+void MemoryBudget::check() {
+  if (total_used > limit && !shed_idle.connected())
+    shed_idle = Glib::signal_idle().connect(sigc::bind_return(sigc::mem_fun(
+        *this, &MemoryBudget::shed_over_limit), false),
+        Glib::PRIORITY_HIGH_IDLE);
+}
+
+void MemoryBudget::shed_over_limit() {
+  std::size_t target = limit * LOW_WATER;
+  if (total_used > target)
+    shed(total_used - target);
+}
+
+// Shedders whose objects have been destroyed are removed as they're found.
+void MemoryBudget::shed(std::size_t bytes, Category end) {
+  for (int c = 0; c < end && bytes; ++c) {
+    std::list<SlotShed>& list = shedders[c];
+    for (auto iter = list.begin(); iter != list.end() && bytes;) {
+      if (iter->empty()) {
+        iter = list.erase(iter);
+        continue;
+      }
+      bytes -= std::min(bytes, (*iter)(bytes));
+      ++iter;
+    }
+  }
+}
+
+// A PSI trigger makes the file pollable; the kernel signals it at most once
+// per window while memory is stalling. Older kernels only let privileged
+// processes create triggers, so the averages are polled instead, but only
+// while there's enough memory in use to be worth shedding.
+void MemoryBudget::start_pressure_monitor() {
+#ifdef __linux__
+  const char* path = "/proc/pressure/memory";
+  std::size_t trigger_size = std::strlen(PRESSURE_TRIGGER) + 1;
+  pressure_fd = ::open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (pressure_fd >= 0 &&
+      ::write(pressure_fd, PRESSURE_TRIGGER, trigger_size) > 0) {
+    pressure_connection = Glib::signal_io().connect(sigc::mem_fun(
+        *this, &MemoryBudget::on_pressure_event), pressure_fd,
+        Glib::IO_PRI | Glib::IO_ERR);
+    return;
+  }
+  if (pressure_fd >= 0)
+    ::close(pressure_fd);
+  pressure_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  pressure_polled = pressure_fd >= 0;
+  update_pressure_polling();
+#endif
+}
+
+bool MemoryBudget::on_pressure_event(Glib::IOCondition condition) {
+  if (condition & Glib::IO_ERR)
+    return false;  // The trigger can't be used anymore.
+  on_pressure();
+  return true;
+}
+
+// The file starts with a line like "some avg10=1.23 avg60=...".
+bool MemoryBudget::on_pressure_timeout() {
+  char buffer[128];
+  ssize_t count = ::pread(pressure_fd, buffer, sizeof buffer - 1, 0);
+  if (count <= 0) {
+    pressure_polled = false;
+    return false;
+  }
+  buffer[count] = '\0';
+  double avg10 = 0.0;
+  if (std::sscanf(buffer, "some avg10=%lf", &avg10) == 1 &&
+      avg10 > PRESSURE_THRESHOLD)
+    on_pressure();
+  return true;
+}
+
+void MemoryBudget::update_pressure_polling() {
+  if (!pressure_polled)
+    return;
+  else if (total_used < limit * PRESSURE_POLL_LEVEL)
+    pressure_connection.disconnect();
+  else if (!pressure_connection.connected())
+    pressure_connection = Glib::signal_timeout().connect(sigc::mem_fun(
+        *this, &MemoryBudget::on_pressure_timeout), PRESSURE_INTERVAL);
+}
+
+void MemoryBudget::on_pressure() {
+  shed(total_used / 2);
+}
@@ -0,0 +1,137 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_MEMORY_BUDGET_H
+#define LUMEE_MEMORY_BUDGET_H
+
+#include <gdkmm/pixbuf.h>
+#include <glibmm/main.h>
+
+#include <list>
+
+// Counts the pixel memory held by the process against a total budget. When
+// the budget is exceeded, or the system reports memory pressure, memory is
+// shed by calling the slots registered for each category in order.
+//
+// Only used from the main thread.
+class MemoryBudget {
+ public:
+  // Kinds of pixel memory, in the order they're shed.
+  enum Category {
+    CATEGORY_CACHES,      // Images kept in case they're shown again.
+    CATEGORY_THUMBNAILS,
+    CATEGORY_RENDERS,     // Scaled copies of images for display.
+    CATEGORY_IMAGES,      // Decoded images being shown.
+    NUM_CATEGORIES
+  };
+
+  // Function that frees memory in a category. It's given the number of bytes
+  // wanted, and returns the number it freed.
+  //
+  //     std::size_t on_shed(std::size_t bytes)
+  typedef sigc::slot<std::size_t, std::size_t> SlotShed;
+
+  ~MemoryBudget();
+
+  // Returns the budget shared by the whole process.
+  static MemoryBudget& get_default();
+
+  // Returns the number of bytes a pixbuf's pixels take.
+  static std::size_t get_size(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf);
+
+  // Counts memory that was allocated or freed in a category.
+  void add(Category category, std::size_t bytes);
+  void remove(Category category, std::size_t bytes);
+
+  // Returns the bytes used in total, or in one category.
+  std::size_t get_used() const { return total_used; }
+  std::size_t get_used(Category category) const { return used[category]; }
+
+  // Returns true if the budget is used up. Memory that can be loaded later
+  // shouldn't be loaded ahead.
+  bool is_full() const { return total_used >= limit; }
+
+  // Returns true if there's room for more memory in a category. If the budget
+  // is full, the categories shed before it are shed first to make room.
+  bool make_room(Category category);
+
+  // Sets the budget in bytes. 0 chooses it from the amount of physical
+  // memory.
+  void set_limit(std::size_t bytes);
+  std::size_t get_limit() const { return limit; }
+
+  // Adds a slot that frees memory in a category. Slots of `sigc::trackable`
+  // objects are dropped once the objects are destroyed.
+  void connect_shedder(Category category, const SlotShed& slot);
+
+ private:
+  MemoryBudget();
+
+  // After shedding, usage is brought down to this fraction of the budget, so
+  // it isn't shed again right away.
+  static const double LOW_WATER;
+
+  // Default range of the automatic budget, in bytes.
+  static const std::size_t MIN_AUTO_LIMIT;
+  static const std::size_t MAX_AUTO_LIMIT;
+
+  // PSI trigger: a stall of this many microseconds within the window, which
+  // must be a multiple of 2 seconds for unprivileged processes.
+  static const char* const PRESSURE_TRIGGER;
+
+  // Where triggers can't be used, the pressure is read at this interval (in
+  // milliseconds), and memory is shed if it's above the threshold (in
+  // percent of time stalled over the last 10 seconds). It's only read while
+  // usage is above the given fraction of the budget, since there's little to
+  // shed otherwise.
+  static const int PRESSURE_INTERVAL;
+  static const double PRESSURE_THRESHOLD;
+  static const double PRESSURE_POLL_LEVEL;
+
+  // Returns the budget chosen when the limit is 0.
+  static std::size_t get_auto_limit();
+
+  // Sheds memory in an idle callback if the budget is exceeded.
+  void check();
+  void shed_over_limit();
+
+  // Calls the shedders in category order until `bytes` have been freed. Only
+  // categories before `end` are shed.
+  void shed(std::size_t bytes, Category end = NUM_CATEGORIES);
+
+  // Starts watching `/proc/pressure/memory`, if the kernel has it.
+  void start_pressure_monitor();
+  bool on_pressure_event(Glib::IOCondition condition);
+  bool on_pressure_timeout();
+
+  // Starts or stops reading the pressure as usage crosses
+  // `PRESSURE_POLL_LEVEL`, if it's read on a timer.
+  void update_pressure_polling();
+
+  // Sheds half of the memory in use.
+  void on_pressure();
+
+  std::size_t used[NUM_CATEGORIES] = {};
+  std::size_t total_used = 0;
+  std::size_t limit = 0;
+  std::list<SlotShed> shedders[NUM_CATEGORIES];
+  sigc::connection shed_idle;
+
+  int pressure_fd = -1;
+  bool pressure_polled = false;  // Read on a timer instead of a trigger.
+  sigc::connection pressure_connection;
+};
+
+#endif  // LUMEE_MEMORY_BUDGET_H
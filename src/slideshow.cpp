@@ -0,0 +1,208 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "slideshow.h"
+#include "memory_budget.h"
+#include "stats.h"
+
+#include <algorithm>
+
+const std::size_t Slideshow::BUFFER_SIZE = 4;
+
+Slideshow::Slideshow(const Glib::RefPtr<ImageList>& image_list)
+    : image_list(image_list) {
+  MemoryBudget::get_default().connect_shedder(
+      MemoryBudget::CATEGORY_CACHES, sigc::mem_fun(*this, &Slideshow::shed));
+}
+
+Slideshow::~Slideshow() {
+  stop();
+}
+
+void Slideshow::start(const SlotShow& slot, int first, bool show_first,
+                      int interval, int width, int height, bool expand) {
+  stop();
+  slot_show = slot;
+  next_row = first;
+  this->interval = interval;
+  this->width = width;
+  this->height = height;
+  this->expand = expand;
+  running = true;
+  waiting = show_first;
+  failures = 0;
+  fill();
+  if (!show_first) {
+    tick_timeout = Glib::signal_timeout().connect(
+        sigc::mem_fun(*this, &Slideshow::on_tick), interval);
+  }
+}
+
+void Slideshow::stop() {
+  running = waiting = false;
+  tick_timeout.disconnect();
+  clear();
+  slot_show = SlotShow();
+}
+
+// Slides that are still loading are loaded again too, since loads can only be
+// cancelled all together. They keep their place in the buffer.
+void Slideshow::set_size(int width, int height) {
+  if (width == this->width && height == this->height)
+    return;
+  int old_width = this->width, old_height = this->height;
+  this->width = width;
+  this->height = height;
+  if (std::all_of(slides.begin(), slides.end(), [&](const Slide& slide) {
+        return slide.loaded && fits_size(slide, old_width, old_height);
+      }))
+    return;
+  image_worker.cancel_all();
+  for (Slide& slide : slides) {
+    if (slide.loaded && fits_size(slide, old_width, old_height))
+      continue;
+    if (slide.pixbuf) {
+      std::size_t size = MemoryBudget::get_size(slide.pixbuf);
+      buffered_bytes -= size;
+      MemoryBudget::get_default().remove(MemoryBudget::CATEGORY_CACHES, size);
+      slide.pixbuf.reset();
+    }
+    slide.loaded = false;
+    load(slide.path);
+  }
+}
+
+// A folder may be reopened while running, so the row is wrapped again each
+// time. If every image has failed to load, there's nothing left to show.
+void Slideshow::fill() {
+  Gtk::TreeModel::Children rows = image_list->children();
+  int size = rows.size();
+  if (!size || failures >= size)
+    return;
+  while (slides.size() < std::min(BUFFER_SIZE, std::size_t(size))) {
+    if (!slides.empty() && MemoryBudget::get_default().is_full())
+      break;
+    next_row %= size;
+    std::string path(rows[next_row][image_list->columns.path]);
+    ++next_row;
+    slides.emplace_back(path);
+    load(path);
+  }
+}
+
+void Slideshow::load(const std::string& path) {
+  image_worker.load_scaled(
+      [this](const Glib::RefPtr<Gdk::Pixbuf>& pixbuf, const std::string& path) {
+        on_loaded(pixbuf, path);
+      },
+      path, width, height, expand, WorkQueue::PRIORITY_PREFETCH);
+}
+
+// The same image may be buffered more than once in a short list, so the result
+// goes to the first slide still waiting for it.
+void Slideshow::on_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                          const std::string& path) {
+  std::size_t size = 0;
+  for (Slide& slide : slides) {
+    if (!slide.loaded && slide.path == path) {
+      slide.pixbuf = pixbuf;
+      slide.loaded = true;
+      size = pixbuf ? MemoryBudget::get_size(pixbuf) : 0;
+      break;
+    }
+  }
+  buffered_bytes += size;
+  MemoryBudget::get_default().add(MemoryBudget::CATEGORY_CACHES, size);
+  if (waiting && show_next()) {
+    waiting = false;
+    tick_timeout = Glib::signal_timeout().connect(
+        sigc::mem_fun(*this, &Slideshow::on_tick), interval);
+  }
+}
+
+// A fitted image touches the box in at least one dimension, unless it wasn't
+// scaled. It's scaled the same, give or take a pixel of rounding, if it still
+// fits and the dimensions it touched haven't changed.
+bool Slideshow::fits_size(const Slide& slide, int old_width,
+                          int old_height) const {
+  if (!slide.pixbuf)
+    return true;
+  int image_width = slide.pixbuf->get_width();
+  int image_height = slide.pixbuf->get_height();
+  return image_width <= width && image_height <= height &&
+         (image_width < old_width || width == old_width) &&
+         (image_height < old_height || height == old_height);
+}
+
+bool Slideshow::on_tick() {
+  if (show_next())
+    return true;
+  Stats::get_default().increment(Stats::COUNTER_SLIDES_LATE);
+  waiting = true;
+  return false;
+}
+
+bool Slideshow::show_next() {
+  while (!slides.empty() && slides.front().loaded &&
+         !slides.front().pixbuf) {
+    slides.pop_front();
+    ++failures;
+    fill();
+  }
+  if (slides.empty() || !slides.front().loaded)
+    return false;
+  Slide slide = slides.front();
+  slides.pop_front();
+  failures = 0;
+  std::size_t size = MemoryBudget::get_size(slide.pixbuf);
+  buffered_bytes -= size;
+  MemoryBudget::get_default().remove(MemoryBudget::CATEGORY_CACHES, size);
+  slot_show(slide.pixbuf, slide.path);
+  fill();
+  return true;
+}
+
+std::size_t Slideshow::shed(std::size_t bytes) {
+  std::size_t freed = 0;
+  while (freed < bytes && slides.size() > 1) {
+    std::size_t old_bytes = buffered_bytes;
+    pop_back();
+    freed += old_bytes - buffered_bytes;
+  }
+  return freed;
+}
+
+// A load that's still running for the slide is ignored when it finishes,
+// unless the row has been buffered again by then.
+void Slideshow::pop_back() {
+  const Slide& slide = slides.back();
+  if (slide.pixbuf) {
+    std::size_t size = MemoryBudget::get_size(slide.pixbuf);
+    buffered_bytes -= size;
+    MemoryBudget::get_default().remove(MemoryBudget::CATEGORY_CACHES, size);
+  }
+  slides.pop_back();
+  int size = image_list->children().size();
+  if (size)
+    next_row = (next_row + size - 1) % size;
+}
+
+void Slideshow::clear() {
+  image_worker.cancel_all();
+  slides.clear();
+  MemoryBudget::get_default().remove(MemoryBudget::CATEGORY_CACHES,
+                                     buffered_bytes);
+  buffered_bytes = 0;
+}
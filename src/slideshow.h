@@ -0,0 +1,120 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_SLIDESHOW_H
+#define LUMEE_SLIDESHOW_H
+
+#include "image_list.h"
+#include "image_worker.h"
+
+#include <gdkmm/pixbuf.h>
+#include <glibmm/main.h>
+
+#include <deque>
+#include <string>
+
+// Shows the images of an `ImageList` one after another on a timer, starting
+// over after the last one. The next `BUFFER_SIZE` images are decoded and
+// scaled to the view's size ahead of time in the work queue, so showing one is
+// just a matter of drawing it. If the next image still isn't ready when its
+// time comes, it's shown as soon as it is, and the timer restarts from then.
+//
+// Buffered images are counted in the `MemoryBudget` as `CATEGORY_CACHES`.
+//
+// Only used from the main thread.
+class Slideshow : public sigc::trackable {
+ public:
+  // Function that shows an image.
+  //
+  //     void on_show(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+  //                  const std::string& path)
+  typedef sigc::slot<void, const Glib::RefPtr<Gdk::Pixbuf>&,
+                     const std::string&> SlotShow;
+
+  explicit Slideshow(const Glib::RefPtr<ImageList>& image_list);
+  ~Slideshow();
+
+  // Starts showing images every `interval` milliseconds, from the row at
+  // `first`. If `show_first` is true, the first image is shown as soon as it's
+  // loaded; otherwise, the image already shown stays until the first tick.
+  //
+  // Images are scaled to fit `width` and `height`, expanding them if `expand`
+  // is true; see `Dimensions::fit()`.
+  void start(const SlotShow& slot, int first, bool show_first, int interval,
+             int width, int height, bool expand);
+  void stop();
+  bool is_running() const { return running; }
+
+  // Changes the size images are scaled to. Buffered images that would be
+  // scaled differently are loaded again at the new size.
+  void set_size(int width, int height);
+
+ private:
+  struct Slide {
+    explicit Slide(const std::string& path) : path(path) {}
+
+    std::string path;
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf;  // Empty if it failed to load.
+    bool loaded = false;
+  };
+
+  // Number of images loaded ahead.
+  static const std::size_t BUFFER_SIZE;
+
+  // Loads images until the buffer is full, or holds the whole list. Only the
+  // next image is loaded while the memory budget is full.
+  void fill();
+  void load(const std::string& path);
+  void on_loaded(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                 const std::string& path);
+
+  // Returns true if a buffered image was scaled to the same size it would be
+  // at the current size, having been loaded at `old_width` and `old_height`.
+  // Images that failed to load always match.
+  bool fits_size(const Slide& slide, int old_width, int old_height) const;
+
+  bool on_tick();
+
+  // Shows the next image, skipping images that failed to load. Returns false
+  // if it's still loading.
+  bool show_next();
+
+  // Drops buffered images, loading them again later. The next image is never
+  // dropped, since it's needed first. Returns the number of bytes freed.
+  std::size_t shed(std::size_t bytes);
+
+  // Drops the last slide in the buffer, so its row is loaded again.
+  void pop_back();
+
+  // Clears the buffer and cancels its loads.
+  void clear();
+
+  Glib::RefPtr<ImageList> image_list;
+  SlotShow slot_show;
+  std::deque<Slide> slides;
+  int next_row = 0;  // Row of the next image to buffer.
+  int interval = 0;
+  int width = 0, height = 0;
+  bool expand = false;
+
+  bool running = false;
+  bool waiting = false;  // True if it's time to show the next image.
+  int failures = 0;  // Images in a row that failed to load.
+  sigc::connection tick_timeout;
+  std::size_t buffered_bytes = 0;
+  ImageWorker image_worker;
+};
+
+#endif  // LUMEE_SLIDESHOW_H
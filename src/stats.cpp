@@ -0,0 +1,208 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "stats.h"
+#include "memory_budget.h"
+#include "thumbnail_atlas.h"
+#include "work_queue.h"
+
+#include <algorithm>
+#include <cstdio>
+
+const char* const Stats::SWITCH_STAGE_NAMES[NUM_SWITCH_STAGES] = {
+    "select", "read", "queue", "decode", "dispatch", "show", "paint",
+    "total"};
+const int Stats::NUM_BUCKETS;
+const gint64 Stats::RATE_INTERVAL = 1000000;
+const char* const Stats::COUNTER_NAMES[NUM_COUNTERS] = {
+    "thumbnails_loaded", "images_loaded", "image_cache_hits",
+    "images_previewed", "slides_late", "thumbnail_cache_hits",
+    "thumbnail_cache_misses", "snapshot_hits", "snapshot_misses"};
+
+// static
+Stats& Stats::get_default() {
+  static Stats stats;
+  return stats;
+}
+
+void Stats::add_switch_time(SwitchStage stage, gint64 time) {
+  switch_times[stage].add(time);
+  if (stage == SWITCH_TOTAL)
+    switch_time = time;
+}
+
+std::vector<std::pair<std::string, double>> Stats::get_values() {
+  update_rate();
+  std::vector<std::pair<std::string, double>> values;
+  std::vector<int> depths = WorkQueue::get_default().get_queue_depths();
+  for (std::size_t i = 0; i < depths.size(); ++i)
+    values.emplace_back("queue_depth_" + std::to_string(i), depths[i]);
+  values.emplace_back("queue_depth_injected",
+                      WorkQueue::get_default().get_injected_depth());
+  values.emplace_back("thumbnails_per_second", thumbnail_rate);
+  for (int c = 0; c < NUM_COUNTERS; ++c)
+    values.emplace_back(COUNTER_NAMES[c], get(Counter(c)));
+  values.emplace_back("thumbnail_cache_hit_rate", get_hit_rate(
+      get(COUNTER_THUMBNAIL_CACHE_HITS), get(COUNTER_THUMBNAIL_CACHE_MISSES)));
+  values.emplace_back("snapshot_hit_rate", get_hit_rate(
+      get(COUNTER_SNAPSHOT_HITS), get(COUNTER_SNAPSHOT_MISSES)));
+  for (int b = 0; b < NUM_BUCKETS; ++b) {
+    std::string name = b < NUM_BUCKETS - 1 ?
+        "decodes_under_" + std::to_string(get_bucket_limit(b)) + "_ms" :
+        "decodes_over_" + std::to_string(get_bucket_limit(b - 1)) + "_ms";
+    values.emplace_back(name, decode_times.buckets[b].load(
+        std::memory_order_relaxed));
+  }
+  for (int stage = 0; stage < NUM_SWITCH_STAGES; ++stage) {
+    std::string name = std::string("switch_") + SWITCH_STAGE_NAMES[stage];
+    values.emplace_back(name + "_mean_ms", switch_times[stage].get_mean());
+    values.emplace_back(name + "_p95_ms",
+                        switch_times[stage].get_percentile(95.0));
+  }
+
+  MemoryBudget& budget = MemoryBudget::get_default();
+  values.emplace_back("bytes_caches",
+                      budget.get_used(MemoryBudget::CATEGORY_CACHES));
+  values.emplace_back("bytes_thumbnails",
+                      budget.get_used(MemoryBudget::CATEGORY_THUMBNAILS));
+  values.emplace_back("bytes_renders",
+                      budget.get_used(MemoryBudget::CATEGORY_RENDERS));
+  values.emplace_back("bytes_images",
+                      budget.get_used(MemoryBudget::CATEGORY_IMAGES));
+  values.emplace_back("bytes_thumbnail_atlas",
+                      ThumbnailAtlas::get_default().get_size());
+  values.emplace_back("image_switch_ms", switch_time / 1000.0);
+  values.emplace_back("frame_ms", frame_time / 1000.0);
+  values.emplace_back("startup_ms", startup_time / 1000.0);
+  values.emplace_back("formats_ms", formats_time / 1000.0);
+  return values;
+}
+
+Glib::ustring Stats::format() {
+  update_rate();
+  MemoryBudget& budget = MemoryBudget::get_default();
+  const double MIB = 1 << 20;
+  char buffer[128];
+  std::string text = "Queue depths   ";
+  for (int depth : WorkQueue::get_default().get_queue_depths())
+    text += " " + std::to_string(depth);
+  text += ", injected " +
+      std::to_string(WorkQueue::get_default().get_injected_depth());
+
+  std::snprintf(buffer, sizeof buffer, "\nThumbnails/s    %.1f",
+                thumbnail_rate);
+  text += buffer;
+  text += "\nDecodes (ms)   ";
+  for (int b = 0; b < NUM_BUCKETS; ++b) {
+    std::snprintf(buffer, sizeof buffer, " %s%d:%llu",
+                  b < NUM_BUCKETS - 1 ? "<" : ">=",
+                  get_bucket_limit(b < NUM_BUCKETS - 1 ? b : b - 1),
+                  static_cast<unsigned long long>(decode_times.buckets[b].load(
+                      std::memory_order_relaxed)));
+    text += buffer;
+  }
+  std::snprintf(buffer, sizeof buffer,
+                "\nCache hits      thumbnails %.0f%%, folders %.0f%%",
+                get_hit_rate(get(COUNTER_THUMBNAIL_CACHE_HITS),
+                             get(COUNTER_THUMBNAIL_CACHE_MISSES)) * 100,
+                get_hit_rate(get(COUNTER_SNAPSHOT_HITS),
+                             get(COUNTER_SNAPSHOT_MISSES)) * 100);
+  text += buffer;
+  std::snprintf(buffer, sizeof buffer,
+                "\nMemory (MiB)    images %.1f, renders %.1f, thumbnails "
+                "%.1f (atlas %.1f), caches %.1f",
+                budget.get_used(MemoryBudget::CATEGORY_IMAGES) / MIB,
+                budget.get_used(MemoryBudget::CATEGORY_RENDERS) / MIB,
+                budget.get_used(MemoryBudget::CATEGORY_THUMBNAILS) / MIB,
+                ThumbnailAtlas::get_default().get_size() / MIB,
+                budget.get_used(MemoryBudget::CATEGORY_CACHES) / MIB);
+  text += buffer;
+  std::snprintf(buffer, sizeof buffer,
+                "\nImage switch    %.1f ms, mean and p95 (ms):",
+                switch_time / 1000.0);
+  text += buffer;
+  for (int stage = 0; stage < NUM_SWITCH_STAGES; ++stage) {
+    std::snprintf(buffer, sizeof buffer, "\n  %-14s%7.1f %7.1f",
+                  SWITCH_STAGE_NAMES[stage], switch_times[stage].get_mean(),
+                  switch_times[stage].get_percentile(95.0));
+    text += buffer;
+  }
+  std::snprintf(buffer, sizeof buffer, "\nFrame           %.1f ms",
+                frame_time / 1000.0);
+  text += buffer;
+  std::snprintf(buffer, sizeof buffer,
+                "\nStartup         %.1f ms (formats %.1f ms)",
+                startup_time / 1000.0, formats_time / 1000.0);
+  return text + buffer;
+}
+
+// static
+double Stats::get_hit_rate(guint64 hits, guint64 misses) {
+  return hits + misses ? double(hits) / (hits + misses) : 0.0;
+}
+
+void Stats::update_rate() {
+  gint64 now = g_get_monotonic_time();
+  if (now - rate_time < RATE_INTERVAL)
+    return;
+  guint64 count = get(COUNTER_THUMBNAILS_LOADED);
+  thumbnail_rate = rate_time ?
+      (count - rate_count) * 1e6 / (now - rate_time) : 0.0;
+  rate_time = now;
+  rate_count = count;
+}
+
+void Stats::Histogram::add(gint64 time) {
+  int bucket = 0;
+  while (bucket < NUM_BUCKETS - 1 && time >= get_bucket_limit(bucket) * 1000)
+    ++bucket;
+  buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(time, std::memory_order_relaxed);
+  gint64 old_max = max.load(std::memory_order_relaxed);
+  while (time > old_max &&
+         !max.compare_exchange_weak(old_max, time, std::memory_order_relaxed))
+    continue;
+}
+
+double Stats::Histogram::get_mean() const {
+  guint64 n = count.load(std::memory_order_relaxed);
+  return n ? total.load(std::memory_order_relaxed) / 1000.0 / n : 0.0;
+}
+
+// Times are assumed to be spread evenly within the bucket the percentile
+// falls in, as in Prometheus' `histogram_quantile()`. The last bucket ends at
+// the slowest time. The counts may change while they're read, so the rank is
+// checked against the buckets' sum as it goes.
+double Stats::Histogram::get_percentile(double percentile) const {
+  guint64 n = count.load(std::memory_order_relaxed);
+  if (!n)
+    return 0.0;
+  double rank = percentile / 100.0 * n;
+  double slowest = max.load(std::memory_order_relaxed) / 1000.0;
+  guint64 sum = 0;
+  for (int b = 0; b < NUM_BUCKETS; ++b) {
+    guint64 bucket_count = buckets[b].load(std::memory_order_relaxed);
+    if (!bucket_count || sum + bucket_count < rank) {
+      sum += bucket_count;
+      continue;
+    }
+    double lower = b ? get_bucket_limit(b - 1) : 0.0,
+           upper = b < NUM_BUCKETS - 1 ? get_bucket_limit(b) : slowest;
+    double time = lower + (upper - lower) * (rank - sum) / bucket_count;
+    return std::min(time, slowest);
+  }
+  return slowest;
+}
@@ -0,0 +1,158 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_STATS_H
+#define LUMEE_STATS_H
+
+#include <glibmm/ustring.h>
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Performance counters for the whole process, shown in the window's overlay
+// and exported through the application's "stats" action.
+//
+// Counters and decode times can be recorded from any thread. Everything else
+// is only used from the main thread.
+class Stats {
+ public:
+  enum Counter {
+    COUNTER_THUMBNAILS_LOADED,
+    COUNTER_IMAGES_LOADED,
+    COUNTER_IMAGE_CACHE_HITS,   // Images shown from the `ImageCache`.
+    COUNTER_IMAGES_PREVIEWED,   // Passed over while a key was held.
+    COUNTER_SLIDES_LATE,        // Slideshow images not loaded in time.
+    COUNTER_THUMBNAIL_CACHE_HITS,
+    COUNTER_THUMBNAIL_CACHE_MISSES,
+    COUNTER_SNAPSHOT_HITS,  // Folders filled from their snapshots.
+    COUNTER_SNAPSHOT_MISSES,
+    NUM_COUNTERS
+  };
+
+  // Stages of switching to an image, from the key press that selects it until
+  // it's painted. A switch that doesn't start with a key press starts when the
+  // selection changes.
+  enum SwitchStage {
+    SWITCH_SELECT,    // Until the selection changes.
+    SWITCH_READ,      // Until the file is read.
+    SWITCH_QUEUE,     // Until a worker thread starts decoding it.
+    SWITCH_DECODE,    // Until the image is decoded.
+    SWITCH_DISPATCH,  // Until the main thread takes the result.
+    SWITCH_SHOW,      // Until the image is set in the view.
+    SWITCH_PAINT,     // Until the first frame showing it is painted.
+    SWITCH_TOTAL,     // The whole switch.
+    NUM_SWITCH_STAGES
+  };
+
+  static const char* const SWITCH_STAGE_NAMES[NUM_SWITCH_STAGES];
+
+  // Returns the counters shared by the whole process.
+  static Stats& get_default();
+
+  void increment(Counter counter) {
+    counters[counter].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Records how long an image took to decode, in microseconds.
+  void add_decode_time(gint64 time) { decode_times.add(time); }
+
+  // Records how long a stage of switching to an image took, in microseconds.
+  void add_switch_time(SwitchStage stage, gint64 time);
+
+  // Returns the number of times a switch stage was recorded, and the mean and
+  // a percentile of its times in milliseconds. Percentiles are interpolated
+  // within their histogram bucket, up to the slowest time.
+  guint64 get_switch_count(SwitchStage stage) const {
+    return switch_times[stage].count.load(std::memory_order_relaxed);
+  }
+  double get_switch_mean(SwitchStage stage) const {
+    return switch_times[stage].get_mean();
+  }
+  double get_switch_percentile(SwitchStage stage, double percentile) const {
+    return switch_times[stage].get_percentile(percentile);
+  }
+
+  // Records how long the last frame took to paint, in microseconds.
+  void set_frame_time(gint64 time) { frame_time = time; }
+
+  // Records how long the process took from starting to painting its first
+  // frame, and how long the table of image formats took to build, in
+  // microseconds.
+  void set_startup_time(gint64 time) { startup_time = time; }
+  void set_formats_time(gint64 time) { formats_time = time; }
+  gint64 get_formats_time() const { return formats_time; }
+
+  // Returns every statistic by name. Byte counts are in bytes, and times in
+  // milliseconds.
+  std::vector<std::pair<std::string, double>> get_values();
+
+  // Returns the statistics as lines of text for the overlay.
+  Glib::ustring format();
+
+ private:
+  // Times are counted in buckets by powers of two milliseconds: under 1 ms,
+  // under 2 ms, under 4 ms and so on, with the last bucket holding the rest.
+  static const int NUM_BUCKETS = 10;
+
+  // Histogram of times, which can be added to from any thread.
+  struct Histogram {
+    void add(gint64 time);
+
+    // In milliseconds.
+    double get_mean() const;
+    double get_percentile(double percentile) const;
+
+    std::atomic<guint64> buckets[NUM_BUCKETS] = {};
+    std::atomic<guint64> count{0};
+    std::atomic<guint64> total{0};  // In microseconds.
+    std::atomic<gint64> max{0};
+  };
+
+  // Minimum time between updates of the thumbnail rate, in microseconds.
+  static const gint64 RATE_INTERVAL;
+
+  static const char* const COUNTER_NAMES[NUM_COUNTERS];
+
+  Stats() {}
+
+  guint64 get(Counter counter) const {
+    return counters[counter].load(std::memory_order_relaxed);
+  }
+
+  // Returns the upper limit of a bucket, in milliseconds.
+  static int get_bucket_limit(int bucket) { return 1 << bucket; }
+
+  // Returns hits as a fraction of lookups, or 0 if there were none.
+  static double get_hit_rate(guint64 hits, guint64 misses);
+
+  // Updates `thumbnail_rate` if `RATE_INTERVAL` has passed.
+  void update_rate();
+
+  std::atomic<guint64> counters[NUM_COUNTERS] = {};
+  Histogram decode_times;
+  Histogram switch_times[NUM_SWITCH_STAGES];
+  gint64 switch_time = 0;  // The last whole switch.
+  gint64 frame_time = 0;
+  gint64 startup_time = 0;
+  std::atomic<gint64> formats_time{0};  // Set in a worker thread.
+
+  double thumbnail_rate = 0.0;  // Thumbnails loaded per second.
+  gint64 rate_time = 0;
+  guint64 rate_count = 0;
+};
+
+#endif  // LUMEE_STATS_H
@@ -0,0 +1,233 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "thumbnail_atlas.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <map>
+
+const int ThumbnailAtlas::BREADTH_STEP = 32;
+const int ThumbnailAtlas::STRIP_LENGTH = 32;
+const int ThumbnailAtlas::EXTENT_STEP = 4;
+
+// Slab that thumbnails of one kind are stacked in. A vertical strip is
+// `breadth` wide and stacks thumbnails from top to bottom; a horizontal one
+// is `breadth` tall and stacks them from left to right.
+struct ThumbnailAtlas::Strip {
+  Strip(int breadth, bool vertical, bool has_alpha)
+      : breadth(breadth), vertical(vertical), has_alpha(has_alpha),
+        slab(Gdk::Pixbuf::create(
+            Gdk::COLORSPACE_RGB, has_alpha, 8,
+            vertical ? breadth : breadth * STRIP_LENGTH,
+            vertical ? breadth * STRIP_LENGTH : breadth)) {}
+
+  const int breadth;
+  const bool vertical;
+  const bool has_alpha;
+  const Glib::RefPtr<Gdk::Pixbuf> slab;
+  std::map<int, int> free_extents;  // Lengths by offset.
+  int allocations = 0;
+  bool retired = false;  // No new thumbnails are put in it.
+};
+
+ThumbnailAtlas::ThumbnailAtlas() {}
+
+ThumbnailAtlas::~ThumbnailAtlas() {}
+
+// It's never destroyed, since thumbnails may still be finalized during exit.
+//
+// static
+ThumbnailAtlas& ThumbnailAtlas::get_default() {
+  static ThumbnailAtlas* atlas = new ThumbnailAtlas;
+  return *atlas;
+}
+
+// An opaque pixbuf is scaled directly into the atlas. One with an alpha
+// channel is scaled first, since it may turn out to be opaque.
+Glib::RefPtr<Gdk::Pixbuf> ThumbnailAtlas::scale(
+    const Glib::RefPtr<Gdk::Pixbuf>& pixbuf, int width, int height) {
+  Trace::Span span("ThumbnailAtlas::scale");
+  if (!pixbuf->get_has_alpha()) {
+    Glib::RefPtr<Gdk::Pixbuf> thumbnail = allocate(width, height, false);
+    pixbuf->scale(thumbnail, 0, 0, width, height, 0.0, 0.0,
+                  double(width) / pixbuf->get_width(),
+                  double(height) / pixbuf->get_height(),
+                  Gdk::INTERP_BILINEAR);
+    return thumbnail;
+  }
+  Glib::RefPtr<Gdk::Pixbuf> scaled = pixbuf->scale_simple(
+      width, height, Gdk::INTERP_BILINEAR);
+  Glib::RefPtr<Gdk::Pixbuf> thumbnail = allocate(width, height,
+                                                 !is_opaque(scaled));
+  scaled->copy_area(0, 0, width, height, thumbnail, 0, 0);
+  return thumbnail;
+}
+
+Glib::RefPtr<Gdk::Pixbuf> ThumbnailAtlas::allocate(int width, int height,
+                                                   bool has_alpha) {
+  bool vertical = width >= height;
+  int breadth = round_up(std::max(width, height), BREADTH_STEP);
+  int length = round_up(vertical ? height : width, EXTENT_STEP);
+  Glib::RefPtr<Gdk::Pixbuf> slab;
+  Allocation* allocation = nullptr;
+  {
+    Glib::Threads::Mutex::Lock lock(mutex);
+    int offset = 0;
+    Strip* strip = find_space(breadth, vertical, has_alpha, length, offset);
+    ++strip->allocations;
+    slab = strip->slab;
+    allocation = new Allocation{this, strip, offset, length};
+  }
+  Glib::RefPtr<Gdk::Pixbuf> pixbuf = Gdk::Pixbuf::create_subpixbuf(
+      slab, vertical ? 0 : allocation->offset,
+      vertical ? allocation->offset : 0, width, height);
+  g_object_weak_ref(G_OBJECT(pixbuf->gobj()), &ThumbnailAtlas::on_finalized,
+                    allocation);
+  g_object_set_qdata(G_OBJECT(pixbuf->gobj()), get_quark(), allocation);
+  return pixbuf;
+}
+
+Glib::RefPtr<Gdk::Pixbuf> ThumbnailAtlas::copy(
+    const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) {
+  int width = pixbuf->get_width(), height = pixbuf->get_height();
+  Glib::RefPtr<Gdk::Pixbuf> thumbnail = allocate(width, height,
+                                                 pixbuf->get_has_alpha());
+  pixbuf->copy_area(0, 0, width, height, thumbnail, 0, 0);
+  return thumbnail;
+}
+
+// The caller's reference keeps the allocation, and so the strip, alive.
+const void* ThumbnailAtlas::get_slab(
+    const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) const {
+  gpointer data = g_object_get_qdata(G_OBJECT(pixbuf->gobj()), get_quark());
+  return data ? static_cast<Allocation*>(data)->strip : nullptr;
+}
+
+void ThumbnailAtlas::retire(const void* slab) {
+  Glib::Threads::Mutex::Lock lock(mutex);
+  for (const auto& strip : strips) {
+    if (strip.get() == slab)
+      strip->retired = true;
+  }
+}
+
+std::size_t ThumbnailAtlas::get_size() const {
+  Glib::Threads::Mutex::Lock lock(mutex);
+  return size;
+}
+
+// static
+bool ThumbnailAtlas::is_opaque(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) {
+  if (!pixbuf->get_has_alpha())
+    return true;
+  const guint8* row = pixbuf->get_pixels();
+  int width = pixbuf->get_width(), channels = pixbuf->get_n_channels();
+  for (int y = 0; y < pixbuf->get_height(); ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (row[x * channels + 3] != 255)
+        return false;
+    }
+    row += pixbuf->get_rowstride();
+  }
+  return true;
+}
+
+// Recent strips are searched first, since they're the most likely to have
+// space, and retired strips are skipped. Within a strip, the first extent
+// that fits is used.
+ThumbnailAtlas::Strip* ThumbnailAtlas::find_space(int breadth, bool vertical,
+                                                  bool has_alpha, int length,
+                                                  int& offset) {
+  for (auto iter = strips.rbegin(); iter != strips.rend(); ++iter) {
+    Strip& strip = **iter;
+    if (strip.retired || strip.breadth != breadth ||
+        strip.vertical != vertical || strip.has_alpha != has_alpha)
+      continue;
+    for (auto extent = strip.free_extents.begin();
+         extent != strip.free_extents.end(); ++extent) {
+      if (extent->second < length)
+        continue;
+      offset = extent->first;
+      if (extent->second > length)
+        strip.free_extents[offset + length] = extent->second - length;
+      strip.free_extents.erase(extent);
+      return &strip;
+    }
+  }
+  strips.emplace_back(new Strip(breadth, vertical, has_alpha));
+  Strip& strip = *strips.back();
+  size += get_size(strip);
+  offset = 0;
+  strip.free_extents[length] = breadth * STRIP_LENGTH - length;
+  return &strip;
+}
+
+// static
+int ThumbnailAtlas::round_up(int value, int step) {
+  return (value + step - 1) / step * step;
+}
+
+// static
+std::size_t ThumbnailAtlas::get_size(const Strip& strip) {
+  return std::size_t(strip.slab->get_rowstride()) * strip.slab->get_height();
+}
+
+// static
+GQuark ThumbnailAtlas::get_quark() {
+  static GQuark quark = g_quark_from_static_string("lumee-atlas-allocation");
+  return quark;
+}
+
+// Freed space is merged with the free extents next to it.
+void ThumbnailAtlas::free(Allocation* allocation) {
+  Glib::Threads::Mutex::Lock lock(mutex);
+  Strip* strip = allocation->strip;
+  if (!--strip->allocations) {
+    size -= get_size(*strip);
+    auto found = std::find_if(strips.begin(), strips.end(),
+                              [strip](const std::unique_ptr<Strip>& s) {
+                                return s.get() == strip;
+                              });
+    strips.erase(found);
+  } else {
+    std::map<int, int>& extents = strip->free_extents;
+    int offset = allocation->offset, length = allocation->length;
+    auto next = extents.lower_bound(offset);
+    if (next != extents.end() && next->first == offset + length) {
+      length += next->second;
+      next = extents.erase(next);
+    }
+    if (next != extents.begin()) {
+      auto previous = std::prev(next);
+      if (previous->first + previous->second == offset) {
+        previous->second += length;
+        length = 0;
+      }
+    }
+    if (length)
+      extents[offset] = length;
+  }
+  delete allocation;
+}
+
+// The sub-pixbuf still holds its slab at this point, so the slab outlives
+// the strip if it's the last one.
+//
+// static
+void ThumbnailAtlas::on_finalized(gpointer data, GObject* /*object*/) {
+  Allocation* allocation = static_cast<Allocation*>(data);
+  allocation->atlas->free(allocation);
+}
@@ -0,0 +1,111 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_THUMBNAIL_ATLAS_H
+#define LUMEE_THUMBNAIL_ATLAS_H
+
+#include <gdkmm/pixbuf.h>
+#include <glibmm/threads.h>
+
+#include <memory>
+#include <vector>
+
+// Packs thumbnails into large shared pixbufs ("slabs"), so each thumbnail is
+// a sub-pixbuf instead of a separate allocation. Opaque thumbnails are stored
+// as RGB, without an alpha channel.
+//
+// A thumbnail always fills its box in at least one dimension, so slabs are
+// strips as wide (or tall) as the box, and thumbnails are stacked along their
+// length. Each strip only needs a list of free extents, and space freed by a
+// thumbnail can be reused by any thumbnail that fits in it.
+//
+// Thread-safe. A thumbnail's space is freed when its pixbuf is finalized.
+class ThumbnailAtlas {
+ public:
+  // Returns the atlas shared by the whole process.
+  static ThumbnailAtlas& get_default();
+
+  // Scales a pixbuf to `width` by `height` into the atlas.
+  Glib::RefPtr<Gdk::Pixbuf> scale(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                                  int width, int height);
+
+  // Returns a pixbuf in the atlas with undefined contents.
+  Glib::RefPtr<Gdk::Pixbuf> allocate(int width, int height, bool has_alpha);
+
+  // Copies a thumbnail to new space in the atlas.
+  Glib::RefPtr<Gdk::Pixbuf> copy(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf);
+
+  // Returns the slab a thumbnail is in, as a key for grouping thumbnails, or
+  // null if it isn't in the atlas.
+  const void* get_slab(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) const;
+
+  // Stops new thumbnails from being put in a slab, so it's freed once the
+  // thumbnails already in it are. Thumbnails that should stay can be moved
+  // out with `copy()`.
+  void retire(const void* slab);
+
+  // Returns the number of bytes in slabs.
+  std::size_t get_size() const;
+
+  // Returns true if a pixbuf has no alpha channel, or is fully opaque.
+  static bool is_opaque(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf);
+
+ private:
+  struct Strip;
+
+  // Space taken by one thumbnail. Passed to the pixbuf's weak reference.
+  struct Allocation {
+    ThumbnailAtlas* atlas;
+    Strip* strip;
+    int offset;
+    int length;
+  };
+
+  // Strip breadths are rounded up to a multiple of this, so thumbnails of
+  // slightly different sizes share strips.
+  static const int BREADTH_STEP;
+
+  // Length of a strip, in multiples of its breadth.
+  static const int STRIP_LENGTH;
+
+  // Extents are rounded up to a multiple of this, so freed space is less
+  // likely to be left in slivers.
+  static const int EXTENT_STEP;
+
+  ThumbnailAtlas();
+  ~ThumbnailAtlas();
+
+  // Finds space in a strip of the given kind, creating one if needed. The
+  // mutex must be held.
+  Strip* find_space(int breadth, bool vertical, bool has_alpha, int length,
+                    int& offset);
+
+  static int round_up(int value, int step);
+  static std::size_t get_size(const Strip& strip);
+
+  // Key of the `Allocation` attached to each thumbnail.
+  static GQuark get_quark();
+
+  // Returns an allocation's space to its strip, and frees the strip if it's
+  // empty.
+  void free(Allocation* allocation);
+  static void on_finalized(gpointer data, GObject* object);
+
+  mutable Glib::Threads::Mutex mutex;
+  std::vector<std::unique_ptr<Strip>> strips;
+  std::size_t size = 0;  // Bytes in `strips`.
+};
+
+#endif  // LUMEE_THUMBNAIL_ATLAS_H
@@ -0,0 +1,138 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "thumbnail_cache.h"
+#include "thumbnail_atlas.h"
+#include "trace.h"
+#include "utils.h"
+#include "work_queue.h"
+
+#include <glib/gstdio.h>
+#include <glibmm/checksum.h>
+#include <glibmm/fileutils.h>
+#include <glibmm/miscutils.h>
+
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+
+const std::vector<int> ThumbnailCache::SIZES = {96, 192, 384};
+const std::size_t ThumbnailCache::MAX_CACHE_SIZE = std::size_t(512) << 20;
+const char* const ThumbnailCache::JPEG_QUALITY = "90";
+
+// Removes old thumbnails when run by the work queue.
+struct ThumbnailCache::CleanupItem : public WorkQueue::Item {
+  virtual void run() {
+    remove_old_thumbnails();
+    delete this;
+  }
+  virtual void discard() { delete this; }
+};
+
+// static
+int ThumbnailCache::get_level(int size) {
+  int level = 0;
+  while (level < int(SIZES.size()) - 1 && SIZES[level] < size)
+    ++level;
+  return level;
+}
+
+// static
+std::string ThumbnailCache::get_filename(const std::string& path,
+                                         guint64 time_modified, int level) {
+  return Glib::build_filename(get_dir(level), Glib::Checksum::compute_checksum(
+      Glib::Checksum::CHECKSUM_SHA1,
+      path + "\n" + std::to_string(time_modified)));
+}
+
+// Each level is scaled from the one above it, so the image itself is only
+// scaled once. Files are written to a uniquely named temporary file and then
+// renamed, so a partially written thumbnail is never read, even when the same
+// image is saved from two threads at once.
+//
+// static
+std::vector<Glib::RefPtr<Gdk::Pixbuf>> ThumbnailCache::save(
+    const std::string& path, guint64 time_modified,
+    const Glib::RefPtr<Gdk::Pixbuf>& image) {
+  Trace::Span span("ThumbnailCache::save");
+  std::vector<Glib::RefPtr<Gdk::Pixbuf>> thumbnails(SIZES.size());
+  Glib::RefPtr<Gdk::Pixbuf> thumbnail = image;
+  for (int level = SIZES.size() - 1; level >= 0; --level) {
+    double factor = Dimensions(thumbnail).fit(SIZES[level]);
+    if (factor < 1.0)
+      thumbnail = thumbnail->scale_simple(
+          std::max(1.0, std::round(thumbnail->get_width() * factor)),
+          std::max(1.0, std::round(thumbnail->get_height() * factor)),
+          Gdk::INTERP_BILINEAR);
+    thumbnails[level] = thumbnail;
+
+    g_mkdir_with_parents(get_dir(level).c_str(), 0700);
+    gchar* buffer = nullptr;
+    gsize size = 0;
+    try {
+      if (ThumbnailAtlas::is_opaque(thumbnail))
+        thumbnail->save_to_buffer(buffer, size, "jpeg", {"quality"},
+                                  {JPEG_QUALITY});
+      else
+        thumbnail->save_to_buffer(buffer, size, "png");
+      Glib::file_set_contents(get_filename(path, time_modified, level),
+                              buffer, size);
+    } catch (const Glib::Error&) {}
+    g_free(buffer);
+  }
+  return thumbnails;
+}
+
+// static
+void ThumbnailCache::remove_old_thumbnails_async() {
+  WorkQueue::get_default().push(new CleanupItem,
+                                WorkQueue::PRIORITY_BACKGROUND);
+}
+
+// static
+std::string ThumbnailCache::get_dir(int level) {
+  return Glib::build_filename(Glib::get_user_cache_dir(), "lumee",
+                              "thumbnails", std::to_string(SIZES[level]));
+}
+
+// static
+void ThumbnailCache::remove_old_thumbnails() {
+  std::vector<std::tuple<time_t, std::size_t, std::string>> files;
+  std::size_t total_size = 0;
+  for (int level = 0; level < int(SIZES.size()); ++level) {
+    std::string dir_name = get_dir(level);
+    try {
+      Glib::Dir dir(dir_name);
+      for (const std::string& name : dir) {
+        std::string filename = Glib::build_filename(dir_name, name);
+        GStatBuf stat_buf;
+        if (g_stat(filename.c_str(), &stat_buf) == 0) {
+          files.emplace_back(stat_buf.st_mtime, stat_buf.st_size, filename);
+          total_size += stat_buf.st_size;
+        }
+      }
+    } catch (const Glib::FileError&) {}
+  }
+  if (total_size <= MAX_CACHE_SIZE)
+    return;
+
+  std::sort(files.begin(), files.end());
+  for (const auto& file : files) {
+    if (total_size <= MAX_CACHE_SIZE)
+      break;
+    if (g_remove(std::get<2>(file).c_str()) == 0)
+      total_size -= std::get<1>(file);
+  }
+}
@@ -0,0 +1,68 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_THUMBNAIL_CACHE_H
+#define LUMEE_THUMBNAIL_CACHE_H
+
+#include <gdkmm/pixbuf.h>
+
+#include <string>
+#include <vector>
+
+// Thumbnails saved in the user's cache folder at a few fixed sizes
+// ("levels"). When an image is decoded for a thumbnail, every level is saved,
+// each scaled down from the one above it. Thumbnails of any size can then be
+// loaded from the smallest level that's big enough, without reading the image
+// again.
+class ThumbnailCache {
+ public:
+  // Maximum width and height of each level, smallest first.
+  static const std::vector<int> SIZES;
+
+  // Returns the smallest level that's at least `size`, or the largest level.
+  static int get_level(int size);
+
+  // Returns the file name of an image's thumbnail at a level. The name
+  // includes the modification time, so a modified image misses the cache.
+  static std::string get_filename(const std::string& path,
+                                  guint64 time_modified, int level);
+
+  // Scales an image to every level and saves them. Returns the thumbnails,
+  // indexed by level. Errors are ignored, since it's only a cache.
+  static std::vector<Glib::RefPtr<Gdk::Pixbuf>> save(
+      const std::string& path, guint64 time_modified,
+      const Glib::RefPtr<Gdk::Pixbuf>& image);
+
+  // Removes the least recently saved thumbnails in a background thread once
+  // the cache is bigger than `MAX_CACHE_SIZE`.
+  static void remove_old_thumbnails_async();
+
+ private:
+  struct CleanupItem;
+
+  // Maximum total size of the cache, in bytes.
+  static const std::size_t MAX_CACHE_SIZE;
+
+  // JPEG quality of opaque thumbnails. Thumbnails with transparency are saved
+  // as PNG.
+  static const char* const JPEG_QUALITY;
+
+  // Returns the folder holding a level.
+  static std::string get_dir(int level);
+
+  static void remove_old_thumbnails();
+};
+
+#endif  // LUMEE_THUMBNAIL_CACHE_H
@@ -0,0 +1,109 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "trace.h"
+
+#include <algorithm>
+#include <fstream>
+
+const std::size_t Trace::BUFFER_SIZE = 65536;
+
+std::atomic<bool> Trace::enabled{false};
+std::string Trace::filename;
+Glib::Threads::Mutex Trace::buffers_mutex;
+std::vector<std::unique_ptr<Trace::Buffer>> Trace::buffers;
+thread_local Trace::Buffer* Trace::current_buffer = nullptr;
+
+// The thread that starts the trace gets the first buffer, so it's shown as
+// thread 1.
+//
+// static
+void Trace::start(const std::string& filename) {
+  Trace::filename = filename;
+  get_buffer();
+  enabled.store(true, std::memory_order_relaxed);
+}
+
+// A thread sets its buffer's `recording` flag before checking `enabled`
+// again, and this clears `enabled` before checking the flags, so once no
+// buffer is recording, none will start.
+//
+// static
+void Trace::stop() {
+  if (!enabled.exchange(false))
+    return;
+  {
+    Glib::Threads::Mutex::Lock lock(buffers_mutex);
+    for (const std::unique_ptr<Buffer>& buffer : buffers) {
+      while (buffer->recording.load())
+        g_thread_yield();
+    }
+  }
+  write(filename);
+}
+
+// static
+void Trace::add_span(const char* name, gint64 start_time, gint64 end_time) {
+  if (!is_enabled())
+    return;
+  Buffer& buffer = get_buffer();
+  buffer.recording.store(true);
+  if (enabled.load()) {
+    std::size_t count = buffer.count.load(std::memory_order_relaxed);
+    buffer.events[count % BUFFER_SIZE] = {name, start_time, end_time};
+    buffer.count.store(count + 1, std::memory_order_release);
+  }
+  buffer.recording.store(false, std::memory_order_release);
+}
+
+// static
+Trace::Buffer& Trace::get_buffer() {
+  if (!current_buffer) {
+    std::unique_ptr<Buffer> buffer(new Buffer());
+    buffer->events.resize(BUFFER_SIZE);
+    current_buffer = buffer.get();
+    Glib::Threads::Mutex::Lock lock(buffers_mutex);
+    buffer->thread_id = buffers.size() + 1;
+    buffers.push_back(std::move(buffer));
+  }
+  return *current_buffer;
+}
+
+// Spans are written as complete ("X") events, with times in microseconds.
+// Names are string literals, so they don't need escaping.
+//
+// static
+void Trace::write(const std::string& filename) {
+  std::ofstream file(filename, std::ios::trunc);
+  file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  file << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+          "\"args\": {\"name\": \"" PACKAGE_NAME "\"}}";
+  Glib::Threads::Mutex::Lock lock(buffers_mutex);
+  for (const std::unique_ptr<Buffer>& buffer : buffers) {
+    file << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+         << "\"tid\": " << buffer->thread_id << ", \"args\": {\"name\": \""
+         << (buffer->thread_id == 1 ? "main" : "worker") << "\"}}";
+    std::size_t count = buffer->count.load(std::memory_order_acquire);
+    for (std::size_t i = count - std::min(count, BUFFER_SIZE); i < count;
+         ++i) {
+      const Event& event = buffer->events[i % BUFFER_SIZE];
+      file << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", "
+           << "\"pid\": 1, \"tid\": " << buffer->thread_id << ", \"ts\": "
+           << event.start_time << ", \"dur\": "
+           << event.end_time - event.start_time << "}";
+    }
+  }
+  file << "\n]}" << std::endl;
+}
@@ -0,0 +1,102 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_TRACE_H
+#define LUMEE_TRACE_H
+
+#include <glibmm/threads.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Records timed spans of work, and writes them as a Chrome trace (JSON) that
+// can be opened in Perfetto or `chrome://tracing`.
+//
+// Each thread records into its own ring buffer, so recording doesn't take a
+// lock, and only the most recent events of each thread are kept. When tracing
+// is off, a span costs one relaxed load.
+class Trace {
+ public:
+  // Times the rest of the scope. `name` must be a string literal.
+  //
+  //     Trace::Span span("ImageWorker::decode");
+  class Span {
+   public:
+    explicit Span(const char* name)
+        : name(name), start_time(is_enabled() ? g_get_monotonic_time() : 0) {}
+    ~Span() {
+      if (start_time)
+        add_span(name, start_time, g_get_monotonic_time());
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+   private:
+    const char* name;
+    gint64 start_time;
+  };
+
+  // Starts recording. The trace is written to `filename` by `stop()`.
+  static void start(const std::string& filename);
+
+  // Stops recording and writes the trace, if it was started. Spans that end
+  // afterward aren't recorded, and ones being recorded in other threads are
+  // waited for.
+  static void stop();
+
+  static bool is_enabled() { return enabled.load(std::memory_order_relaxed); }
+
+  // Records a span in the calling thread that has already ended, such as one
+  // that started in another callback. Times are from `g_get_monotonic_time()`.
+  static void add_span(const char* name, gint64 start_time, gint64 end_time);
+
+ private:
+  struct Event {
+    const char* name;
+    gint64 start_time;
+    gint64 end_time;
+  };
+
+  // Events recorded by one thread. Only that thread writes to it.
+  struct Buffer {
+    int thread_id = 0;
+    std::vector<Event> events;
+    std::atomic<std::size_t> count{0};  // Events ever recorded.
+    std::atomic<bool> recording{false};  // An event is being written.
+  };
+
+  // Number of events kept per thread.
+  static const std::size_t BUFFER_SIZE;
+
+  // Returns the calling thread's buffer, creating it if needed.
+  static Buffer& get_buffer();
+
+  static void write(const std::string& filename);
+
+  static std::atomic<bool> enabled;
+  static std::string filename;
+
+  // Every thread's buffer. Buffers outlive their threads, so events aren't
+  // lost when a thread exits.
+  static Glib::Threads::Mutex buffers_mutex;
+  static std::vector<std::unique_ptr<Buffer>> buffers;
+
+  static thread_local Buffer* current_buffer;
+};
+
+#endif  // LUMEE_TRACE_H
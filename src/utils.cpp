@@ -17,8 +17,15 @@
 
 #include <glibmm/miscutils.h>
 
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <time.h>
+#include <unistd.h>
+
 bool RuntimeInfo::installed = true;
 std::string RuntimeInfo::data_dir = PKGDATADIR;
+gint64 RuntimeInfo::start_time = 0;
 
 // Checks the location of the current executable, in order to support being run
 // from the source tree. Doing this isn't portable and may need changes for
@@ -26,6 +33,7 @@ std::string RuntimeInfo::data_dir = PKGDATADIR;
 //
 // static
 void RuntimeInfo::init() {
+  start_time = g_get_monotonic_time() - get_process_age();
   char exe_file[PATH_MAX];
   ssize_t size = readlink("/proc/self/exe", exe_file, PATH_MAX);
   if (size != -1) {
@@ -37,6 +45,32 @@ void RuntimeInfo::init() {
   }
 }
 
+// The kernel's start time counts the time before `main()` too, such as loading
+// shared libraries. It's in clock ticks since boot, usually 10 ms each.
+//
+// static
+gint64 RuntimeInfo::get_process_age() {
+  std::ifstream stat_file("/proc/self/stat");
+  std::string stat;
+  std::getline(stat_file, stat);
+  // The command name is in parentheses, and may contain spaces. The start
+  // time is the 20th field after it.
+  std::size_t name_end = stat.rfind(')');
+  if (name_end == std::string::npos)
+    return 0;
+  std::istringstream fields(stat.substr(name_end + 1));
+  std::string field;
+  for (int i = 0; i < 19; ++i)
+    fields >> field;
+  unsigned long long start_ticks = 0;
+  struct timespec now;
+  if (!(fields >> start_ticks) || clock_gettime(CLOCK_BOOTTIME, &now) != 0)
+    return 0;
+  gint64 age = now.tv_sec * G_GINT64_CONSTANT(1000000) + now.tv_nsec / 1000 -
+               gint64(start_ticks) * 1000000 / sysconf(_SC_CLK_TCK);
+  return std::max(age, gint64(0));
+}
+
 // When `scrollbar_width` is nonzero, only width is constrained. Otherwise,
 // both width and height are constrained.
 double Dimensions::fit(Dimensions target, bool expand, int scrollbar_width)
@@ -28,9 +28,18 @@ class RuntimeInfo {
   static bool is_installed() { return installed; }
   static std::string get_data_dir() { return data_dir; }
 
+  // Returns when the process started, in the time of
+  // `g_get_monotonic_time()`, or 0 before `init()`.
+  static gint64 get_start_time() { return start_time; }
+
  private:
+  // Returns how long ago the process started, in microseconds, or 0 if it
+  // can't be found.
+  static gint64 get_process_age();
+
   static bool installed;
   static std::string data_dir;
+  static gint64 start_time;
 };
 
 // Represents two dimensions. It can be used to fit one area into another; see
@@ -15,53 +15,270 @@
 
 #include "work_queue.h"
 
+#include <algorithm>
+
+const int WorkQueue::INJECT_BATCH = 32;
+
+thread_local WorkQueue::Worker* WorkQueue::current_worker = nullptr;
+
+// Thread in the pool.
+struct WorkQueue::Worker {
+  Worker(WorkQueue* queue, guint32 seed) : queue(queue), random_state(seed) {}
+
+  // Returns a pseudo-random number (xorshift), used to pick a thread to steal
+  // from.
+  guint32 random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+  }
+
+  WorkQueue* queue;
+  WorkStealingDeque<Item> deques[NUM_PRIORITIES];
+  Glib::Threads::Thread* thread = nullptr;
+  guint32 random_state;
+};
+
+// With one thread, low-priority items can only be preempted between items.
+WorkQueue::WorkQueue(int num_threads)
+    : num_threads(num_threads > 0 ? num_threads
+                                  : int(g_get_num_processors())),
+      max_low_priority(std::max(this->num_threads - 1, 1)) {
+  for (int i = 0; i < this->num_threads; ++i)
+    workers.emplace_back(new Worker(this, i + 1));
+}
+
 WorkQueue::~WorkQueue() {
   stop();
 }
 
-void WorkQueue::push(const sigc::slot<void>& slot) {
-  if (!thread)
-    thread = Glib::Threads::Thread::create(sigc::mem_fun(*this,
-                                                         &WorkQueue::run));
-  {
-    Glib::Threads::Mutex::Lock lock(mutex);
-    slots.push_back(slot);
-  }
-  cond.signal();
+// static
+WorkQueue& WorkQueue::get_default() {
+  static WorkQueue queue(0);
+  return queue;
 }
 
-void WorkQueue::clear() {
-  Glib::Threads::Mutex::Lock lock(mutex);
-  slots.clear();
+void WorkQueue::push(Item* item, Priority priority) {
+  if (!started.load(std::memory_order_acquire))
+    start();
+  item->priority = priority;
+  if (priority == PRIORITY_INTERACTIVE)
+    interactive_pending.fetch_add(1, std::memory_order_relaxed);
+  if (current_worker && current_worker->queue == this)
+    current_worker->deques[priority].push(item);
+  else
+    inject(injectors[priority], item);
+  event_count.notify_one();
 }
 
+// The threads have exited when the leftover items are discarded, so this
+// thread can act as the owner of their deques and the injection queues'
+// consumer.
 void WorkQueue::stop() {
-  if (thread) {
-    {
-      Glib::Threads::Mutex::Lock lock(mutex);
-      if (stopping)
-        return;
-      stopping = true;
+  {
+    Glib::Threads::Mutex::Lock lock(start_mutex);
+    if (stopping.exchange(true))
+      return;
+  }
+  event_count.notify_all();
+  for (std::unique_ptr<Worker>& worker : workers) {
+    if (worker->thread)
+      worker->thread->join();
+  }
+  for (int p = 0; p < NUM_PRIORITIES; ++p) {
+    for (std::unique_ptr<Worker>& worker : workers) {
+      while (Item* item = worker->deques[p].take())
+        item->discard();
     }
-    cond.broadcast();
-    thread->join();
+    while (Item* item = pop_injected(injectors[p]))
+      item->discard();
+  }
+}
+
+std::vector<int> WorkQueue::get_queue_depths() const {
+  std::vector<int> depths;
+  for (const std::unique_ptr<Worker>& worker : workers) {
+    std::int64_t depth = 0;
+    for (int p = 0; p < NUM_PRIORITIES; ++p)
+      depth += worker->deques[p].size();
+    depths.push_back(depth);
   }
+  return depths;
+}
+
+int WorkQueue::get_injected_depth() const {
+  int depth = 0;
+  for (const Injector& injector : injectors)
+    depth += injector.size.load(std::memory_order_relaxed);
+  return depth;
 }
 
-void WorkQueue::run() {
-  while (true) {
-    sigc::slot<void> slot;
-    {
-      Glib::Threads::Mutex::Lock lock(mutex);
-      while (!stopping && slots.empty())
-        cond.wait(mutex);
-      if (stopping)
-        break;
+void WorkQueue::start() {
+  Glib::Threads::Mutex::Lock lock(start_mutex);
+  if (started.load(std::memory_order_relaxed) || stopping)
+    return;
+  for (std::unique_ptr<Worker>& worker : workers) {
+    Worker* w = worker.get();
+    w->thread = Glib::Threads::Thread::create([this, w]() { run(*w); });
+  }
+  started.store(true, std::memory_order_release);
+}
 
-      slot = slots.front();
-      slots.pop_front();
-      slot_popped();
+// Before sleeping, the thread registers as a waiter and then checks for work
+// again, so an item pushed in between isn't missed.
+void WorkQueue::run(Worker& worker) {
+  current_worker = &worker;
+  while (!stopping.load(std::memory_order_relaxed)) {
+    if (Item* item = find_item(worker)) {
+      finish(item);
+      continue;
     }
-    slot();
+    EventCount::Key key = event_count.prepare_wait();
+    if (stopping.load(std::memory_order_seq_cst) || has_work())
+      event_count.cancel_wait();
+    else
+      event_count.wait(key);
+  }
+  current_worker = nullptr;
+}
+
+// A slot for a low-priority item is reserved before searching, so the limit
+// can't be exceeded by threads searching at the same time.
+WorkQueue::Item* WorkQueue::find_item(Worker& worker) {
+  for (int p = 0; p < PRIORITY_VISIBLE; ++p) {
+    if (Item* item = find_item(worker, Priority(p)))
+      return item;
+  }
+  if (low_priority_running.fetch_add(1, std::memory_order_acq_rel) >=
+      max_low_priority) {
+    low_priority_running.fetch_sub(1, std::memory_order_acq_rel);
+    return nullptr;
+  }
+  Item* item = find_item(worker, PRIORITY_VISIBLE);
+  if (!item && !interactive_pending.load(std::memory_order_acquire))
+    item = find_item(worker, PRIORITY_BACKGROUND);
+  if (!item)
+    low_priority_running.fetch_sub(1, std::memory_order_acq_rel);
+  return item;
+}
+
+WorkQueue::Item* WorkQueue::find_item(Worker& worker, Priority priority) {
+  if (Item* item = worker.deques[priority].take())
+    return item;
+  if (Item* item = take_injected(worker, priority))
+    return item;
+  std::size_t first = worker.random() % workers.size();
+  for (std::size_t i = 0; i < workers.size(); ++i) {
+    Worker& victim = *workers[(first + i) % workers.size()];
+    if (&victim == &worker)
+      continue;
+    if (Item* item = victim.deques[priority].steal())
+      return item;
+  }
+  return nullptr;
+}
+
+bool WorkQueue::has_work() const {
+  if (has_work(PRIORITY_INTERACTIVE) || has_work(PRIORITY_PREFETCH))
+    return true;
+  if (low_priority_running.load(std::memory_order_seq_cst) >=
+      max_low_priority)
+    return false;
+  return has_work(PRIORITY_VISIBLE) ||
+         (!interactive_pending.load(std::memory_order_seq_cst) &&
+          has_work(PRIORITY_BACKGROUND));
+}
+
+// An injection queue only holds its stub when it's empty.
+bool WorkQueue::has_work(Priority priority) const {
+  const Injector& injector = injectors[priority];
+  if (injector.head.load(std::memory_order_seq_cst) != &injector.stub)
+    return true;
+  for (const std::unique_ptr<Worker>& worker : workers) {
+    if (!worker->deques[priority].empty())
+      return true;
+  }
+  return false;
+}
+
+// The item may be reused as soon as it has run, so its priority is read
+// first. Once the last interactive item finishes, background items can start
+// again, so every sleeping thread is woken.
+void WorkQueue::finish(Item* item) {
+  Priority priority = item->priority;
+  gint64 start_time = g_get_monotonic_time();
+  item->run();
+  busy_time.fetch_add(g_get_monotonic_time() - start_time,
+                      std::memory_order_relaxed);
+  if (priority >= PRIORITY_VISIBLE)
+    low_priority_running.fetch_sub(1, std::memory_order_acq_rel);
+  else if (priority == PRIORITY_INTERACTIVE &&
+           interactive_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    event_count.notify_all();
+}
+
+// static
+void WorkQueue::inject(Injector& injector, Item* item) {
+  if (item != &injector.stub)
+    injector.size.fetch_add(1, std::memory_order_relaxed);
+  item->next.store(nullptr, std::memory_order_relaxed);
+  Item* previous = injector.head.exchange(item, std::memory_order_acq_rel);
+  previous->next.store(item, std::memory_order_release);
+}
+
+// The batch is pushed newest first, so the thread takes the oldest item next
+// and other threads steal the newest.
+WorkQueue::Item* WorkQueue::take_injected(Worker& worker, Priority priority) {
+  Injector& injector = injectors[priority];
+  if (injector.lock.test_and_set(std::memory_order_acquire))
+    return nullptr;
+  Item* item = pop_injected(injector);
+  Item* batch[INJECT_BATCH];
+  int count = 0;
+  // Interactive items are few, and each one should start as soon as possible
+  // on a thread of its own.
+  if (item && priority != PRIORITY_INTERACTIVE) {
+    while (count < INJECT_BATCH && (batch[count] = pop_injected(injector)))
+      ++count;
+  }
+  injector.lock.clear(std::memory_order_release);
+
+  for (int i = count - 1; i >= 0; --i)
+    worker.deques[priority].push(batch[i]);
+  // Wake another thread to steal from the batch, or to take the rest of the
+  // injection queue.
+  if (count)
+    event_count.notify_one();
+  return item;
+}
+
+// If a producer has swapped `head` but hasn't linked its item yet, the queue
+// looks empty. The producer notifies a thread once the item is linked.
+//
+// static
+WorkQueue::Item* WorkQueue::pop_injected(Injector& injector) {
+  Item* tail = injector.tail;
+  Item* next = tail->next.load(std::memory_order_acquire);
+  if (tail == &injector.stub) {
+    if (!next)
+      return nullptr;
+    injector.tail = tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+  if (next) {
+    injector.tail = next;
+    injector.size.fetch_sub(1, std::memory_order_relaxed);
+    return tail;
+  }
+  if (tail != injector.head.load(std::memory_order_acquire))
+    return nullptr;
+  inject(injector, &injector.stub);
+  next = tail->next.load(std::memory_order_acquire);
+  if (next) {
+    injector.tail = next;
+    injector.size.fetch_sub(1, std::memory_order_relaxed);
+    return tail;
   }
+  return nullptr;
 }
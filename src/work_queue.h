@@ -16,38 +16,171 @@
 #ifndef LUMEE_WORK_QUEUE_H
 #define LUMEE_WORK_QUEUE_H
 
+#include "event_count.h"
+#include "work_stealing_deque.h"
+
 #include <glibmm/threads.h>
 
-#include <deque>
+#include <atomic>
+#include <memory>
+#include <vector>
 
-// Executes work in a thread.
+// Executes work in a pool of threads, in order of priority.
+//
+// Each thread has a deque of items per priority. Items pushed from outside the
+// pool go into lock-free injection queues, and threads move them to their
+// deques in batches. A thread with nothing to do steals from the other
+// threads' deques, and sleeps on an event count when there's no work anywhere.
+// None of this takes a lock unless a thread is sleeping.
+//
+// Threads pick the most urgent item whenever they finish one, so lower
+// priorities are preempted between items. Low-priority items never occupy
+// every thread, and background items wait while interactive items are queued
+// or running.
 class WorkQueue {
  public:
+  // From most to least urgent.
+  enum Priority {
+    PRIORITY_INTERACTIVE,  // The user is waiting for it, such as an image.
+    PRIORITY_PREFETCH,     // Likely to be needed next.
+    PRIORITY_VISIBLE,      // On screen, such as visible thumbnails.
+    PRIORITY_BACKGROUND,   // Everything else.
+    NUM_PRIORITIES
+  };
+
+  // Unit of work. Items are linked into the queue intrusively, so pushing and
+  // popping doesn't allocate. The queue doesn't own its items.
+  class Item {
+   public:
+    virtual ~Item() {}
+
+    // Does the work. Called in one of the queue's threads.
+    virtual void run() = 0;
+
+    // Called instead of `run()` when the item is still queued when `stop()` is
+    // called.
+    virtual void discard() = 0;
+
+   private:
+    friend class WorkQueue;
+    std::atomic<Item*> next{nullptr};  // Link in an injection queue.
+    Priority priority = PRIORITY_BACKGROUND;
+  };
+
+  // `num_threads` is the number of threads in the pool. If it's 0, there is
+  // one per processor.
+  explicit WorkQueue(int num_threads = 1);
   ~WorkQueue();
 
-  // Adds a slot to the end of the queue. If this is the first time `push()` is
-  // called for this instance, starts a thread first.
-  void push(const sigc::slot<void>& slot);
+  // Returns the queue shared by the whole process. It has one thread per
+  // processor.
+  static WorkQueue& get_default();
 
-  // Removes all slots from the queue.
-  void clear();
+  // Adds an item to the queue. If this is the first time `push()` is called
+  // for this instance, starts the threads first. Items of the same priority
+  // are started roughly in the order they were pushed, but may finish in any
+  // order.
+  //
+  // Items pushed from the queue's own threads go into the thread's deque.
+  void push(Item* item, Priority priority);
 
-  // Stops processing the queue and waits for the thread to exit.
+  // Stops processing the queue and waits for the threads to exit. Items that
+  // are still queued are discarded.
   void stop();
 
-  // Function to call in the critical section after a work slot is popped from
-  // the queue, before the work slot is called.
-  sigc::slot<void> slot_popped;
+  int get_num_threads() const { return num_threads; }
+
+  // Returns the number of items in each thread's deques, and the number in
+  // the injection queues that no thread has taken yet. The counts may be out
+  // of date.
+  std::vector<int> get_queue_depths() const;
+  int get_injected_depth() const;
+
+  // Returns the total time the threads have spent running items, in
+  // microseconds.
+  gint64 get_busy_time() const {
+    return busy_time.load(std::memory_order_relaxed);
+  }
 
  private:
-  // Runs a loop in a thread waiting for slots.
-  void run();
-
-  Glib::Threads::Thread* thread = nullptr;
-  Glib::Threads::Mutex mutex;
-  Glib::Threads::Cond cond;
-  std::deque<sigc::slot<void>> slots;
-  bool stopping = false;
+  struct Worker;
+
+  // Placeholder that keeps an injection queue from being empty; it's never
+  // run.
+  class Stub : public Item {
+   public:
+    virtual void run() {}
+    virtual void discard() {}
+  };
+
+  // Injection queue (Vyukov's intrusive queue). Producers swap `head`, and the
+  // thread holding `lock` pops from `tail`.
+  struct Injector {
+    Stub stub;
+    std::atomic<Item*> head{&stub};
+    Item* tail = &stub;
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+    std::atomic<int> size{0};  // Items other than the stub.
+  };
+
+  // Maximum number of items moved from an injection queue to a thread's deque
+  // at once.
+  static const int INJECT_BATCH;
+
+  // Starts the threads, if they haven't been started.
+  void start();
+
+  // Runs a loop in a thread waiting for items.
+  void run(Worker& worker);
+
+  // Gets the most urgent item that may start now. Returns null if none was
+  // found.
+  Item* find_item(Worker& worker);
+
+  // Gets an item of one priority for a thread: from its own deque, then from
+  // the injection queue, and then by stealing.
+  Item* find_item(Worker& worker, Priority priority);
+
+  // Returns true if there may be items that may start now.
+  bool has_work() const;
+  bool has_work(Priority priority) const;
+
+  // Runs an item and updates the counts used for throttling and the busy
+  // time.
+  void finish(Item* item);
+
+  // Adds an item to an injection queue. Any thread may call this.
+  static void inject(Injector& injector, Item* item);
+
+  // Takes an item from an injection queue and moves up to `INJECT_BATCH` more
+  // to the thread's deque. Returns null if the queue is empty or another
+  // thread is taking items from it.
+  Item* take_injected(Worker& worker, Priority priority);
+
+  // Removes the oldest item from an injection queue. Only one thread at a time
+  // may call this.
+  static Item* pop_injected(Injector& injector);
+
+  const int num_threads;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::atomic<bool> started{false};
+  std::atomic<bool> stopping{false};
+  Glib::Threads::Mutex start_mutex;
+  EventCount event_count;
+  Injector injectors[NUM_PRIORITIES];
+
+  // Number of threads that may run visible and background items at once, and
+  // the number that are.
+  const int max_low_priority;
+  std::atomic<int> low_priority_running{0};
+
+  // Number of interactive items queued or running.
+  std::atomic<int> interactive_pending{0};
+
+  std::atomic<gint64> busy_time{0};
+
+  // The pool thread that is running, if any.
+  static thread_local Worker* current_worker;
 };
 
 #endif  // LUMEE_WORK_QUEUE_H
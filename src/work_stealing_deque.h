@@ -0,0 +1,141 @@
+// Copyright (C) 2014 Brian Marshall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LUMEE_WORK_STEALING_DEQUE_H
+#define LUMEE_WORK_STEALING_DEQUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Lock-free double-ended queue of pointers (Chase and Lev, as formulated for
+// C11 atomics by Lê et al.). The owner thread pushes and takes at the bottom,
+// and any other thread can steal from the top.
+template <typename T>
+class WorkStealingDeque {
+ public:
+  WorkStealingDeque() {
+    arrays.emplace_back(new Array(INITIAL_CAPACITY));
+    array.store(arrays.back().get(), std::memory_order_relaxed);
+  }
+  WorkStealingDeque(const WorkStealingDeque&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+  // Adds an element at the bottom. Only the owner may call this.
+  void push(T* element) {
+    std::int64_t b = bottom.load(std::memory_order_relaxed);
+    std::int64_t t = top.load(std::memory_order_acquire);
+    Array* a = array.load(std::memory_order_relaxed);
+    if (b - t > a->capacity - 1)
+      a = grow(a, b, t);
+    a->put(b, element);
+    bottom.store(b + 1, std::memory_order_release);
+  }
+
+  // Removes the bottom element, or returns null if the deque is empty. Only
+  // the owner may call this.
+  T* take() {
+    std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array* a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {  // Empty.
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    T* element = a->get(b);
+    if (t == b) {  // Last element; race with thieves.
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed))
+        element = nullptr;
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return element;
+  }
+
+  // Removes the top element. Returns null if the deque is empty or another
+  // thread won the race for the element. Any thread may call this.
+  T* steal() {
+    std::int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b)
+      return nullptr;
+    T* element = array.load(std::memory_order_acquire)->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed))
+      return nullptr;
+    return element;
+  }
+
+  // Returns true if the deque looks empty. The result may be out of date
+  // when it's returned.
+  bool empty() const {
+    return bottom.load(std::memory_order_relaxed) -
+           top.load(std::memory_order_relaxed) <= 0;
+  }
+
+  // Returns roughly how many elements are in the deque. Like `empty()`, it
+  // may be out of date.
+  std::int64_t size() const {
+    std::int64_t size = bottom.load(std::memory_order_relaxed) -
+                        top.load(std::memory_order_relaxed);
+    return size > 0 ? size : 0;
+  }
+
+ private:
+  static const std::int64_t INITIAL_CAPACITY = 256;
+
+  // Circular buffer. Its capacity is a power of two.
+  struct Array {
+    explicit Array(std::int64_t capacity)
+        : capacity(capacity), elements(new std::atomic<T*>[capacity]) {}
+
+    T* get(std::int64_t i) const {
+      return elements[i & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+    void put(std::int64_t i, T* element) {
+      elements[i & (capacity - 1)].store(element, std::memory_order_relaxed);
+    }
+
+    const std::int64_t capacity;
+    std::unique_ptr<std::atomic<T*>[]> elements;
+  };
+
+  // Replaces the array with one twice as big. Thieves may still be reading
+  // the old array, so it's kept until the deque is destroyed.
+  Array* grow(Array* old_array, std::int64_t b, std::int64_t t) {
+    arrays.emplace_back(new Array(old_array->capacity * 2));
+    Array* new_array = arrays.back().get();
+    for (std::int64_t i = t; i < b; ++i)
+      new_array->put(i, old_array->get(i));
+    array.store(new_array, std::memory_order_release);
+    return new_array;
+  }
+
+  // The indexes are padded onto separate cache lines, since the owner writes
+  // `bottom` and thieves write `top`. (`alignas` isn't honored by `new`
+  // before C++17.)
+  std::atomic<std::int64_t> top{0};
+  char top_padding[64 - sizeof(std::atomic<std::int64_t>)];
+  std::atomic<std::int64_t> bottom{0};
+  char bottom_padding[64 - sizeof(std::atomic<std::int64_t>)];
+  std::atomic<Array*> array{nullptr};
+  std::vector<std::unique_ptr<Array>> arrays;  // Only used by the owner.
+};
+
+#endif  // LUMEE_WORK_STEALING_DEQUE_H